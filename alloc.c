@@ -0,0 +1,811 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <linux/bitmap.h>
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/percpu_counter.h>
+#include <linux/random.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+#include "amnesiafs.h"
+
+#include "alloc.h"
+#include "journal.h"
+#include "log.h"
+#include "super.h"
+
+/*
+ * The volume is split into block groups, one for each bitmap block, and
+ * each group gets an equal slice of the inode table. A group's bits in the
+ * bitmap are under its own lock, so allocations in different groups don't
+ * contend. Placement follows the Orlov allocator: new top-level directories
+ * go to the least crowded of the roomier groups, while everything else
+ * starts in its parent's group, and file data starts in its inode's.
+ *
+ * Freed blocks are cleared in the bitmap blocks logged by the freeing
+ * transaction, but stay busy, set in the in-memory bitmap, until that
+ * transaction has committed, like ext4's busy extents. Until then the
+ * extents pointing at them are still what a crash would come back to, so
+ * the blocks mustn't be handed out and written over.
+ *
+ * The other way round, blocks taken to replace ones that already hold data
+ * are staged: set in the in-memory bitmap, but free in every bitmap block
+ * logged, until the transaction that points the file at them, once they've
+ * been written, commits them. A crash before that finds the file as it was,
+ * and the blocks free.
+ */
+
+struct amnesiafs_busy {
+	/* on its group's busy list */
+	struct list_head group_entry;
+	/* on sbi->busy in commit order, unless it's staged */
+	struct list_head entry;
+	bool staged;
+	uint64_t tid;
+	uint64_t start;
+	unsigned int count;
+};
+
+/*
+ * How far the per-CPU free block count may be off. Allocation decisions
+ * closer than this to running out pay for an exact sum.
+ */
+#define AMNESIAFS_COUNTER_SLACK (4 * percpu_counter_batch * nr_cpu_ids)
+
+/* the group whose inode table slice holds ino */
+static unsigned int amnesiafs_ino_group(struct amnesiafs_sb_info *sbi,
+					uint64_t ino)
+{
+	/* the last group also takes whatever the rounding left over */
+	return min_t(uint64_t, div_u64(ino - 1, sbi->inodes_per_group),
+		     sbi->nr_groups - 1);
+}
+
+/* The slots [*first, *end) of the inode table in group's slice. */
+static void amnesiafs_group_inodes(struct amnesiafs_sb_info *sbi,
+				   unsigned int group, uint64_t *first,
+				   uint64_t *end)
+{
+	*first = min_t(uint64_t, (uint64_t)group * sbi->inodes_per_group,
+		       AMNESIAFS_MAX_INODES);
+	*end = group == sbi->nr_groups - 1 ?
+		       AMNESIAFS_MAX_INODES :
+		       min_t(uint64_t, *first + sbi->inodes_per_group,
+			     AMNESIAFS_MAX_INODES);
+}
+
+/*
+ * Set up the block groups, counting their free blocks from the bitmap, and
+ * their free inodes and directories from the inode table. A slot is in use
+ * if it has an inode number.
+ */
+static int amnesiafs_groups_init(struct super_block *sb)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	uint64_t blocks_count = sbi->disk_sb->blocks_count;
+	struct amnesiafs_inode *raw;
+	struct amnesiafs_group *grp;
+	struct buffer_head *bh;
+	uint64_t start, end, i, slot, used = 0;
+	unsigned int g;
+
+	sbi->nr_groups = DIV_ROUND_UP(blocks_count, AMNESIAFS_GROUP_BLOCKS);
+	sbi->inodes_per_group =
+		max_t(uint64_t, AMNESIAFS_INODES_PER_BLOCK,
+		      rounddown(AMNESIAFS_MAX_INODES / sbi->nr_groups,
+				AMNESIAFS_INODES_PER_BLOCK));
+
+	sbi->groups = kvcalloc(sbi->nr_groups, sizeof(*sbi->groups),
+			       GFP_KERNEL);
+	sbi->inode_bitmap = bitmap_zalloc(AMNESIAFS_MAX_INODES, GFP_KERNEL);
+	if (!sbi->groups || !sbi->inode_bitmap)
+		return -ENOMEM;
+
+	for (g = 0; g < sbi->nr_groups; g++) {
+		grp = &sbi->groups[g];
+		start = (uint64_t)g * AMNESIAFS_GROUP_BLOCKS;
+		end = min_t(uint64_t, start + AMNESIAFS_GROUP_BLOCKS,
+			    blocks_count);
+
+		spin_lock_init(&grp->lock);
+		INIT_LIST_HEAD(&grp->busy);
+		grp->free_blocks = end - start -
+				   bitmap_weight(sbi->bitmap + BIT_WORD(start),
+						 end - start);
+		amnesiafs_group_inodes(sbi, g, &start, &end);
+		grp->free_inodes = end - start;
+	}
+
+	for (i = 0; i < AMNESIAFS_INODE_TABLE_BLOCKS; i++) {
+		bh = sb_bread(sb, AMNESIAFS_INODE_TABLE_BLOCK_NUMBER + i);
+		if (!bh) {
+			amnesiafs_err("reading inode table block %llu failed",
+				      i);
+			return -EIO;
+		}
+
+		raw = (struct amnesiafs_inode *)bh->b_data;
+		for (slot = i * AMNESIAFS_INODES_PER_BLOCK;
+		     slot < (i + 1) * AMNESIAFS_INODES_PER_BLOCK; slot++, raw++) {
+			if (!raw->inode_no)
+				continue;
+
+			grp = &sbi->groups[amnesiafs_ino_group(sbi, slot + 1)];
+			set_bit(slot, sbi->inode_bitmap);
+			grp->free_inodes--;
+			if (S_ISDIR(raw->mode))
+				grp->dirs++;
+			used++;
+		}
+		brelse(bh);
+	}
+
+	if (used != sbi->disk_sb->inodes_count)
+		amnesiafs_err("found %llu inodes in use, super block says %llu",
+			      used, sbi->disk_sb->inodes_count);
+
+	return 0;
+}
+
+int amnesiafs_alloc_init(struct super_block *sb)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	struct amnesiafs_super_block *disk_sb = sbi->disk_sb;
+	struct buffer_head *bh;
+	uint64_t i;
+	int err;
+
+	spin_lock_init(&sbi->busy_lock);
+	INIT_LIST_HEAD(&sbi->busy);
+	sbi->busy_blocks = 0;
+
+	if (disk_sb->bitmap_blocks * AMNESIAFS_BITS_PER_BLOCK <
+	    disk_sb->blocks_count) {
+		amnesiafs_err("bitmap of %llu blocks can't cover %llu blocks",
+			      disk_sb->bitmap_blocks, disk_sb->blocks_count);
+		return -EINVAL;
+	}
+
+	sbi->bitmap = kvzalloc(disk_sb->bitmap_blocks * AMNESIAFS_BLOCKSIZE,
+			       GFP_KERNEL);
+	if (!sbi->bitmap)
+		return -ENOMEM;
+
+	for (i = 0; i < disk_sb->bitmap_blocks; i++) {
+		bh = sb_bread(sb, AMNESIAFS_BITMAP_BLOCK_NUMBER + i);
+		if (!bh) {
+			amnesiafs_err("reading bitmap block %llu failed", i);
+			amnesiafs_alloc_destroy(sb);
+			return -EIO;
+		}
+		memcpy((char *)sbi->bitmap + i * AMNESIAFS_BLOCKSIZE,
+		       bh->b_data, AMNESIAFS_BLOCKSIZE);
+		brelse(bh);
+	}
+
+	sbi->alloc_cursor = disk_sb->refcount_block + disk_sb->refcount_blocks;
+
+	err = amnesiafs_groups_init(sb);
+	if (err)
+		goto out_free;
+
+	err = -ENOMEM;
+	if (percpu_counter_init(&sbi->free_blocks, disk_sb->blocks_available,
+				GFP_KERNEL))
+		goto out_free;
+	if (percpu_counter_init(&sbi->free_inodes,
+				AMNESIAFS_MAX_INODES - disk_sb->inodes_count,
+				GFP_KERNEL)) {
+		percpu_counter_destroy(&sbi->free_blocks);
+		goto out_free;
+	}
+
+	return 0;
+
+out_free:
+	bitmap_free(sbi->inode_bitmap);
+	sbi->inode_bitmap = NULL;
+	kvfree(sbi->groups);
+	sbi->groups = NULL;
+	kvfree(sbi->bitmap);
+	sbi->bitmap = NULL;
+	return err;
+}
+
+void amnesiafs_alloc_destroy(struct super_block *sb)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	struct amnesiafs_busy *busy, *next;
+	unsigned int g;
+
+	/* only left over if the journal aborted */
+	for (g = 0; sbi->groups && g < sbi->nr_groups; g++)
+		list_for_each_entry_safe(busy, next, &sbi->groups[g].busy,
+					 group_entry)
+			kfree(busy);
+	INIT_LIST_HEAD(&sbi->busy);
+
+	percpu_counter_destroy(&sbi->free_inodes);
+	percpu_counter_destroy(&sbi->free_blocks);
+	bitmap_free(sbi->inode_bitmap);
+	sbi->inode_bitmap = NULL;
+	kvfree(sbi->groups);
+	sbi->groups = NULL;
+	kvfree(sbi->bitmap);
+	sbi->bitmap = NULL;
+}
+
+/*
+ * Fold the free block count into the on-disk super block. Called by the
+ * journal as it commits, with every handle closed, so the count matches the
+ * bitmap blocks going out alongside it, where busy blocks are free.
+ */
+void amnesiafs_alloc_sync_counters(struct super_block *sb)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	uint64_t busy_blocks;
+
+	spin_lock(&sbi->busy_lock);
+	busy_blocks = sbi->busy_blocks;
+	spin_unlock(&sbi->busy_lock);
+
+	sbi->disk_sb->blocks_available =
+		percpu_counter_sum_positive(&sbi->free_blocks) + busy_blocks;
+}
+
+/*
+ * Hand the blocks freed by transactions up to and including tid back to the
+ * allocator, now that they're committed. Called by the journal, under its
+ * commit_mutex.
+ */
+void amnesiafs_alloc_committed(struct super_block *sb, uint64_t tid)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	struct amnesiafs_busy *busy, *next;
+	struct amnesiafs_group *grp;
+	LIST_HEAD(done);
+	uint64_t freed = 0;
+
+	spin_lock(&sbi->busy_lock);
+	list_for_each_entry_safe(busy, next, &sbi->busy, entry) {
+		if (busy->tid > tid)
+			break;
+		list_move_tail(&busy->entry, &done);
+		sbi->busy_blocks -= busy->count;
+	}
+	spin_unlock(&sbi->busy_lock);
+
+	list_for_each_entry_safe(busy, next, &done, entry) {
+		grp = &sbi->groups[div_u64(busy->start,
+					   AMNESIAFS_GROUP_BLOCKS)];
+		spin_lock(&grp->lock);
+		list_del(&busy->group_entry);
+		bitmap_clear(sbi->bitmap, busy->start, busy->count);
+		grp->free_blocks += busy->count;
+		spin_unlock(&grp->lock);
+
+		freed += busy->count;
+		kfree(busy);
+	}
+
+	if (freed) {
+		spin_lock(&sbi->bitmap_lock);
+		percpu_counter_add(&sbi->free_blocks, freed);
+		spin_unlock(&sbi->bitmap_lock);
+	}
+}
+
+/*
+ * Are there count free blocks beyond those already reserved? The caller
+ * holds bitmap_lock, which every update of free_blocks is made under.
+ */
+static bool amnesiafs_has_free_blocks(struct amnesiafs_sb_info *sbi,
+				      uint64_t count)
+{
+	uint64_t needed = count + sbi->reserved_blocks;
+
+	if (percpu_counter_read_positive(&sbi->free_blocks) >=
+	    needed + AMNESIAFS_COUNTER_SLACK)
+		return true;
+	return percpu_counter_sum_positive(&sbi->free_blocks) >= needed;
+}
+
+/*
+ * Log the bitmap blocks covering [start, start + count). The copy is taken
+ * under the group's lock, so it may also carry bits from allocations running in
+ * parallel; those are logged again by their own callers. Busy blocks go out
+ * as free. The caller must hold a journal handle.
+ */
+static int amnesiafs_bitmap_sync(struct super_block *sb, uint64_t start,
+				 unsigned int count)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	struct amnesiafs_busy *busy;
+	struct buffer_head *bh;
+	uint64_t first = start / AMNESIAFS_BITS_PER_BLOCK;
+	uint64_t last = (start + count - 1) / AMNESIAFS_BITS_PER_BLOCK;
+	uint64_t i;
+
+	for (i = first; i <= last; i++) {
+		bh = sb_bread(sb, AMNESIAFS_BITMAP_BLOCK_NUMBER + i);
+		if (!bh) {
+			amnesiafs_err("reading bitmap block %llu failed", i);
+			return -EIO;
+		}
+
+		/* bitmap block i is group i's */
+		lock_buffer(bh);
+		spin_lock(&sbi->groups[i].lock);
+		memcpy(bh->b_data, (char *)sbi->bitmap + i * AMNESIAFS_BLOCKSIZE,
+		       AMNESIAFS_BLOCKSIZE);
+		list_for_each_entry(busy, &sbi->groups[i].busy, group_entry)
+			bitmap_clear((unsigned long *)bh->b_data,
+				     busy->start - i * AMNESIAFS_BITS_PER_BLOCK,
+				     busy->count);
+		spin_unlock(&sbi->groups[i].lock);
+		unlock_buffer(bh);
+
+		amnesiafs_journal_dirty(sb, bh);
+		brelse(bh);
+	}
+
+	amnesiafs_sync_super(sb);
+
+	return 0;
+}
+
+/*
+ * Pick a group for a new top-level directory: of the groups with at least
+ * the average number of free inodes and blocks, the one with the fewest
+ * directories. The search starts somewhere random so that ties spread out.
+ * Returns -1 if no group qualifies.
+ */
+static int amnesiafs_find_group_orlov(struct amnesiafs_sb_info *sbi)
+{
+	unsigned int n = sbi->nr_groups, g, i, start = prandom_u32_max(n);
+	uint64_t avg_inodes = 0, avg_blocks = 0;
+	int best = -1;
+
+	for (g = 0; g < n; g++) {
+		avg_inodes += sbi->groups[g].free_inodes;
+		avg_blocks += READ_ONCE(sbi->groups[g].free_blocks);
+	}
+	avg_inodes = div_u64(avg_inodes, n);
+	avg_blocks = div_u64(avg_blocks, n);
+
+	for (i = 0; i < n; i++) {
+		struct amnesiafs_group *grp;
+
+		g = (start + i) % n;
+		grp = &sbi->groups[g];
+		if (!grp->free_inodes || grp->free_inodes < avg_inodes ||
+		    READ_ONCE(grp->free_blocks) < avg_blocks)
+			continue;
+		if (best < 0 || grp->dirs < sbi->groups[best].dirs)
+			best = g;
+	}
+
+	return best;
+}
+
+/*
+ * Pick a group for a new inode in dir, or -1 if the inode table is full.
+ * The caller holds inode_lock.
+ */
+static int amnesiafs_find_group(struct amnesiafs_sb_info *sbi,
+				struct inode *dir, umode_t mode)
+{
+	unsigned int parent = amnesiafs_ino_group(sbi, dir->i_ino);
+	unsigned int i, g;
+	int group;
+
+	if (S_ISDIR(mode) && dir->i_ino == AMNESIAFS_ROOT_INODE_NUMBER) {
+		group = amnesiafs_find_group_orlov(sbi);
+		if (group >= 0)
+			return group;
+	}
+
+	/* near the parent, preferably somewhere with blocks to spare */
+	for (i = 0; i < sbi->nr_groups; i++) {
+		g = (parent + i) % sbi->nr_groups;
+		if (sbi->groups[g].free_inodes &&
+		    READ_ONCE(sbi->groups[g].free_blocks))
+			return g;
+	}
+	for (i = 0; i < sbi->nr_groups; i++) {
+		g = (parent + i) % sbi->nr_groups;
+		if (sbi->groups[g].free_inodes)
+			return g;
+	}
+
+	return -1;
+}
+
+/* Hand out an inode number for a new inode of type mode in dir. */
+int amnesiafs_new_ino(struct super_block *sb, struct inode *dir, umode_t mode,
+		      uint64_t *ino)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	struct amnesiafs_group *grp;
+	uint64_t first, end, slot;
+	int group, err = 0;
+
+	spin_lock(&sbi->inode_lock);
+	group = amnesiafs_find_group(sbi, dir, mode);
+	if (group < 0) {
+		err = -ENOSPC;
+		goto out_unlock;
+	}
+
+	grp = &sbi->groups[group];
+	amnesiafs_group_inodes(sbi, group, &first, &end);
+	slot = find_next_zero_bit(sbi->inode_bitmap, end, first);
+	if (WARN_ON(slot >= end)) {
+		err = -EIO;
+		goto out_unlock;
+	}
+
+	set_bit(slot, sbi->inode_bitmap);
+	grp->free_inodes--;
+	if (S_ISDIR(mode))
+		grp->dirs++;
+	sbi->disk_sb->inodes_count++;
+	/* inode n lives in slot n - 1 of the inode table */
+	*ino = slot + 1;
+
+out_unlock:
+	spin_unlock(&sbi->inode_lock);
+
+	if (!err) {
+		percpu_counter_dec(&sbi->free_inodes);
+		amnesiafs_sync_super(sb);
+	}
+
+	return err;
+}
+
+/*
+ * Give back inode number ino of an inode of type mode that was never linked
+ * in, when creating it fails. The caller must hold a journal handle.
+ */
+void amnesiafs_free_ino(struct super_block *sb, uint64_t ino, umode_t mode)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	struct amnesiafs_group *grp = &sbi->groups[amnesiafs_ino_group(sbi, ino)];
+
+	spin_lock(&sbi->inode_lock);
+	if (WARN_ON(!test_and_clear_bit(ino - 1, sbi->inode_bitmap))) {
+		spin_unlock(&sbi->inode_lock);
+		return;
+	}
+	grp->free_inodes++;
+	if (S_ISDIR(mode))
+		grp->dirs--;
+	sbi->disk_sb->inodes_count--;
+	spin_unlock(&sbi->inode_lock);
+
+	percpu_counter_inc(&sbi->free_inodes);
+	amnesiafs_sync_super(sb);
+}
+
+/* Where data for inode ino should go: the start of its group. */
+uint64_t amnesiafs_inode_goal(struct super_block *sb, uint64_t ino)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+
+	return (uint64_t)amnesiafs_ino_group(sbi, ino) * AMNESIAFS_GROUP_BLOCKS;
+}
+
+/*
+ * Take count contiguous free blocks from group, the first run from goal on
+ * if goal is in there, otherwise the first from the start of the group.
+ * Runs never cross into the next group, whose bits are under another lock.
+ * If staged is given, the run goes on the group's busy list as that, under
+ * the same lock hold, so no bitmap block is ever logged with it set.
+ */
+static bool amnesiafs_group_new_blocks(struct amnesiafs_sb_info *sbi,
+				       unsigned int group, uint64_t goal,
+				       unsigned int count, unsigned long *found,
+				       struct amnesiafs_busy *staged)
+{
+	struct amnesiafs_group *grp = &sbi->groups[group];
+	unsigned long start = (unsigned long)group * AMNESIAFS_GROUP_BLOCKS;
+	unsigned long end = min_t(uint64_t, start + AMNESIAFS_GROUP_BLOCKS,
+				  sbi->disk_sb->blocks_count);
+	unsigned long pos = end;
+
+	spin_lock(&grp->lock);
+	if (grp->free_blocks < count)
+		goto out_unlock;
+
+	if (goal > start && goal < end)
+		pos = bitmap_find_next_zero_area(sbi->bitmap, end, goal, count,
+						 0);
+	if (pos + count > end)
+		pos = bitmap_find_next_zero_area(sbi->bitmap, end, start,
+						 count, 0);
+	if (pos + count > end)
+		goto out_unlock;
+
+	bitmap_set(sbi->bitmap, pos, count);
+	grp->free_blocks -= count;
+	*found = pos;
+	if (staged) {
+		staged->start = pos;
+		staged->count = count;
+		list_add_tail(&staged->group_entry, &grp->busy);
+	}
+
+out_unlock:
+	spin_unlock(&grp->lock);
+	return pos + count <= end;
+}
+
+/*
+ * Find count contiguous free blocks, starting the search at goal (or where
+ * the last allocation left off) and going on through the following groups,
+ * wrapping around once. The blocks are taken off the free count up front
+ * and given back if no run turns up; the bitmap blocks are written
+ * afterwards, unless the blocks are staged. The first reserved of them come
+ * out of an earlier reservation.
+ */
+static int __amnesiafs_new_blocks(struct super_block *sb, uint64_t goal,
+				  unsigned int count, uint64_t *start,
+				  unsigned int reserved, bool staged)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	struct amnesiafs_super_block *disk_sb = sbi->disk_sb;
+	struct amnesiafs_busy *busy = NULL;
+	unsigned long found;
+	unsigned int group, i;
+
+	if (staged) {
+		busy = kmalloc(sizeof(*busy), GFP_NOFS | __GFP_NOFAIL);
+		busy->staged = true;
+		INIT_LIST_HEAD(&busy->entry);
+		/* free on disk throughout, for the committed free count */
+		spin_lock(&sbi->busy_lock);
+		sbi->busy_blocks += count;
+		spin_unlock(&sbi->busy_lock);
+	}
+
+	spin_lock(&sbi->bitmap_lock);
+	if (WARN_ON(sbi->reserved_blocks < reserved))
+		goto out_nospc;
+	if (count > reserved &&
+	    !amnesiafs_has_free_blocks(sbi, count - reserved))
+		goto out_nospc;
+	sbi->reserved_blocks -= reserved;
+	percpu_counter_sub(&sbi->free_blocks, count);
+	spin_unlock(&sbi->bitmap_lock);
+
+	if (!goal || goal >= disk_sb->blocks_count)
+		goal = READ_ONCE(sbi->alloc_cursor);
+
+	group = div_u64(goal, AMNESIAFS_GROUP_BLOCKS);
+	for (i = 0; i < sbi->nr_groups; i++) {
+		if (group >= sbi->nr_groups)
+			group = 0;
+		if (amnesiafs_group_new_blocks(sbi, group++, goal, count,
+					       &found, busy))
+			goto out_found;
+	}
+
+	spin_lock(&sbi->bitmap_lock);
+	percpu_counter_add(&sbi->free_blocks, count);
+	sbi->reserved_blocks += reserved;
+	goto out_nospc;
+
+out_found:
+	WRITE_ONCE(sbi->alloc_cursor, found + count);
+
+	amnesiafs_debug("allocated %u blocks at %lu", count, found);
+
+	*start = found;
+	if (staged)
+		return 0;
+	return amnesiafs_bitmap_sync(sb, found, count);
+
+out_nospc:
+	spin_unlock(&sbi->bitmap_lock);
+	if (busy) {
+		spin_lock(&sbi->busy_lock);
+		sbi->busy_blocks -= count;
+		spin_unlock(&sbi->busy_lock);
+		kfree(busy);
+	}
+	return -ENOSPC;
+}
+
+int amnesiafs_new_blocks(struct super_block *sb, uint64_t goal,
+			 unsigned int count, uint64_t *start)
+{
+	return __amnesiafs_new_blocks(sb, goal, count, start, 0, false);
+}
+
+/*
+ * Turn count blocks of an earlier amnesiafs_reserve_blocks() into real ones,
+ * followed in the same run by ahead more that weren't reserved. This can
+ * still fail with -ENOSPC if there's no contiguous run that long, in which
+ * case the reservation is left alone.
+ */
+int amnesiafs_claim_blocks(struct super_block *sb, uint64_t goal,
+			   unsigned int count, unsigned int ahead,
+			   uint64_t *start)
+{
+	return __amnesiafs_new_blocks(sb, goal, count + ahead, start, count,
+				      false);
+}
+
+/*
+ * As amnesiafs_claim_blocks(), but the blocks are only staged: nothing is
+ * logged, and they stay free on disk until amnesiafs_stage_commit(), or go
+ * back with amnesiafs_stage_cancel(). Needs no journal handle.
+ */
+int amnesiafs_stage_blocks(struct super_block *sb, uint64_t goal,
+			   unsigned int count, unsigned int ahead,
+			   uint64_t *start)
+{
+	return __amnesiafs_new_blocks(sb, goal, count + ahead, start, count,
+				      true);
+}
+
+/* Take the staged run at start off its group's busy list. */
+static struct amnesiafs_busy *amnesiafs_unstage(struct amnesiafs_sb_info *sbi,
+						 uint64_t start)
+{
+	struct amnesiafs_group *grp =
+		&sbi->groups[div_u64(start, AMNESIAFS_GROUP_BLOCKS)];
+	struct amnesiafs_busy *busy;
+
+	spin_lock(&grp->lock);
+	list_for_each_entry(busy, &grp->busy, group_entry) {
+		if (busy->staged && busy->start == start) {
+			list_del(&busy->group_entry);
+			spin_unlock(&grp->lock);
+			return busy;
+		}
+	}
+	spin_unlock(&grp->lock);
+
+	WARN(1, "no staged blocks at %llu", start);
+	return NULL;
+}
+
+/*
+ * Log the count staged blocks at start as allocated, in the transaction that
+ * maps them. The caller must hold a journal handle.
+ */
+void amnesiafs_stage_commit(struct super_block *sb, uint64_t start,
+			    unsigned int count)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	struct amnesiafs_busy *busy = amnesiafs_unstage(sbi, start);
+
+	if (!busy)
+		return;
+
+	spin_lock(&sbi->busy_lock);
+	sbi->busy_blocks -= busy->count;
+	spin_unlock(&sbi->busy_lock);
+	kfree(busy);
+
+	if (amnesiafs_bitmap_sync(sb, start, count))
+		amnesiafs_err("failed to allocate %u blocks at %llu", count,
+			      start);
+}
+
+/*
+ * Give back the count staged blocks at start, which were never logged, and
+ * so are free straight away; reserved of them go back into the reservation
+ * they were staged from.
+ */
+void amnesiafs_stage_cancel(struct super_block *sb, uint64_t start,
+			    unsigned int count, unsigned int reserved)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	struct amnesiafs_busy *busy = amnesiafs_unstage(sbi, start);
+	struct amnesiafs_group *grp =
+		&sbi->groups[div_u64(start, AMNESIAFS_GROUP_BLOCKS)];
+
+	if (!busy)
+		return;
+
+	spin_lock(&grp->lock);
+	bitmap_clear(sbi->bitmap, start, count);
+	grp->free_blocks += count;
+	spin_unlock(&grp->lock);
+
+	spin_lock(&sbi->busy_lock);
+	sbi->busy_blocks -= busy->count;
+	spin_unlock(&sbi->busy_lock);
+	kfree(busy);
+
+	spin_lock(&sbi->bitmap_lock);
+	percpu_counter_add(&sbi->free_blocks, count);
+	sbi->reserved_blocks += reserved;
+	spin_unlock(&sbi->bitmap_lock);
+}
+
+/*
+ * Set aside count blocks without choosing which ones, so that delayed
+ * allocation can't run out of space at writeback.
+ */
+int amnesiafs_reserve_blocks(struct super_block *sb, unsigned int count)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	bool forced = false;
+	int err;
+
+retry:
+	err = 0;
+	spin_lock(&sbi->bitmap_lock);
+	if (!amnesiafs_has_free_blocks(sbi, count))
+		err = -ENOSPC;
+	else
+		sbi->reserved_blocks += count;
+	spin_unlock(&sbi->bitmap_lock);
+
+	/* busy blocks are free once the transactions that freed them commit */
+	if (err == -ENOSPC && !forced && READ_ONCE(sbi->busy_blocks) &&
+	    !current->journal_info) {
+		forced = true;
+		if (!amnesiafs_journal_force(sb))
+			goto retry;
+	}
+
+	return err;
+}
+
+void amnesiafs_release_blocks(struct super_block *sb, unsigned int count)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+
+	spin_lock(&sbi->bitmap_lock);
+	WARN_ON(sbi->reserved_blocks < count);
+	sbi->reserved_blocks -= count;
+	spin_unlock(&sbi->bitmap_lock);
+}
+
+/*
+ * Free [start, start + count). The blocks stay busy until the caller's
+ * transaction has committed, see amnesiafs_alloc_committed(). The caller
+ * must hold a journal handle.
+ */
+void amnesiafs_free_blocks(struct super_block *sb, uint64_t start,
+			   unsigned int count)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	uint64_t tid = amnesiafs_journal_tid(sb);
+	struct amnesiafs_busy *busy;
+	struct amnesiafs_group *grp;
+	uint64_t pos, next, end = start + count;
+
+	for (pos = start; pos < end; pos = next) {
+		grp = &sbi->groups[div_u64(pos, AMNESIAFS_GROUP_BLOCKS)];
+		next = min(end, round_down(pos, AMNESIAFS_GROUP_BLOCKS) +
+					AMNESIAFS_GROUP_BLOCKS);
+
+		/* as ext4 does for its busy extents, this can't fail */
+		busy = kmalloc(sizeof(*busy), GFP_NOFS | __GFP_NOFAIL);
+		busy->staged = false;
+		busy->tid = tid;
+		busy->start = pos;
+		busy->count = next - pos;
+
+		spin_lock(&grp->lock);
+		list_add_tail(&busy->group_entry, &grp->busy);
+		spin_unlock(&grp->lock);
+
+		spin_lock(&sbi->busy_lock);
+		list_add_tail(&busy->entry, &sbi->busy);
+		sbi->busy_blocks += busy->count;
+		spin_unlock(&sbi->busy_lock);
+	}
+
+	if (amnesiafs_bitmap_sync(sb, start, count))
+		amnesiafs_err("failed to free %u blocks at %llu", count, start);
+}
@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#ifndef AMNESIAFS_ALLOC_H
+#define AMNESIAFS_ALLOC_H
+
+#include <linux/cache.h>
+#include <linux/fs.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+
+/* in-memory state of a block group, see alloc.c */
+struct amnesiafs_group {
+	/* protects the group's part of the bitmap, free_blocks and busy */
+	spinlock_t lock;
+	unsigned int free_blocks;
+	/* runs freed in the group by transactions that haven't committed */
+	struct list_head busy;
+	/* under inode_lock, like the inode bitmap */
+	unsigned int free_inodes;
+	unsigned int dirs;
+} ____cacheline_aligned_in_smp;
+
+int amnesiafs_alloc_init(struct super_block *sb);
+
+void amnesiafs_alloc_destroy(struct super_block *sb);
+
+void amnesiafs_alloc_sync_counters(struct super_block *sb);
+
+void amnesiafs_alloc_committed(struct super_block *sb, uint64_t tid);
+
+int amnesiafs_new_ino(struct super_block *sb, struct inode *dir, umode_t mode,
+		      uint64_t *ino);
+
+void amnesiafs_free_ino(struct super_block *sb, uint64_t ino, umode_t mode);
+
+uint64_t amnesiafs_inode_goal(struct super_block *sb, uint64_t ino);
+
+int amnesiafs_new_blocks(struct super_block *sb, uint64_t goal,
+			 unsigned int count, uint64_t *start);
+
+int amnesiafs_claim_blocks(struct super_block *sb, uint64_t goal,
+			   unsigned int count, unsigned int ahead,
+			   uint64_t *start);
+
+int amnesiafs_stage_blocks(struct super_block *sb, uint64_t goal,
+			   unsigned int count, unsigned int ahead,
+			   uint64_t *start);
+
+void amnesiafs_stage_commit(struct super_block *sb, uint64_t start,
+			    unsigned int count);
+
+void amnesiafs_stage_cancel(struct super_block *sb, uint64_t start,
+			    unsigned int count, unsigned int reserved);
+
+int amnesiafs_reserve_blocks(struct super_block *sb, unsigned int count);
+
+void amnesiafs_release_blocks(struct super_block *sb, unsigned int count);
+
+void amnesiafs_free_blocks(struct super_block *sb, uint64_t start,
+			   unsigned int count);
+
+#endif
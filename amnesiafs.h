@@ -9,6 +9,91 @@
 
 #define AMNESIAFS_FILENAME_MAX 255
 
+/*
+ * On-disk layout:
+ *
+ *   block 0                  super block
+ *   blocks 1-64              inode table
+ *   block 65                 root directory
+ *   next bitmap_blocks       free block bitmap, one bit per block
+ *   next journal_blocks      metadata journal
+ *   next refcount_blocks     reference counts of shared blocks
+ *   remaining blocks         data
+ */
+#define AMNESIAFS_SUPER_BLOCK_NUMBER 0
+#define AMNESIAFS_INODE_TABLE_BLOCK_NUMBER 1
+#define AMNESIAFS_INODE_TABLE_BLOCKS 64
+#define AMNESIAFS_ROOT_DIR_BLOCK_NUMBER                                        \
+	(AMNESIAFS_INODE_TABLE_BLOCK_NUMBER + AMNESIAFS_INODE_TABLE_BLOCKS)
+#define AMNESIAFS_BITMAP_BLOCK_NUMBER (AMNESIAFS_ROOT_DIR_BLOCK_NUMBER + 1)
+
+#define AMNESIAFS_ROOT_INODE_NUMBER 1
+
+#define AMNESIAFS_BITS_PER_BLOCK (AMNESIAFS_BLOCKSIZE * 8)
+
+/*
+ * A block group is the run of blocks one bitmap block covers. The inode
+ * table is shared out between the groups in equal slices, so that related
+ * inodes end up in the same table blocks, next to their data.
+ */
+#define AMNESIAFS_GROUP_BLOCKS AMNESIAFS_BITS_PER_BLOCK
+
+#define AMNESIAFS_JOURNAL_DESCRIPTOR_MAGIC 0x6a6e6c64
+#define AMNESIAFS_JOURNAL_COMMIT_MAGIC 0x6a6e6c63
+
+/* most metadata blocks a single transaction can carry */
+#define AMNESIAFS_JOURNAL_MAX_TRANSACTION 128
+
+/* descriptor, the logged blocks, then the commit block */
+#define AMNESIAFS_JOURNAL_BLOCKS (AMNESIAFS_JOURNAL_MAX_TRANSACTION + 2)
+
+#define AMNESIAFS_REFCOUNT_BLOCKS 16
+
+/*
+ * A volume can span up to AMNESIAFS_MAX_DEVICES block devices. Everything
+ * below data_start lives on the first device, as on a single-device volume;
+ * above it, the volume's blocks are striped across all of them in runs of
+ * stripe_blocks. Each device keeps its part of the stripes from data_start
+ * onwards, so the start of every other device holds just a member header.
+ */
+#define AMNESIAFS_MAX_DEVICES 8
+#define AMNESIAFS_DEFAULT_STRIPE_BLOCKS 64
+#define AMNESIAFS_MEMBER_MAGIC 0x616d6e6d
+
+struct amnesiafs_device {
+	/* size of the device in blocks, when the volume was made */
+	uint64_t blocks;
+	uint64_t reserved;
+};
+
+/* block 0 of every device but the first */
+struct amnesiafs_member_header {
+	uint64_t magic;
+	uint8_t volume_uuid[16];
+	/* where the device goes in the super block's device table */
+	uint64_t index;
+	uint8_t padding[4064];
+};
+
+/*
+ * The super block, the inodes in use and directory blocks carry crc32c
+ * checksums, which are checked when they're read. Volumes made before
+ * checksums existed don't have this, and are only checksummed as they're
+ * written.
+ */
+#define AMNESIAFS_FEATURE_CSUM 0x1
+/*
+ * File data is encrypted with blk-crypto, so the volume can only be mounted
+ * with inlinecrypt. Set by the first such mount, which has to find the
+ * volume without any files yet.
+ */
+#define AMNESIAFS_FEATURE_INLINE_CRYPT 0x2
+/*
+ * Directory records hold encrypted names along with a keyed hash of each,
+ * see names.c. Set by mkfs; older volumes keep plaintext names.
+ */
+#define AMNESIAFS_FEATURE_ENCRYPTED_NAMES 0x4
+
 struct amnesiafs_super_block {
 	uint64_t magic;
 	uint64_t version;
@@ -18,26 +103,221 @@ struct amnesiafs_super_block {
 	uint64_t inodes_count;
 	uint64_t blocks_available;
 
-	uint8_t padding[4048];
+	/* total size of the volume in blocks */
+	uint64_t blocks_count;
+	/* number of blocks used by the free block bitmap */
+	uint64_t bitmap_blocks;
+
+	uint64_t journal_block;
+	uint64_t journal_blocks;
+	/* last transaction whose blocks are all written in place */
+	uint64_t journal_sequence;
+
+	uint64_t refcount_block;
+	uint64_t refcount_blocks;
+	/* number of entries in use in the refcount table */
+	uint64_t refcount_count;
+
+	uint8_t volume_uuid[16];
+	uint64_t nr_devices;
+	uint64_t stripe_blocks;
+	/* the first block that's striped */
+	uint64_t data_start;
+	struct amnesiafs_device devices[AMNESIAFS_MAX_DEVICES];
+
+	/* AMNESIAFS_FEATURE_* */
+	uint64_t features;
+	/* see AMNESIAFS_FEATURE_CSUM */
+	uint32_t checksum;
+	uint32_t reserved;
+
+	uint8_t padding[3800];
+};
+
+/*
+ * A run of len file blocks starting at logical, stored at physical onwards.
+ * Extents never overlap and are kept sorted by logical block; anything not
+ * covered by one is a hole.
+ */
+struct amnesiafs_extent {
+	uint64_t logical;
+	uint64_t physical;
+	uint32_t len;
+	uint32_t flags;
+};
+
+/*
+ * Blocks reserved by a buffered write but not yet allocated. Only ever set
+ * in memory: allocation happens at writeback and such extents are never
+ * written to disk.
+ */
+#define AMNESIAFS_EXTENT_DELALLOC 0x1
+
+/*
+ * Allocated but not written to yet, so it reads as zeros: by fallocate(),
+ * or by writeback, until the data it's writing there is on disk.
+ */
+#define AMNESIAFS_EXTENT_UNWRITTEN 0x2
+
+/*
+ * Some of the blocks may also belong to another extent, through a reflink.
+ * Any extent referring to a block with a refcount table entry has this set;
+ * it can outlive the sharing, so the table has the final say.
+ */
+#define AMNESIAFS_EXTENT_SHARED 0x4
+
+/*
+ * The extent is a compression cluster: its len blocks are stored compressed
+ * in fewer blocks from physical onwards, starting with a struct
+ * amnesiafs_compress_header. The algorithm and the number of blocks stored
+ * live in the upper bits of flags. Compressed extents never merge and only
+ * ever shrink from the end, or go away whole.
+ */
+#define AMNESIAFS_EXTENT_COMPRESSED 0x8
+#define AMNESIAFS_EXTENT_ALGO(flags) (((flags) >> 8) & 0xff)
+#define AMNESIAFS_EXTENT_STORED(flags) ((flags) >> 16)
+#define AMNESIAFS_EXTENT_COMPRESSION(algo, stored)                             \
+	(AMNESIAFS_EXTENT_COMPRESSED | (algo) << 8 | (stored) << 16)
+
+#define AMNESIAFS_COMPRESS_NONE 0
+#define AMNESIAFS_COMPRESS_LZ4 1
+#define AMNESIAFS_COMPRESS_ZSTD 2
+#define AMNESIAFS_COMPRESS_MAX 3
+
+/* compression works on aligned runs of this many blocks */
+#define AMNESIAFS_CLUSTER_BLOCKS 16
+
+struct amnesiafs_compress_header {
+	/* bytes of compressed data following the header */
+	uint32_t len;
+	uint32_t reserved;
+};
+
+/*
+ * count references to blocks start to start + len - 1. Blocks without an
+ * entry in the refcount table have a single owner; entries are sorted and
+ * never overlap.
+ */
+struct amnesiafs_refcount {
+	uint64_t start;
+	uint32_t len;
+	uint32_t count;
 };
 
+#define AMNESIAFS_INODE_EXTENTS 8
+
+/*
+ * The file's contents are kept in the inode in place of its extents, so
+ * reading it needs nothing past the inode table. Only set while the file
+ * fits in AMNESIAFS_INLINE_DATA_MAX bytes.
+ */
+#define AMNESIAFS_INODE_INLINE_DATA 0x1
+
+/*
+ * The file's blocks from reclaim_from on are waiting to be freed in the
+ * background, see reclaim.c.
+ */
+#define AMNESIAFS_INODE_RECLAIM 0x2
+
 struct amnesiafs_inode {
 	mode_t mode;
+	uint32_t flags;
 	uint64_t inode_no;
+	/* directory contents, unused for regular files */
 	uint64_t data_block_number;
 
 	union {
 		uint64_t file_size;
 		uint64_t dir_children_count;
 	};
+
+	/* holds the extents that don't fit in the inode, 0 if there's none */
+	uint64_t extent_block;
+	uint32_t nr_extents;
+	uint32_t reserved;
+	union {
+		struct amnesiafs_extent extents[AMNESIAFS_INODE_EXTENTS];
+		uint8_t inline_data[AMNESIAFS_INODE_EXTENTS *
+				    sizeof(struct amnesiafs_extent)];
+	};
+
+	/* only meaningful with AMNESIAFS_INODE_RECLAIM */
+	uint64_t reclaim_from;
+	uint32_t checksum;
+	uint8_t padding[4];
 };
 
+/*
+ * Used for both the descriptor block at the start of the journal and the
+ * commit block after the logged blocks; the commit block only fills in magic
+ * and sequence.
+ */
+struct amnesiafs_journal_header {
+	uint64_t magic;
+	uint64_t sequence;
+	uint64_t nr_blocks;
+	/* where each logged block belongs */
+	uint64_t blocks[AMNESIAFS_JOURNAL_MAX_TRANSACTION];
+};
+
+/* the longest encrypted name, padding included */
+#define AMNESIAFS_ENCRYPTED_NAME_MAX (AMNESIAFS_FILENAME_MAX - 9)
+
 struct amnesiafs_dir_record {
-	char filename[AMNESIAFS_FILENAME_MAX];
+	union {
+		/* NUL-terminated, unless it fills the field */
+		char filename[AMNESIAFS_FILENAME_MAX];
+		/* with AMNESIAFS_FEATURE_ENCRYPTED_NAMES */
+		struct {
+			uint64_t name_hash;
+			/* of the ciphertext, which is padded */
+			uint8_t name_len;
+			uint8_t name[AMNESIAFS_ENCRYPTED_NAME_MAX];
+		};
+	};
 	uint64_t inode_no;
 };
 
+#define AMNESIAFS_INODES_PER_BLOCK                                             \
+	(AMNESIAFS_BLOCKSIZE / sizeof(struct amnesiafs_inode))
+
+#define AMNESIAFS_MAX_INODES                                                   \
+	(AMNESIAFS_INODE_TABLE_BLOCKS * AMNESIAFS_INODES_PER_BLOCK)
+
+#define AMNESIAFS_INLINE_DATA_MAX                                              \
+	sizeof(((struct amnesiafs_inode *)0)->inline_data)
+
+#define AMNESIAFS_EXTENTS_PER_BLOCK                                            \
+	(AMNESIAFS_BLOCKSIZE / sizeof(struct amnesiafs_extent))
+
+#define AMNESIAFS_MAX_EXTENTS                                                  \
+	(AMNESIAFS_INODE_EXTENTS + AMNESIAFS_EXTENTS_PER_BLOCK)
+
+#define AMNESIAFS_REFCOUNTS_PER_BLOCK                                          \
+	(AMNESIAFS_BLOCKSIZE / sizeof(struct amnesiafs_refcount))
+
+#define AMNESIAFS_MAX_REFCOUNTS                                                \
+	(AMNESIAFS_REFCOUNT_BLOCKS * AMNESIAFS_REFCOUNTS_PER_BLOCK)
+
+/* the last bytes of a directory block hold its checksum */
+#define AMNESIAFS_DIR_CHECKSUM_OFFSET (AMNESIAFS_BLOCKSIZE - sizeof(uint32_t))
+
+#define AMNESIAFS_DIR_RECORDS_PER_BLOCK                                        \
+	(AMNESIAFS_DIR_CHECKSUM_OFFSET / sizeof(struct amnesiafs_dir_record))
+
 _Static_assert(sizeof(struct amnesiafs_super_block) == AMNESIAFS_BLOCKSIZE,
 	       "amnesiafs_super_block must remain the same size");
 
+_Static_assert(sizeof(struct amnesiafs_member_header) == AMNESIAFS_BLOCKSIZE,
+	       "amnesiafs_member_header must fill a block");
+
+_Static_assert(sizeof(struct amnesiafs_inode) == 256,
+	       "amnesiafs_inode must remain the same size");
+
+_Static_assert(sizeof(struct amnesiafs_dir_record) == 264,
+	       "amnesiafs_dir_record must remain the same size");
+
+_Static_assert(sizeof(struct amnesiafs_journal_header) <= AMNESIAFS_BLOCKSIZE,
+	       "amnesiafs_journal_header must fit in a block");
+
 #endif
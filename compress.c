@@ -0,0 +1,318 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <linux/crypto.h>
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/wait.h>
+
+#include "amnesiafs.h"
+
+#include "compress.h"
+#include "log.h"
+#include "super.h"
+
+/*
+ * Clusters are compressed through the crypto API's compression transforms.
+ * A transform can only work on one cluster at a time, so each algorithm has
+ * a pool of them, much like btrfs's compression workspaces: a caller takes
+ * an idle one, loads a new one if there are fewer than there are CPUs, or
+ * else waits for one to come back. Transforms are only loaded the first
+ * time their algorithm is needed, which for reading can be long after the
+ * mount that wrote the data.
+ *
+ * Some transforms carry large workspaces (zstd's runs to megabytes), so they
+ * don't stay loaded for the life of the mount. A shrinker frees idle ones
+ * under memory pressure, giving each pool that's been used since the last
+ * scan a second chance, so the least recently used go first.
+ */
+
+struct amnesiafs_compress_pool {
+	spinlock_t lock;
+	/* idle transforms, most recently used first */
+	struct list_head idle;
+	unsigned int nr_idle;
+	/* idle or in use */
+	unsigned int total;
+	/* used since the shrinker last looked */
+	bool referenced;
+	/* callers waiting for a transform to come back */
+	wait_queue_head_t wait;
+};
+
+struct amnesiafs_compress_ws {
+	struct list_head entry;
+	struct crypto_comp *tfm;
+};
+
+static const char *const amnesiafs_compress_names[AMNESIAFS_COMPRESS_MAX] = {
+	[AMNESIAFS_COMPRESS_LZ4] = "lz4",
+	[AMNESIAFS_COMPRESS_ZSTD] = "zstd",
+};
+
+static struct amnesiafs_compress_ws *amnesiafs_compress_load(unsigned int algo)
+{
+	struct amnesiafs_compress_ws *ws;
+	long err;
+
+	ws = kmalloc(sizeof(*ws), GFP_NOFS);
+	if (!ws)
+		return ERR_PTR(-ENOMEM);
+
+	ws->tfm = crypto_alloc_comp(amnesiafs_compress_names[algo], 0, 0);
+	if (IS_ERR(ws->tfm)) {
+		err = PTR_ERR(ws->tfm);
+		amnesiafs_err("can't load %s: %ld",
+			      amnesiafs_compress_names[algo], err);
+		kfree(ws);
+		return ERR_PTR(err);
+	}
+
+	return ws;
+}
+
+static void amnesiafs_compress_free(struct amnesiafs_compress_ws *ws)
+{
+	crypto_free_comp(ws->tfm);
+	kfree(ws);
+}
+
+/* Take a transform for algo, to be given back with amnesiafs_compress_put. */
+static struct amnesiafs_compress_ws *
+amnesiafs_compress_get(struct super_block *sb, unsigned int algo)
+{
+	struct amnesiafs_compress_pool *pool;
+	struct amnesiafs_compress_ws *ws;
+	bool load;
+
+	if (algo >= AMNESIAFS_COMPRESS_MAX || !amnesiafs_compress_names[algo]) {
+		amnesiafs_err("unknown compression algorithm %u", algo);
+		return ERR_PTR(-EIO);
+	}
+
+	pool = &AMNESIAFS_SB(sb)->compress_pools[algo];
+	for (;;) {
+		spin_lock(&pool->lock);
+		pool->referenced = true;
+		ws = list_first_entry_or_null(&pool->idle,
+					      struct amnesiafs_compress_ws,
+					      entry);
+		if (ws) {
+			list_del(&ws->entry);
+			pool->nr_idle--;
+			spin_unlock(&pool->lock);
+			return ws;
+		}
+		load = pool->total < num_online_cpus();
+		if (load)
+			pool->total++;
+		spin_unlock(&pool->lock);
+
+		if (load) {
+			ws = amnesiafs_compress_load(algo);
+			if (!IS_ERR(ws))
+				return ws;
+
+			spin_lock(&pool->lock);
+			pool->total--;
+			load = pool->total;
+			spin_unlock(&pool->lock);
+			/* with none to wait for, there's nothing else to try */
+			if (!load)
+				return ws;
+		}
+
+		wait_event(pool->wait, READ_ONCE(pool->nr_idle) ||
+					       READ_ONCE(pool->total) <
+						       num_online_cpus());
+	}
+}
+
+static void amnesiafs_compress_put(struct super_block *sb, unsigned int algo,
+				   struct amnesiafs_compress_ws *ws)
+{
+	struct amnesiafs_compress_pool *pool =
+		&AMNESIAFS_SB(sb)->compress_pools[algo];
+
+	spin_lock(&pool->lock);
+	list_add(&ws->entry, &pool->idle);
+	pool->nr_idle++;
+	spin_unlock(&pool->lock);
+
+	wake_up(&pool->wait);
+}
+
+/*
+ * Compress len bytes from src into dst, which has room for len bytes, header
+ * included. Returns the size of the result, or -E2BIG if it doesn't fit.
+ */
+int amnesiafs_compress(struct super_block *sb, unsigned int algo,
+		       const void *src, unsigned int len, void *dst)
+{
+	struct amnesiafs_compress_header *hdr = dst;
+	struct amnesiafs_compress_ws *ws;
+	unsigned int dlen = len - sizeof(*hdr);
+	int err;
+
+	ws = amnesiafs_compress_get(sb, algo);
+	if (IS_ERR(ws))
+		return PTR_ERR(ws);
+
+	err = crypto_comp_compress(ws->tfm, src, len, (u8 *)(hdr + 1), &dlen);
+	amnesiafs_compress_put(sb, algo, ws);
+	if (err)
+		return -E2BIG;
+
+	hdr->len = dlen;
+	hdr->reserved = 0;
+	return dlen + sizeof(*hdr);
+}
+
+/*
+ * Decompress the src_len bytes at src, as written by amnesiafs_compress,
+ * into len bytes at dst. Anything the data doesn't cover is zeroed.
+ */
+int amnesiafs_decompress(struct super_block *sb, unsigned int algo,
+			 const void *src, unsigned int src_len, void *dst,
+			 unsigned int len)
+{
+	const struct amnesiafs_compress_header *hdr = src;
+	struct amnesiafs_compress_ws *ws;
+	unsigned int dlen = len;
+	int err;
+
+	if (src_len < sizeof(*hdr) || hdr->len > src_len - sizeof(*hdr)) {
+		amnesiafs_err("bad compressed cluster: %u bytes in %u",
+			      hdr->len, src_len);
+		return -EIO;
+	}
+
+	ws = amnesiafs_compress_get(sb, algo);
+	if (IS_ERR(ws))
+		return PTR_ERR(ws);
+
+	err = crypto_comp_decompress(ws->tfm, (const u8 *)(hdr + 1), hdr->len,
+				     dst, &dlen);
+	amnesiafs_compress_put(sb, algo, ws);
+	if (err) {
+		amnesiafs_err("decompressing cluster failed: %d", err);
+		return -EIO;
+	}
+
+	if (dlen < len)
+		memset(dst + dlen, 0, len - dlen);
+	return 0;
+}
+
+static unsigned long amnesiafs_compress_count(struct shrinker *shrink,
+					      struct shrink_control *sc)
+{
+	struct amnesiafs_sb_info *sbi =
+		container_of(shrink, struct amnesiafs_sb_info, compress_shrinker);
+	unsigned long count = 0;
+	unsigned int i;
+
+	for (i = 0; i < AMNESIAFS_COMPRESS_MAX; i++)
+		count += READ_ONCE(sbi->compress_pools[i].nr_idle);
+
+	return count;
+}
+
+static unsigned long amnesiafs_compress_scan(struct shrinker *shrink,
+					     struct shrink_control *sc)
+{
+	struct amnesiafs_sb_info *sbi =
+		container_of(shrink, struct amnesiafs_sb_info, compress_shrinker);
+	struct amnesiafs_compress_pool *pool;
+	struct amnesiafs_compress_ws *ws, *next;
+	unsigned long freed = 0;
+	unsigned int i;
+	LIST_HEAD(dispose);
+
+	for (i = 0; i < AMNESIAFS_COMPRESS_MAX && freed < sc->nr_to_scan; i++) {
+		pool = &sbi->compress_pools[i];
+
+		spin_lock(&pool->lock);
+		if (pool->referenced) {
+			pool->referenced = false;
+			spin_unlock(&pool->lock);
+			continue;
+		}
+		while (pool->nr_idle && freed < sc->nr_to_scan) {
+			/* the least recently used are at the back */
+			ws = list_last_entry(&pool->idle,
+					     struct amnesiafs_compress_ws, entry);
+			list_move(&ws->entry, &dispose);
+			pool->nr_idle--;
+			pool->total--;
+			freed++;
+		}
+		spin_unlock(&pool->lock);
+
+		/* room for a waiter to load one of its own */
+		wake_up(&pool->wait);
+	}
+
+	/* freeing a transform can sleep */
+	list_for_each_entry_safe(ws, next, &dispose, entry)
+		amnesiafs_compress_free(ws);
+
+	return freed;
+}
+
+int amnesiafs_compress_init(struct super_block *sb)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	struct amnesiafs_compress_pool *pool;
+	unsigned int i;
+	int err;
+
+	sbi->compress_pools = kcalloc(AMNESIAFS_COMPRESS_MAX,
+				      sizeof(*sbi->compress_pools), GFP_KERNEL);
+	if (!sbi->compress_pools)
+		return -ENOMEM;
+
+	for (i = 0; i < AMNESIAFS_COMPRESS_MAX; i++) {
+		pool = &sbi->compress_pools[i];
+		spin_lock_init(&pool->lock);
+		INIT_LIST_HEAD(&pool->idle);
+		init_waitqueue_head(&pool->wait);
+	}
+
+	sbi->compress_shrinker.count_objects = amnesiafs_compress_count;
+	sbi->compress_shrinker.scan_objects = amnesiafs_compress_scan;
+	sbi->compress_shrinker.seeks = DEFAULT_SEEKS;
+
+	err = register_shrinker(&sbi->compress_shrinker);
+	if (err) {
+		kfree(sbi->compress_pools);
+		sbi->compress_pools = NULL;
+	}
+	return err;
+}
+
+void amnesiafs_compress_destroy(struct super_block *sb)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	struct amnesiafs_compress_pool *pool;
+	struct amnesiafs_compress_ws *ws, *next;
+	unsigned int i;
+
+	unregister_shrinker(&sbi->compress_shrinker);
+
+	for (i = 0; i < AMNESIAFS_COMPRESS_MAX; i++) {
+		pool = &sbi->compress_pools[i];
+		/* nothing's compressing any more */
+		WARN_ON(pool->nr_idle != pool->total);
+		list_for_each_entry_safe(ws, next, &pool->idle, entry)
+			amnesiafs_compress_free(ws);
+	}
+
+	kfree(sbi->compress_pools);
+	sbi->compress_pools = NULL;
+}
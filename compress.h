@@ -0,0 +1,19 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#ifndef AMNESIAFS_COMPRESS_H
+#define AMNESIAFS_COMPRESS_H
+
+#include <linux/fs.h>
+
+int amnesiafs_compress(struct super_block *sb, unsigned int algo,
+		       const void *src, unsigned int len, void *dst);
+
+int amnesiafs_decompress(struct super_block *sb, unsigned int algo,
+			 const void *src, unsigned int src_len, void *dst,
+			 unsigned int len);
+
+int amnesiafs_compress_init(struct super_block *sb);
+
+void amnesiafs_compress_destroy(struct super_block *sb);
+
+#endif
@@ -5,15 +5,25 @@
 #include <linux/string.h>
 #include <linux/parser.h>
 #include <linux/gfp.h>
+#include <linux/slab.h>
 
+#include "amnesiafs.h"
 #include "config.h"
 
 enum { OPT_KEY_NAME,
+       OPT_COMPRESS,
+       OPT_DEVICE,
+       OPT_DISCARD,
+       OPT_INLINECRYPT,
        OPT_ERR,
 };
 
 static const match_table_t tokens = {
 	{ OPT_KEY_NAME, "key_name=%s" },
+	{ OPT_COMPRESS, "compress=%s" },
+	{ OPT_DEVICE, "device=%s" },
+	{ OPT_DISCARD, "discard" },
+	{ OPT_INLINECRYPT, "inlinecrypt" },
 	{ OPT_ERR, NULL },
 };
 
@@ -37,6 +47,36 @@ int amnesiafs_parse_options(char *options, struct amnesiafs_config *config)
 			config->key_desc = kstrdup(args[0].from, GFP_KERNEL);
 			pr_debug("key_name: %s", config->key_desc);
 			break;
+		case OPT_COMPRESS:
+			if (!strcmp(args[0].from, "lz4"))
+				config->compress = AMNESIAFS_COMPRESS_LZ4;
+			else if (!strcmp(args[0].from, "zstd"))
+				config->compress = AMNESIAFS_COMPRESS_ZSTD;
+			else if (!strcmp(args[0].from, "none"))
+				config->compress = AMNESIAFS_COMPRESS_NONE;
+			else {
+				pr_err("unknown compression algorithm \"%s\"",
+				       args[0].from);
+				return -EINVAL;
+			}
+			break;
+		case OPT_DEVICE:
+			if (config->nr_devices >= ARRAY_SIZE(config->devices)) {
+				pr_err("too many devices");
+				return -EINVAL;
+			}
+			config->devices[config->nr_devices] =
+				kstrdup(args[0].from, GFP_KERNEL);
+			if (!config->devices[config->nr_devices])
+				return -ENOMEM;
+			config->nr_devices++;
+			break;
+		case OPT_DISCARD:
+			config->discard = true;
+			break;
+		case OPT_INLINECRYPT:
+			config->inlinecrypt = true;
+			break;
 		default: {
 			pr_err("unrecognized mount option \"%s\" or missing value",
 			       p);
@@ -46,4 +86,15 @@ int amnesiafs_parse_options(char *options, struct amnesiafs_config *config)
 		}
 	}
 	return 0;
-}
\ No newline at end of file
+}
+
+void amnesiafs_free_config(struct amnesiafs_config *config)
+{
+	unsigned int i;
+
+	for (i = 0; i < config->nr_devices; i++)
+		kfree(config->devices[i]);
+	kfree_sensitive(config->passphrase);
+	kfree(config->key_desc);
+	kfree(config);
+}
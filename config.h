@@ -3,14 +3,32 @@
 #ifndef AMNESIAFS_CONFIG_H
 #define AMNESIAFS_CONFIG_H
 
+#include "amnesiafs.h"
+
 struct amnesiafs_config {
 	/* name of the user's passphrase key */
 	char *key_desc;
 
-	/* probably not the best place to store this */
+	/* only kept until the mount has derived its keys from it */
 	char *passphrase;
+	size_t passphrase_len;
+
+	/* AMNESIAFS_COMPRESS_*, for newly written data */
+	unsigned int compress;
+
+	/* discard freed blocks */
+	bool discard;
+
+	/* encrypt file data with blk-crypto, see crypt.c */
+	bool inlinecrypt;
+
+	/* paths of the volume's devices besides the one mounted */
+	char *devices[AMNESIAFS_MAX_DEVICES - 1];
+	unsigned int nr_devices;
 };
 
 int amnesiafs_parse_options(char *options, struct amnesiafs_config *config);
 
+void amnesiafs_free_config(struct amnesiafs_config *config);
+
 #endif
\ No newline at end of file
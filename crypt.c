@@ -0,0 +1,179 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <linux/bio.h>
+#include <linux/blk-crypto.h>
+#include <linux/blkdev.h>
+#include <linux/fs.h>
+#include <linux/keyslot-manager.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "amnesiafs.h"
+
+#include "crypt.h"
+#include "journal.h"
+#include "keys.h"
+#include "log.h"
+#include "super.h"
+
+/*
+ * With inlinecrypt, file data bios carry a blk-crypto context and are
+ * encrypted on the way to the device and decrypted on the way back, by the
+ * storage controller where it can, and by blk-crypto-fallback everywhere
+ * else. The page cache only ever holds plaintext, and the file system never
+ * touches ciphertext or needs bounce pages of its own.
+ *
+ * Data is encrypted with AES-256-XTS, a block at a time, with the volume
+ * block number as the tweak. Bios are only built from runs of consecutive
+ * volume blocks, so the tweak of each block follows from the first. Small
+ * files aren't kept in their inode on an encrypted volume, see
+ * amnesiafs_inline_max(); metadata is not encrypted.
+ */
+
+#ifdef CONFIG_BLK_INLINE_ENCRYPTION
+
+#define AMNESIAFS_CRYPT_MODE BLK_ENCRYPTION_MODE_AES_256_XTS
+#define AMNESIAFS_CRYPT_KEY_SIZE 64
+
+/* Can the controller behind q do the work itself, without the fallback? */
+static bool amnesiafs_crypt_hardware(struct request_queue *q,
+				     const struct blk_crypto_key *key)
+{
+	return q->ksm && blk_ksm_crypto_cfg_supported(q->ksm, &key->crypto_cfg);
+}
+
+/* Mark the volume as encrypted, the first time it's mounted inlinecrypt. */
+static int amnesiafs_crypt_claim(struct super_block *sb)
+{
+	struct amnesiafs_super_block *disk_sb = AMNESIAFS_SB(sb)->disk_sb;
+	int err;
+
+	if (disk_sb->features & AMNESIAFS_FEATURE_INLINE_CRYPT)
+		return 0;
+
+	/* anything already written would read back as garbage */
+	if (disk_sb->inodes_count > 1) {
+		amnesiafs_err("inlinecrypt needs a volume without files");
+		return -EINVAL;
+	}
+
+	err = amnesiafs_journal_start(sb, 1);
+	if (err)
+		return err;
+	disk_sb->features |= AMNESIAFS_FEATURE_INLINE_CRYPT;
+	amnesiafs_sync_super(sb);
+	amnesiafs_journal_stop(sb);
+
+	return 0;
+}
+
+int amnesiafs_crypt_init(struct super_block *sb)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	struct blk_crypto_key *key;
+	u8 raw[AMNESIAFS_CRYPT_KEY_SIZE];
+	struct request_queue *q;
+	unsigned int i;
+	int err;
+
+	if (!sbi->config->inlinecrypt) {
+		if (!(sbi->disk_sb->features & AMNESIAFS_FEATURE_INLINE_CRYPT))
+			return 0;
+		amnesiafs_err("volume is encrypted, mount it with inlinecrypt");
+		return -EINVAL;
+	}
+
+	key = kzalloc(sizeof(*key), GFP_KERNEL);
+	if (!key)
+		return -ENOMEM;
+
+	err = amnesiafs_derive_key(sbi->config, "amnesiafs data", raw,
+				   sizeof(raw));
+	if (!err)
+		err = blk_crypto_init_key(key, raw, AMNESIAFS_CRYPT_MODE,
+					  sizeof(u64), AMNESIAFS_BLOCKSIZE);
+	memzero_explicit(raw, sizeof(raw));
+	if (err)
+		goto out_free;
+
+	/* stays in the hardware where it can, or else in the fallback */
+	for (i = 0; i < sbi->nr_devices; i++) {
+		q = bdev_get_queue(sbi->devices[i]);
+		err = blk_crypto_start_using_key(key, q);
+		if (err) {
+			amnesiafs_err("device %u can't do inline encryption: %d",
+				      i, err);
+			goto out_evict;
+		}
+		amnesiafs_info("device %u encrypts %s", i,
+			       amnesiafs_crypt_hardware(q, key) ?
+				       "inline" :
+				       "with blk-crypto-fallback");
+	}
+
+	sbi->crypt_key = key;
+
+	err = amnesiafs_crypt_claim(sb);
+	if (err)
+		amnesiafs_crypt_destroy(sb);
+	return err;
+
+out_evict:
+	while (i--)
+		blk_crypto_evict_key(bdev_get_queue(sbi->devices[i]), key);
+out_free:
+	kfree_sensitive(key);
+	return err;
+}
+
+void amnesiafs_crypt_destroy(struct super_block *sb)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	unsigned int i;
+
+	if (!sbi->crypt_key)
+		return;
+
+	/* only after everything that used the key has completed */
+	for (i = 0; i < sbi->nr_devices; i++)
+		blk_crypto_evict_key(bdev_get_queue(sbi->devices[i]),
+				     sbi->crypt_key);
+	kfree_sensitive(sbi->crypt_key);
+	sbi->crypt_key = NULL;
+}
+
+/* Attach the volume's key to a file data bio starting at volume block. */
+void amnesiafs_crypt_set_ctx(struct super_block *sb, struct bio *bio,
+			     uint64_t block)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	u64 dun[BLK_CRYPTO_DUN_ARRAY_SIZE] = { block };
+
+	if (sbi->crypt_key)
+		bio_crypt_set_ctx(bio, sbi->crypt_key, dun, GFP_NOFS);
+}
+
+#else
+
+int amnesiafs_crypt_init(struct super_block *sb)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+
+	if (!sbi->config->inlinecrypt &&
+	    !(sbi->disk_sb->features & AMNESIAFS_FEATURE_INLINE_CRYPT))
+		return 0;
+
+	amnesiafs_err("kernel built without CONFIG_BLK_INLINE_ENCRYPTION");
+	return -EOPNOTSUPP;
+}
+
+void amnesiafs_crypt_destroy(struct super_block *sb)
+{
+}
+
+void amnesiafs_crypt_set_ctx(struct super_block *sb, struct bio *bio,
+			     uint64_t block)
+{
+}
+
+#endif
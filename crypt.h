@@ -0,0 +1,16 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#ifndef AMNESIAFS_CRYPT_H
+#define AMNESIAFS_CRYPT_H
+
+#include <linux/bio.h>
+#include <linux/fs.h>
+
+int amnesiafs_crypt_init(struct super_block *sb);
+
+void amnesiafs_crypt_destroy(struct super_block *sb);
+
+void amnesiafs_crypt_set_ctx(struct super_block *sb, struct bio *bio,
+			     uint64_t block);
+
+#endif
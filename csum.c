@@ -0,0 +1,151 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <linux/buffer_head.h>
+#include <linux/crc32c.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+
+#include "amnesiafs.h"
+
+#include "csum.h"
+#include "log.h"
+#include "super.h"
+
+/*
+ * Metadata checksums. Every checksum is the crc32c of the whole structure
+ * it's in, taken with the checksum field itself as zero; crc32c() goes
+ * through the crypto API, and so gets the SSE4.2 or PCLMUL version where
+ * the CPU has one.
+ *
+ * Blocks are checked once, when they're first read into the buffer cache,
+ * and the buffer is then marked verified. Checksums aren't kept up to date
+ * in the cache: the journal fills them in on the copies it writes out, see
+ * amnesiafs_csum_set(). The cost is one pass over each block per commit.
+ */
+
+static uint32_t amnesiafs_csum(const void *data, size_t len, size_t offset)
+{
+	static const uint32_t zero;
+	uint32_t crc;
+
+	crc = crc32c(~0, data, offset);
+	crc = crc32c(crc, &zero, sizeof(zero));
+	return crc32c(crc, data + offset + sizeof(zero),
+		      len - offset - sizeof(zero));
+}
+
+static bool amnesiafs_csum_enabled(struct super_block *sb)
+{
+	return AMNESIAFS_SB(sb)->disk_sb->features & AMNESIAFS_FEATURE_CSUM;
+}
+
+bool amnesiafs_super_verify(struct amnesiafs_super_block *disk_sb)
+{
+	if (!(disk_sb->features & AMNESIAFS_FEATURE_CSUM))
+		return true;
+
+	return disk_sb->checksum ==
+	       amnesiafs_csum(disk_sb, sizeof(*disk_sb),
+			      offsetof(struct amnesiafs_super_block, checksum));
+}
+
+static uint32_t amnesiafs_inode_csum(const struct amnesiafs_inode *raw)
+{
+	return amnesiafs_csum(raw, sizeof(*raw),
+			      offsetof(struct amnesiafs_inode, checksum));
+}
+
+static uint32_t amnesiafs_dir_csum(const void *data)
+{
+	return amnesiafs_csum(data, AMNESIAFS_BLOCKSIZE,
+			      AMNESIAFS_DIR_CHECKSUM_OFFSET);
+}
+
+/*
+ * Check the inodes in use in an inode table block, the first time it's
+ * looked at. Empty slots are all zero and have no checksum.
+ */
+int amnesiafs_inode_table_verify(struct super_block *sb,
+				 struct buffer_head *bh)
+{
+	struct amnesiafs_inode *raw;
+	unsigned int i;
+	int err = 0;
+
+	if (buffer_amnesiafs_verified(bh) || !amnesiafs_csum_enabled(sb))
+		return 0;
+
+	lock_buffer(bh);
+	raw = (struct amnesiafs_inode *)bh->b_data;
+	for (i = 0; i < AMNESIAFS_INODES_PER_BLOCK; i++, raw++) {
+		if (raw->inode_no && raw->checksum != amnesiafs_inode_csum(raw)) {
+			amnesiafs_err("inode %llu: bad checksum", raw->inode_no);
+			err = -EBADMSG;
+		}
+	}
+	if (!err)
+		set_buffer_amnesiafs_verified(bh);
+	unlock_buffer(bh);
+
+	return err;
+}
+
+/* Check a directory block the first time it's looked at. */
+int amnesiafs_dir_verify(struct super_block *sb, struct buffer_head *bh)
+{
+	uint32_t *checksum;
+	int err = 0;
+
+	if (buffer_amnesiafs_verified(bh) || !amnesiafs_csum_enabled(sb))
+		return 0;
+
+	lock_buffer(bh);
+	checksum = (uint32_t *)(bh->b_data + AMNESIAFS_DIR_CHECKSUM_OFFSET);
+	if (*checksum != amnesiafs_dir_csum(bh->b_data)) {
+		amnesiafs_err("directory block %llu: bad checksum",
+			      (unsigned long long)bh->b_blocknr);
+		err = -EBADMSG;
+	} else {
+		set_buffer_amnesiafs_verified(bh);
+	}
+	unlock_buffer(bh);
+
+	return err;
+}
+
+/*
+ * Fill in the checksums in data, the journal's copy of bh about to be
+ * written out. Blocks other than the super block, the inode table and
+ * directory blocks don't have any.
+ */
+void amnesiafs_csum_set(struct super_block *sb, struct buffer_head *bh,
+			void *data)
+{
+	struct amnesiafs_super_block *disk_sb;
+	struct amnesiafs_inode *raw;
+	unsigned int i;
+
+	if (buffer_amnesiafs_dir(bh)) {
+		*(uint32_t *)(data + AMNESIAFS_DIR_CHECKSUM_OFFSET) =
+			amnesiafs_dir_csum(data);
+		return;
+	}
+
+	/* the rest all live on the first device */
+	if (bh->b_bdev != sb->s_bdev)
+		return;
+
+	if (bh->b_blocknr == AMNESIAFS_SUPER_BLOCK_NUMBER) {
+		disk_sb = data;
+		disk_sb->checksum = amnesiafs_csum(
+			disk_sb, sizeof(*disk_sb),
+			offsetof(struct amnesiafs_super_block, checksum));
+	} else if (bh->b_blocknr >= AMNESIAFS_INODE_TABLE_BLOCK_NUMBER &&
+		   bh->b_blocknr < AMNESIAFS_INODE_TABLE_BLOCK_NUMBER +
+					   AMNESIAFS_INODE_TABLE_BLOCKS) {
+		raw = data;
+		for (i = 0; i < AMNESIAFS_INODES_PER_BLOCK; i++, raw++)
+			if (raw->inode_no)
+				raw->checksum = amnesiafs_inode_csum(raw);
+	}
+}
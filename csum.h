@@ -0,0 +1,31 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#ifndef AMNESIAFS_CSUM_H
+#define AMNESIAFS_CSUM_H
+
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+
+#include "amnesiafs.h"
+
+enum amnesiafs_bh_state_bits {
+	/* the checksums in the buffer were checked when it was read */
+	BH_AmnesiafsVerified = BH_PrivateStart,
+	/* the buffer is a directory block */
+	BH_AmnesiafsDir,
+};
+
+BUFFER_FNS(AmnesiafsVerified, amnesiafs_verified)
+BUFFER_FNS(AmnesiafsDir, amnesiafs_dir)
+
+bool amnesiafs_super_verify(struct amnesiafs_super_block *disk_sb);
+
+int amnesiafs_inode_table_verify(struct super_block *sb,
+				 struct buffer_head *bh);
+
+int amnesiafs_dir_verify(struct super_block *sb, struct buffer_head *bh);
+
+void amnesiafs_csum_set(struct super_block *sb, struct buffer_head *bh,
+			void *data);
+
+#endif
@@ -1,13 +1,154 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 
+#include <linux/bitmap.h>
+#include <linux/blkdev.h>
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
+#include <linux/slab.h>
 
 #include "amnesiafs.h"
 
+#include "csum.h"
 #include "dir.h"
 #include "log.h"
 #include "inode.h"
+#include "names.h"
+#include "volume.h"
+
+/* Read a directory block, checking it the first time round. */
+struct buffer_head *amnesiafs_dir_bread(struct super_block *sb, uint64_t block)
+{
+	struct buffer_head *bh = amnesiafs_bread(sb, block);
+
+	if (!bh)
+		return NULL;
+
+	/* so the journal knows to fill in its checksum */
+	set_buffer_amnesiafs_dir(bh);
+	if (amnesiafs_dir_verify(sb, bh)) {
+		brelse(bh);
+		return NULL;
+	}
+
+	return bh;
+}
+
+/* Start a new, empty directory block. The caller logs it. */
+struct buffer_head *amnesiafs_dir_new_block(struct super_block *sb,
+					    uint64_t block)
+{
+	struct buffer_head *bh = amnesiafs_getblk(sb, block);
+
+	if (!bh)
+		return NULL;
+
+	lock_buffer(bh);
+	memset(bh->b_data, 0, AMNESIAFS_BLOCKSIZE);
+	set_buffer_uptodate(bh);
+	set_buffer_amnesiafs_dir(bh);
+	set_buffer_amnesiafs_verified(bh);
+	unlock_buffer(bh);
+
+	return bh;
+}
+
+/*
+ * Each directory keeps a Bloom filter of its names in memory, so a lookup
+ * of a name that isn't there can usually be turned away without reading the
+ * directory block. It is filled in by the first lookup, which reads the
+ * block anyway, and kept up to date by create and mkdir. Names are never
+ * taken out of a directory, so it never needs rebuilding.
+ *
+ * Lookups only hold the directory's i_rwsem shared, so two of them can fill
+ * it in at once; setting the same bits twice is harmless.
+ */
+static void amnesiafs_dir_bloom_set(struct amnesiafs_inode_info *info,
+				    u64 hash)
+{
+	int i;
+
+	for (i = 0; i < 4; i++, hash >>= 8)
+		set_bit(hash & (AMNESIAFS_DIR_BLOOM_BITS - 1), info->dir_bloom);
+}
+
+/*
+ * Add a new name to a directory's filter, if it's been filled in. hash is
+ * amnesiafs_name_hash() of the name.
+ */
+void amnesiafs_dir_bloom_add(struct amnesiafs_inode_info *info, u64 hash)
+{
+	if (smp_load_acquire(&info->dir_bloom_ready))
+		amnesiafs_dir_bloom_set(info, hash);
+}
+
+/* Fill in a directory's filter from its records. */
+void amnesiafs_dir_bloom_fill(struct inode *dir,
+			      const struct amnesiafs_dir_record *record,
+			      unsigned int count)
+{
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(dir);
+	unsigned int i;
+
+	if (smp_load_acquire(&info->dir_bloom_ready))
+		return;
+
+	for (i = 0; i < count; i++)
+		amnesiafs_dir_bloom_set(info, amnesiafs_name_record_hash(
+						      dir, &record[i]));
+	smp_store_release(&info->dir_bloom_ready, true);
+}
+
+/*
+ * Might the directory hold the name with hash? Only a false answer is
+ * certain, and it is always true until the filter has been filled in.
+ */
+bool amnesiafs_dir_bloom_check(struct amnesiafs_inode_info *info, u64 hash)
+{
+	int i;
+
+	if (!smp_load_acquire(&info->dir_bloom_ready))
+		return true;
+
+	for (i = 0; i < 4; i++, hash >>= 8)
+		if (!test_bit(hash & (AMNESIAFS_DIR_BLOOM_BITS - 1),
+			      info->dir_bloom))
+			return false;
+
+	return true;
+}
+
+/*
+ * Start reading the inode table blocks for a directory's entries, without
+ * waiting for them. Listings are usually followed by a stat() of every name,
+ * and this way those find their inodes already in memory rather than reading
+ * the table one block at a time. Blocks that are already cached are skipped.
+ */
+static void amnesiafs_dir_prefetch(struct super_block *sb,
+				   const struct amnesiafs_dir_record *record,
+				   unsigned int count)
+{
+	DECLARE_BITMAP(seen, AMNESIAFS_INODE_TABLE_BLOCKS);
+	struct blk_plug plug;
+	uint64_t block;
+	unsigned int i;
+
+	bitmap_zero(seen, AMNESIAFS_INODE_TABLE_BLOCKS);
+
+	blk_start_plug(&plug);
+	for (i = 0; i < count; i++, record++) {
+		if (record->inode_no < 1 ||
+		    record->inode_no > AMNESIAFS_MAX_INODES)
+			continue;
+
+		block = amnesiafs_inode_table_block(record->inode_no);
+		if (__test_and_set_bit(block - AMNESIAFS_INODE_TABLE_BLOCK_NUMBER,
+				       seen))
+			continue;
+
+		sb_breadahead(sb, block);
+	}
+	blk_finish_plug(&plug);
+}
 
 int amnesiafs_iterate(struct file *filp, struct dir_context *ctx)
 {
@@ -17,7 +158,8 @@ int amnesiafs_iterate(struct file *filp, struct dir_context *ctx)
 	struct buffer_head *bh;
 	struct amnesiafs_inode *sfs_inode;
 	struct amnesiafs_dir_record *record;
-	int i;
+	char *name;
+	int i, len, err = 0;
 
 	amnesiafs_debug("iterating over %s", filp->f_path.dentry->d_name.name);
 
@@ -30,7 +172,7 @@ int amnesiafs_iterate(struct file *filp, struct dir_context *ctx)
 		return 0;
 	}
 
-	sfs_inode = inode->i_private;
+	sfs_inode = &AMNESIAFS_I(inode)->raw;
 
 	if (!S_ISDIR(sfs_inode->mode)) {
 		amnesiafs_err(
@@ -40,24 +182,40 @@ int amnesiafs_iterate(struct file *filp, struct dir_context *ctx)
 		return -ENOTDIR;
 	}
 
-	bh = sb_bread(sb, sfs_inode->data_block_number);
-	BUG_ON(!bh);
+	/* decrypted names go here, see names.c */
+	name = kmalloc(AMNESIAFS_FILENAME_MAX, GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
+
+	/* inode->i_rwsem is held shared, which keeps out creates */
+	bh = amnesiafs_dir_bread(sb, sfs_inode->data_block_number);
+	if (!bh) {
+		kfree(name);
+		return -EIO;
+	}
 
 	record = (struct amnesiafs_dir_record *)bh->b_data;
+	amnesiafs_dir_prefetch(sb, record, sfs_inode->dir_children_count);
+
 	for (i = 0; i < sfs_inode->dir_children_count; i++) {
-		dir_emit(ctx, record->filename, 255, record->inode_no,
-			 DT_UNKNOWN);
+		len = amnesiafs_name_load(inode, record, name);
+		if (len < 0) {
+			err = len;
+			break;
+		}
+		dir_emit(ctx, name, len, record->inode_no, DT_UNKNOWN);
 		ctx->pos += sizeof(struct amnesiafs_dir_record);
 
 		pos += sizeof(struct amnesiafs_dir_record);
 		record++;
 	}
 	brelse(bh);
+	kfree_sensitive(name);
 
-	return 0;
+	return err;
 }
 
 const struct file_operations amnesiafs_dir_operations = {
 	.owner = THIS_MODULE,
-	.iterate = amnesiafs_iterate,
+	.iterate_shared = amnesiafs_iterate,
 };
\ No newline at end of file
@@ -4,9 +4,60 @@
 #define AMNESIAFS_DIR_H
 
 #include <linux/fs.h>
+#include <linux/string.h>
+
+#include "amnesiafs.h"
+
+/* The index of the record for name among the first count, or -1. */
+static inline int
+amnesiafs_dir_find(const struct amnesiafs_dir_record *records,
+		   unsigned int count, const char *name, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		if (strnlen(records[i].filename, AMNESIAFS_FILENAME_MAX) == len &&
+		    !memcmp(records[i].filename, name, len))
+			return i;
+
+	return -1;
+}
+
+/*
+ * The index of the next record from from on, among the first count, whose
+ * encrypted name has hash, or -1.
+ */
+static inline int
+amnesiafs_dir_find_hash(const struct amnesiafs_dir_record *records,
+			unsigned int from, unsigned int count, uint64_t hash)
+{
+	unsigned int i;
+
+	for (i = from; i < count; i++)
+		if (records[i].name_hash == hash)
+			return i;
+
+	return -1;
+}
+
+struct amnesiafs_inode_info;
 
 extern const struct file_operations amnesiafs_dir_operations;
 
 int amnesiafs_iterate(struct file *filp, struct dir_context *ctx);
 
+struct buffer_head *amnesiafs_dir_bread(struct super_block *sb,
+					uint64_t block);
+
+struct buffer_head *amnesiafs_dir_new_block(struct super_block *sb,
+					    uint64_t block);
+
+void amnesiafs_dir_bloom_add(struct amnesiafs_inode_info *info, u64 hash);
+
+void amnesiafs_dir_bloom_fill(struct inode *dir,
+			      const struct amnesiafs_dir_record *record,
+			      unsigned int count);
+
+bool amnesiafs_dir_bloom_check(struct amnesiafs_inode_info *info, u64 hash);
+
 #endif
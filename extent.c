@@ -0,0 +1,1267 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "amnesiafs.h"
+
+#include "alloc.h"
+#include "extent.h"
+#include "inode.h"
+#include "journal.h"
+#include "log.h"
+#include "prealloc.h"
+#include "refcount.h"
+#include "volume.h"
+
+/*
+ * The most blocks handed out in one go at writeback. A run never crosses
+ * from one block group into the next, so it's at most a group's worth.
+ */
+#define AMNESIAFS_MAX_ALLOC_BLOCKS AMNESIAFS_GROUP_BLOCKS
+
+/*
+ * the bitmap block of one allocation, which stays in its group, and saving
+ * the inode
+ */
+#define AMNESIAFS_ALLOC_CREDITS (2 + AMNESIAFS_SAVE_CREDITS)
+
+/* the most copies of shared blocks swapped in per handle */
+#define AMNESIAFS_CONVERT_COWS 16
+
+/*
+ * per step of converting a written range: the bitmap blocks of each copy
+ * and of the shared block it replaces, the refcount table, and the inode
+ */
+#define AMNESIAFS_CONVERT_CREDITS                                 \
+	(2 * AMNESIAFS_CONVERT_COWS + AMNESIAFS_REFCOUNT_CREDITS + \
+	 AMNESIAFS_SAVE_CREDITS)
+
+/*
+ * per step of freeing a range: the bitmap blocks freed into, the refcount
+ * table, and the inode
+ */
+#define AMNESIAFS_FREE_CREDITS 64
+
+/* per extent cloned: the refcount table and both inodes */
+#define AMNESIAFS_CLONE_CREDITS \
+	(AMNESIAFS_REFCOUNT_CREDITS + 2 * AMNESIAFS_SAVE_CREDITS)
+
+/*
+ * the bitmap blocks for a cluster's new blocks, for freeing whatever backed
+ * it before, and saving the inode
+ */
+#define AMNESIAFS_CLUSTER_CREDITS                                     \
+	(2 + 2 * AMNESIAFS_CLUSTER_BLOCKS + AMNESIAFS_REFCOUNT_CREDITS + \
+	 AMNESIAFS_SAVE_CREDITS)
+
+/* the index of the last extent starting at or before lblk, or -1 */
+static int amnesiafs_extent_find(struct amnesiafs_inode_info *info,
+				 uint64_t lblk)
+{
+	int lo = 0, hi = (int)info->nr_extents - 1, found = -1;
+
+	while (lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (info->extents[mid].logical <= lblk) {
+			found = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	return found;
+}
+
+static bool amnesiafs_extent_contains(const struct amnesiafs_extent *ext,
+				      uint64_t lblk)
+{
+	return lblk >= ext->logical && lblk - ext->logical < ext->len;
+}
+
+/* Can b, which starts where a ends, be folded into a? */
+static bool amnesiafs_extent_mergeable(const struct amnesiafs_extent *a,
+				       const struct amnesiafs_extent *b)
+{
+	if (a->flags != b->flags || a->logical + a->len != b->logical)
+		return false;
+	if (a->flags & AMNESIAFS_EXTENT_COMPRESSED)
+		return false;
+	if ((uint64_t)a->len + b->len > U32_MAX)
+		return false;
+	if (a->flags & AMNESIAFS_EXTENT_DELALLOC)
+		return true;
+	return a->physical + a->len == b->physical;
+}
+
+/*
+ * Find the mapping for lblk. If it's a hole, ext is filled in with the hole,
+ * which runs up to the next extent, and false is returned. The caller holds
+ * extent_lock.
+ */
+bool amnesiafs_extent_lookup(struct amnesiafs_inode_info *info, uint64_t lblk,
+			     struct amnesiafs_extent *ext)
+{
+	int i = amnesiafs_extent_find(info, lblk);
+
+	if (i >= 0 && amnesiafs_extent_contains(&info->extents[i], lblk)) {
+		*ext = info->extents[i];
+		return true;
+	}
+
+	ext->logical = lblk;
+	ext->physical = 0;
+	ext->flags = 0;
+	ext->len = U32_MAX;
+	if (i + 1 < (int)info->nr_extents)
+		ext->len = min_t(uint64_t, U32_MAX,
+				 info->extents[i + 1].logical - lblk);
+
+	return false;
+}
+
+static int amnesiafs_extent_make_room(struct amnesiafs_inode_info *info)
+{
+	struct amnesiafs_extent *extents;
+	unsigned int max;
+
+	if (info->nr_extents < info->max_extents)
+		return 0;
+	if (info->nr_extents >= AMNESIAFS_MAX_EXTENTS)
+		return -ENOSPC;
+
+	max = max_t(unsigned int, AMNESIAFS_INODE_EXTENTS,
+		    info->max_extents * 2);
+	max = min_t(unsigned int, max, AMNESIAFS_MAX_EXTENTS);
+	extents = krealloc(info->extents, max * sizeof(*extents), GFP_NOFS);
+	if (!extents)
+		return -ENOMEM;
+
+	info->extents = extents;
+	info->max_extents = max;
+	return 0;
+}
+
+static int amnesiafs_extent_insert_at(struct amnesiafs_inode_info *info, int i,
+				      const struct amnesiafs_extent *ext)
+{
+	int err;
+
+	err = amnesiafs_extent_make_room(info);
+	if (err)
+		return err;
+
+	memmove(&info->extents[i + 1], &info->extents[i],
+		(info->nr_extents - i) * sizeof(*ext));
+	info->extents[i] = *ext;
+	info->nr_extents++;
+
+	return 0;
+}
+
+static void amnesiafs_extent_delete_at(struct amnesiafs_inode_info *info,
+				       int i)
+{
+	memmove(&info->extents[i], &info->extents[i + 1],
+		(info->nr_extents - i - 1) * sizeof(info->extents[0]));
+	info->nr_extents--;
+}
+
+/* Fold extent i into its neighbours where they line up. */
+static void amnesiafs_extent_merge(struct amnesiafs_inode_info *info, int i)
+{
+	struct amnesiafs_extent *extents = info->extents;
+
+	if (i + 1 < (int)info->nr_extents &&
+	    amnesiafs_extent_mergeable(&extents[i], &extents[i + 1])) {
+		extents[i].len += extents[i + 1].len;
+		amnesiafs_extent_delete_at(info, i + 1);
+	}
+
+	if (i > 0 && amnesiafs_extent_mergeable(&extents[i - 1], &extents[i])) {
+		extents[i - 1].len += extents[i].len;
+		amnesiafs_extent_delete_at(info, i);
+	}
+}
+
+/*
+ * Map a range that's currently a hole. The caller holds extent_lock for
+ * writing.
+ */
+int amnesiafs_extent_insert(struct amnesiafs_inode_info *info,
+			    const struct amnesiafs_extent *ext)
+{
+	struct amnesiafs_extent *extents = info->extents;
+	int i = amnesiafs_extent_find(info, ext->logical);
+
+	if (i >= 0 && amnesiafs_extent_mergeable(&extents[i], ext)) {
+		extents[i].len += ext->len;
+		amnesiafs_extent_merge(info, i);
+		return 0;
+	}
+
+	if (i + 1 < (int)info->nr_extents &&
+	    amnesiafs_extent_mergeable(ext, &extents[i + 1])) {
+		extents[i + 1].logical = ext->logical;
+		extents[i + 1].physical = ext->physical;
+		extents[i + 1].len += ext->len;
+		return 0;
+	}
+
+	return amnesiafs_extent_insert_at(info, i + 1, ext);
+}
+
+/* Read the extent map of a freshly loaded inode. */
+int amnesiafs_extent_load(struct super_block *sb,
+			  struct amnesiafs_inode_info *info)
+{
+	struct amnesiafs_inode *raw = &info->raw;
+	unsigned int n = raw->nr_extents;
+	struct buffer_head *bh;
+
+	if (raw->flags & AMNESIAFS_INODE_INLINE_DATA)
+		return 0;
+
+	if (n > AMNESIAFS_MAX_EXTENTS) {
+		amnesiafs_err("inode %llu has %u extents", raw->inode_no, n);
+		return -EIO;
+	}
+	if (!n)
+		return 0;
+
+	info->extents = kmalloc_array(n, sizeof(*info->extents), GFP_NOFS);
+	if (!info->extents)
+		return -ENOMEM;
+	info->max_extents = n;
+
+	memcpy(info->extents, raw->extents,
+	       min_t(unsigned int, n, AMNESIAFS_INODE_EXTENTS) *
+		       sizeof(*info->extents));
+
+	if (n > AMNESIAFS_INODE_EXTENTS) {
+		bh = amnesiafs_bread(sb, raw->extent_block);
+		if (!bh) {
+			amnesiafs_err("reading extent block %llu failed",
+				      raw->extent_block);
+			return -EIO;
+		}
+		memcpy(info->extents + AMNESIAFS_INODE_EXTENTS, bh->b_data,
+		       (n - AMNESIAFS_INODE_EXTENTS) * sizeof(*info->extents));
+		brelse(bh);
+	}
+
+	info->nr_extents = n;
+	return 0;
+}
+
+/*
+ * Copy the extent map into the on-disk inode, spilling into the inode's
+ * extent block once it's outgrown the inode. Delalloc extents only exist in
+ * memory and are left out. The caller holds extent_lock for writing and a
+ * journal handle, and logs the inode itself.
+ */
+int amnesiafs_extent_store(struct super_block *sb,
+			   struct amnesiafs_inode_info *info)
+{
+	struct amnesiafs_inode *raw = &info->raw;
+	struct amnesiafs_extent *overflow = NULL;
+	struct buffer_head *bh = NULL;
+	unsigned int i, n = 0;
+	int err;
+
+	/* the extents share their space with the data */
+	if (raw->flags & AMNESIAFS_INODE_INLINE_DATA)
+		return 0;
+
+	for (i = 0; i < info->nr_extents; i++)
+		if (!(info->extents[i].flags & AMNESIAFS_EXTENT_DELALLOC))
+			n++;
+
+	if (n > AMNESIAFS_INODE_EXTENTS) {
+		if (!raw->extent_block) {
+			err = amnesiafs_new_blocks(
+				sb, amnesiafs_inode_goal(sb, raw->inode_no), 1,
+				&raw->extent_block);
+			if (err)
+				return err;
+		}
+
+		bh = amnesiafs_getblk(sb, raw->extent_block);
+		if (!bh)
+			return -ENOMEM;
+
+		lock_buffer(bh);
+		memset(bh->b_data, 0, AMNESIAFS_BLOCKSIZE);
+		overflow = (struct amnesiafs_extent *)bh->b_data;
+	} else if (raw->extent_block) {
+		amnesiafs_free_blocks(sb, raw->extent_block, 1);
+		raw->extent_block = 0;
+	}
+
+	memset(raw->extents, 0, sizeof(raw->extents));
+	n = 0;
+	for (i = 0; i < info->nr_extents; i++) {
+		if (info->extents[i].flags & AMNESIAFS_EXTENT_DELALLOC)
+			continue;
+		if (n < AMNESIAFS_INODE_EXTENTS)
+			raw->extents[n] = info->extents[i];
+		else
+			overflow[n - AMNESIAFS_INODE_EXTENTS] =
+				info->extents[i];
+		n++;
+	}
+	raw->nr_extents = n;
+
+	if (bh) {
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		amnesiafs_journal_dirty(sb, bh);
+		brelse(bh);
+	}
+
+	return 0;
+}
+
+void amnesiafs_extent_destroy(struct amnesiafs_inode_info *info)
+{
+	kfree(info->extents);
+	info->extents = NULL;
+	info->nr_extents = info->max_extents = 0;
+}
+
+/*
+ * The extent slots writeback needs on top of those in use to allocate every
+ * delalloc extent, at most a block group's worth at a time, with one to
+ * spare for settling on a shorter run. The caller holds extent_lock.
+ */
+static unsigned int amnesiafs_extent_splits(struct amnesiafs_inode_info *info)
+{
+	unsigned int i, splits = 1;
+
+	for (i = 0; i < info->nr_extents; i++) {
+		if (info->extents[i].flags & AMNESIAFS_EXTENT_DELALLOC)
+			splits += DIV_ROUND_UP(info->extents[i].len,
+					       AMNESIAFS_MAX_ALLOC_BLOCKS) -
+				  1;
+	}
+
+	return splits;
+}
+
+/*
+ * Reserve space for file block lblk if it isn't mapped yet, without picking
+ * a block for it. Called from write_begin with i_rwsem held. The extent map
+ * has to have room for whatever splitting writeback will do, or it couldn't
+ * allocate the block, so that's checked here too.
+ */
+int amnesiafs_extent_reserve(struct inode *inode, uint64_t lblk)
+{
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+	struct amnesiafs_extent ext;
+	bool mapped;
+	int err;
+
+	down_read(&info->extent_lock);
+	mapped = amnesiafs_extent_lookup(info, lblk, &ext);
+	up_read(&info->extent_lock);
+	if (mapped)
+		return 0;
+
+	err = amnesiafs_reserve_blocks(inode->i_sb, 1);
+	if (err)
+		return err;
+
+	ext.logical = lblk;
+	ext.physical = 0;
+	ext.len = 1;
+	ext.flags = AMNESIAFS_EXTENT_DELALLOC;
+
+	down_write(&info->extent_lock);
+	/* the block may need a slot of its own, or grow a delalloc extent */
+	if (info->nr_extents + 1 + amnesiafs_extent_splits(info) >
+	    AMNESIAFS_MAX_EXTENTS)
+		err = -ENOSPC;
+	else
+		err = amnesiafs_extent_insert(info, &ext);
+	up_write(&info->extent_lock);
+	if (err) {
+		amnesiafs_release_blocks(inode->i_sb, 1);
+		return err;
+	}
+
+	inode_add_bytes(inode, AMNESIAFS_BLOCKSIZE);
+	return 0;
+}
+
+/*
+ * How many new blocks writeback will take for file block lblk on top of any
+ * delalloc reservation: a copy of it if it's shared, or a whole cluster if
+ * it's part of a compressed one, which is only ever rewritten whole. Called
+ * from write_begin, which reserves them.
+ */
+unsigned int amnesiafs_extent_cow_blocks(struct inode *inode, uint64_t lblk)
+{
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+	struct amnesiafs_extent ext;
+	bool mapped;
+
+	down_read(&info->extent_lock);
+	/* the block may be past the end of the data, in the same cluster */
+	mapped = amnesiafs_extent_lookup(
+		info, round_down(lblk, AMNESIAFS_CLUSTER_BLOCKS), &ext);
+	if (mapped && (ext.flags & AMNESIAFS_EXTENT_COMPRESSED)) {
+		up_read(&info->extent_lock);
+		return AMNESIAFS_CLUSTER_BLOCKS;
+	}
+	mapped = amnesiafs_extent_lookup(info, lblk, &ext);
+	up_read(&info->extent_lock);
+
+	if (mapped && (ext.flags & AMNESIAFS_EXTENT_SHARED) &&
+	    amnesiafs_refcount_shared(inode->i_sb,
+				      ext.physical + (lblk - ext.logical)))
+		return 1;
+	return 0;
+}
+
+/*
+ * Split extent i so that file block lblk has an extent of its own, and
+ * return that extent's index. The caller holds extent_lock for writing.
+ */
+static int amnesiafs_extent_isolate(struct amnesiafs_inode_info *info, int i,
+				    uint64_t lblk)
+{
+	struct amnesiafs_extent *ext = &info->extents[i];
+	struct amnesiafs_extent part;
+	int err;
+
+	if (lblk + 1 < ext->logical + ext->len) {
+		part = *ext;
+		part.logical = lblk + 1;
+		part.physical += lblk + 1 - ext->logical;
+		part.len = ext->logical + ext->len - (lblk + 1);
+		err = amnesiafs_extent_insert_at(info, i + 1, &part);
+		if (err)
+			return err;
+		ext = &info->extents[i];
+		ext->len -= part.len;
+	}
+
+	if (lblk > ext->logical) {
+		part = *ext;
+		part.logical = lblk;
+		part.physical += lblk - ext->logical;
+		part.len = 1;
+		err = amnesiafs_extent_insert_at(info, i + 1, &part);
+		if (err)
+			return err;
+		ext = &info->extents[i];
+		ext->len = lblk - ext->logical;
+		i++;
+	}
+
+	return i;
+}
+
+/*
+ * Mark file block lblk of unwritten extent i as written, now that it has
+ * been. Only that block is converted, the rest of the extent still has to
+ * read as zeros.
+ */
+static int amnesiafs_extent_convert(struct amnesiafs_inode_info *info, int i,
+				    uint64_t lblk)
+{
+	i = amnesiafs_extent_isolate(info, i, lblk);
+	if (i < 0)
+		return i;
+
+	info->extents[i].flags &= ~AMNESIAFS_EXTENT_UNWRITTEN;
+	amnesiafs_extent_merge(info, i);
+
+	return 0;
+}
+
+/*
+ * Stage a block of its own, returned in block, for file block lblk of
+ * extent i, which is shared with another file, out of write_begin's
+ * reservation if reserved. Nothing needs copying: the whole page is about
+ * to be written out. The file keeps pointing at the shared block until the
+ * copy is on disk and amnesiafs_extent_convert_range() swaps it in, so a
+ * crash in between leaves the old data, not a block that was never written,
+ * as XFS's COW fork does.
+ */
+static int amnesiafs_extent_cow(struct super_block *sb,
+				struct amnesiafs_inode_info *info, int i,
+				uint64_t lblk, bool reserved, uint64_t *block)
+{
+	struct amnesiafs_extent *ext = &info->extents[i];
+	uint64_t old = ext->physical + (lblk - ext->logical);
+	int err;
+
+	/* out of the reservation, or ahead of it */
+	err = amnesiafs_stage_blocks(sb, old, reserved, !reserved, block);
+	if (err)
+		return err;
+
+	err = xa_err(xa_store(&info->cow, lblk, xa_mk_value(*block),
+			      GFP_NOFS));
+	if (err)
+		amnesiafs_stage_cancel(sb, *block, 1, reserved);
+	return err;
+}
+
+/*
+ * Swap the copy staged for file block lblk in for the shared block behind
+ * it, now that the copy has been written, and drop the file's reference to
+ * the old one. If the block has been unmapped since, the copy just goes.
+ */
+static int amnesiafs_extent_cow_end(struct inode *inode, uint64_t lblk,
+				    uint64_t block)
+{
+	struct super_block *sb = inode->i_sb;
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+	struct amnesiafs_extent *ext;
+	uint64_t old;
+	int i;
+
+	i = amnesiafs_extent_find(info, lblk);
+	if (i < 0 || !amnesiafs_extent_contains(&info->extents[i], lblk) ||
+	    (info->extents[i].flags & (AMNESIAFS_EXTENT_DELALLOC |
+				       AMNESIAFS_EXTENT_UNWRITTEN |
+				       AMNESIAFS_EXTENT_COMPRESSED))) {
+		amnesiafs_stage_cancel(sb, block, 1, 0);
+		return 0;
+	}
+
+	i = amnesiafs_extent_isolate(info, i, lblk);
+	if (i < 0) {
+		amnesiafs_stage_cancel(sb, block, 1, 0);
+		return i;
+	}
+
+	ext = &info->extents[i];
+	old = ext->physical;
+	amnesiafs_stage_commit(sb, block, 1);
+	if (ext->flags & AMNESIAFS_EXTENT_SHARED)
+		amnesiafs_refcount_put(sb, old, 1);
+	else
+		amnesiafs_free_blocks(sb, old, 1);
+	ext->physical = block;
+	ext->flags &= ~AMNESIAFS_EXTENT_SHARED;
+	amnesiafs_extent_merge(info, i);
+
+	return 0;
+}
+
+/*
+ * Give back the copies staged for file blocks [start, end), whose write
+ * failed; the file still has the shared blocks.
+ */
+void amnesiafs_extent_cow_cancel(struct inode *inode, uint64_t start,
+				 uint64_t end)
+{
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+	unsigned long lblk;
+	void *entry;
+
+	down_write(&info->extent_lock);
+	xa_for_each_start(&info->cow, lblk, entry, start) {
+		if (lblk >= end)
+			break;
+		xa_erase(&info->cow, lblk);
+		amnesiafs_stage_cancel(inode->i_sb, xa_to_value(entry), 1, 0);
+	}
+	up_write(&info->extent_lock);
+}
+
+/*
+ * Find the block backing file block lblk for writeback, allocating the
+ * delalloc extent it's part of first if need be. By now that extent covers
+ * everything buffered since the last writeback, so a streaming writer ends
+ * up with one contiguous run instead of a block per write(2).
+ *
+ * *reserved is what write_begin set aside for the block, see
+ * amnesiafs_extent_cow_blocks(). What's used of it, or given back once the
+ * block is found, comes off.
+ *
+ * Newly allocated blocks are mapped unwritten, and a block that's still
+ * unwritten stays that way, with *unwritten set: no transaction may say the
+ * block holds data before the data is on disk, so the caller converts it
+ * once the write has completed, see amnesiafs_extent_convert_range(). A
+ * shared block gets a staged copy, with *unwritten set as well, for the
+ * conversion to swap in.
+ */
+int amnesiafs_extent_allocate(struct inode *inode, uint64_t lblk,
+			      unsigned int *reserved, uint64_t *block,
+			      bool *unwritten)
+{
+	struct super_block *sb = inode->i_sb;
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+	struct amnesiafs_extent *ext;
+	struct amnesiafs_extent rest, window;
+	bool allocated = false;
+	unsigned int count, ahead;
+	uint64_t goal, start;
+	int i, err;
+
+	down_read(&info->extent_lock);
+	i = amnesiafs_extent_find(info, lblk);
+	if (i >= 0 && amnesiafs_extent_contains(&info->extents[i], lblk) &&
+	    !(info->extents[i].flags & (AMNESIAFS_EXTENT_DELALLOC |
+					AMNESIAFS_EXTENT_SHARED |
+					AMNESIAFS_EXTENT_COMPRESSED))) {
+		ext = &info->extents[i];
+		*block = ext->physical + (lblk - ext->logical);
+		*unwritten = ext->flags & AMNESIAFS_EXTENT_UNWRITTEN;
+		up_read(&info->extent_lock);
+		if (*reserved)
+			amnesiafs_release_blocks(sb, *reserved);
+		*reserved = 0;
+		return 0;
+	}
+	up_read(&info->extent_lock);
+
+	err = amnesiafs_journal_start(sb, AMNESIAFS_ALLOC_CREDITS);
+	if (err)
+		return err;
+
+	down_write(&info->extent_lock);
+	for (;;) {
+		i = amnesiafs_extent_find(info, lblk);
+		if (WARN_ON_ONCE(i < 0 || !amnesiafs_extent_contains(
+						  &info->extents[i], lblk))) {
+			/* write_begin reserves every block it hands out */
+			err = -EIO;
+			goto out_unlock;
+		}
+
+		ext = &info->extents[i];
+		if (WARN_ON_ONCE(ext->flags & AMNESIAFS_EXTENT_COMPRESSED)) {
+			/* compressed clusters are written whole, see file.c */
+			err = -EIO;
+			goto out_unlock;
+		}
+		if ((ext->flags & AMNESIAFS_EXTENT_SHARED) &&
+		    amnesiafs_refcount_shared(
+			    sb, ext->physical + (lblk - ext->logical))) {
+			err = amnesiafs_extent_cow(sb, info, i, lblk,
+						   *reserved > 0, block);
+			if (err)
+				goto out_unlock;
+			if (*reserved)
+				(*reserved)--;
+			*unwritten = true;
+			goto out_release;
+		}
+		if (!(ext->flags & AMNESIAFS_EXTENT_DELALLOC))
+			break;
+
+		/* carry on from the previous extent */
+		goal = amnesiafs_inode_goal(sb, info->raw.inode_no);
+		if (i > 0 &&
+		    !(info->extents[i - 1].flags & AMNESIAFS_EXTENT_DELALLOC))
+			goal = info->extents[i - 1].physical +
+			       info->extents[i - 1].len;
+
+		/*
+		 * Splitting the extent needs a free slot, which write_begin
+		 * has kept for any extent longer than a single run.
+		 */
+		count = min_t(uint64_t, ext->len, AMNESIAFS_MAX_ALLOC_BLOCKS);
+		ahead = 0;
+		err = amnesiafs_extent_make_room(info);
+		if (err && count < ext->len)
+			goto out_unlock;
+		ext = &info->extents[i];
+		/* an append takes the slot for a window past the end */
+		if (!err && count == ext->len &&
+		    i == (int)info->nr_extents - 1)
+			ahead = min_t(unsigned int,
+				      amnesiafs_prealloc_window(
+					      inode, ext->logical + count,
+					      count),
+				      AMNESIAFS_MAX_ALLOC_BLOCKS - count);
+
+		err = -ENOSPC;
+		if (ahead)
+			err = amnesiafs_claim_blocks(sb, goal, count, ahead,
+						     &start);
+		if (err) {
+			ahead = 0;
+			/* settle for shorter runs when free space is fragmented */
+			while ((err = amnesiafs_claim_blocks(sb, goal, count, 0,
+							     &start)) == -ENOSPC &&
+			       count > 1 && info->nr_extents < info->max_extents)
+				count /= 2;
+		}
+		if (err)
+			goto out_unlock;
+
+		if (count < ext->len) {
+			rest = *ext;
+			rest.logical += count;
+			rest.len -= count;
+			/* can't fail, there's room */
+			amnesiafs_extent_insert_at(info, i + 1, &rest);
+			ext = &info->extents[i];
+			ext->len = count;
+		}
+
+		amnesiafs_debug("inode %lu: blocks %llu-%llu at %llu",
+				inode->i_ino, ext->logical,
+				ext->logical + count - 1, start);
+
+		/* written once the data is on disk, see file.c */
+		ext->physical = start;
+		ext->flags = AMNESIAFS_EXTENT_UNWRITTEN;
+
+		if (ahead) {
+			window.logical = ext->logical + count;
+			window.physical = start + count;
+			window.len = ahead;
+			window.flags = AMNESIAFS_EXTENT_UNWRITTEN;
+			/* can't fail, there's room */
+			amnesiafs_extent_insert_at(info, i + 1, &window);
+			inode_add_bytes(inode,
+					(loff_t)ahead * AMNESIAFS_BLOCKSIZE);
+			amnesiafs_prealloc_track(inode, window.logical,
+						 window.logical + ahead);
+		}
+
+		amnesiafs_extent_merge(info, i);
+		allocated = true;
+	}
+
+	*block = ext->physical + (lblk - ext->logical);
+	*unwritten = ext->flags & AMNESIAFS_EXTENT_UNWRITTEN;
+
+out_release:
+	err = 0;
+	/* the other file let go of the block in the meantime */
+	if (*reserved)
+		amnesiafs_release_blocks(sb, *reserved);
+	*reserved = 0;
+
+out_unlock:
+	up_write(&info->extent_lock);
+	if (allocated) {
+		int save_err = amnesiafs_inode_save(inode);
+
+		if (!err)
+			err = save_err;
+	}
+	amnesiafs_journal_stop(sb);
+	return err;
+}
+
+/*
+ * Mark file blocks [start, end) written, now that their data is on disk,
+ * and swap in the copies staged for shared ones. Blocks that have stopped
+ * being unwritten or been freed in the meantime are left alone. Called from
+ * I/O completion, in as many handles as the copies take.
+ */
+int amnesiafs_extent_convert_range(struct inode *inode, uint64_t start,
+				   uint64_t end)
+{
+	struct super_block *sb = inode->i_sb;
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+	unsigned int cows;
+	bool converted;
+	void *entry;
+	int i, err, save_err;
+
+	do {
+		err = amnesiafs_journal_start(sb, AMNESIAFS_CONVERT_CREDITS);
+		if (err)
+			break;
+
+		converted = false;
+		cows = 0;
+		down_write(&info->extent_lock);
+		for (; start < end && cows < AMNESIAFS_CONVERT_COWS; start++) {
+			entry = xa_erase(&info->cow, start);
+			if (entry) {
+				err = amnesiafs_extent_cow_end(
+					inode, start, xa_to_value(entry));
+				if (err)
+					break;
+				converted = true;
+				cows++;
+				continue;
+			}
+
+			i = amnesiafs_extent_find(info, start);
+			if (i < 0 ||
+			    !amnesiafs_extent_contains(&info->extents[i],
+						       start) ||
+			    !(info->extents[i].flags &
+			      AMNESIAFS_EXTENT_UNWRITTEN))
+				continue;
+
+			err = amnesiafs_extent_convert(info, i, start);
+			if (err)
+				break;
+			converted = true;
+		}
+		up_write(&info->extent_lock);
+
+		if (converted) {
+			save_err = amnesiafs_inode_save(inode);
+			if (!err)
+				err = save_err;
+		}
+		amnesiafs_journal_stop(sb);
+	} while (!err && start < end);
+
+	/* the copies past a failure are never swapped in */
+	if (err)
+		amnesiafs_extent_cow_cancel(inode, start, end);
+	return err;
+}
+
+static void amnesiafs_extent_release(struct inode *inode,
+				     const struct amnesiafs_extent *ext,
+				     uint64_t from, uint64_t to)
+{
+	unsigned int count = to - from;
+
+	if (ext->flags & AMNESIAFS_EXTENT_COMPRESSED) {
+		/* only ever released whole */
+		count = AMNESIAFS_EXTENT_STORED(ext->flags);
+		amnesiafs_free_blocks(inode->i_sb, ext->physical, count);
+	} else if (ext->flags & AMNESIAFS_EXTENT_DELALLOC)
+		amnesiafs_release_blocks(inode->i_sb, count);
+	else if (ext->flags & AMNESIAFS_EXTENT_SHARED)
+		amnesiafs_refcount_put(inode->i_sb,
+				       ext->physical + (from - ext->logical),
+				       count);
+	else
+		amnesiafs_free_blocks(inode->i_sb,
+				      ext->physical + (from - ext->logical),
+				      count);
+	inode_sub_bytes(inode, (loff_t)count * AMNESIAFS_BLOCKSIZE);
+}
+
+/*
+ * Unmap [start, end), working back from the end so that the file is
+ * consistent at every step. Freeing blocks dirties bitmap blocks; once that
+ * would take more than credits of them this stops with -EAGAIN, and the
+ * caller saves the inode, starts a new handle and calls again. The caller
+ * holds extent_lock for writing.
+ */
+static int amnesiafs_extent_punch(struct inode *inode, uint64_t start,
+				  uint64_t end, unsigned int credits)
+{
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+	struct amnesiafs_extent *ext;
+	struct amnesiafs_extent tail;
+	uint64_t ext_end, from, to, first, last;
+	unsigned int span;
+	int i, err = 0;
+
+	while (end > start) {
+		i = amnesiafs_extent_find(info, end - 1);
+		if (i < 0)
+			break;
+
+		ext = &info->extents[i];
+		ext_end = ext->logical + ext->len;
+		if (ext_end <= start)
+			break;
+
+		from = max(start, ext->logical);
+		to = min(end, ext_end);
+		if (ext->flags & AMNESIAFS_EXTENT_COMPRESSED) {
+			/*
+			 * The blocks can't be split up, so the cluster can
+			 * only lose its tail, which is just forgotten, or go
+			 * away whole.
+			 */
+			if (to < ext_end) {
+				err = -EOPNOTSUPP;
+				break;
+			}
+			if (from > ext->logical) {
+				ext->len = from - ext->logical;
+				end = from;
+				continue;
+			}
+
+			first = ext->physical;
+			last = first + AMNESIAFS_EXTENT_STORED(ext->flags) - 1;
+			span = last / AMNESIAFS_BITS_PER_BLOCK -
+			       first / AMNESIAFS_BITS_PER_BLOCK + 1;
+			if (span > credits) {
+				err = -EAGAIN;
+				break;
+			}
+			credits -= span;
+		} else if (!(ext->flags & AMNESIAFS_EXTENT_DELALLOC)) {
+			if (credits < 2) {
+				err = -EAGAIN;
+				break;
+			}
+
+			/* n blocks never span more than n / bits + 2 */
+			if (to - from >
+			    (uint64_t)(credits - 1) * AMNESIAFS_BITS_PER_BLOCK) {
+				from = to - (uint64_t)(credits - 1) *
+						    AMNESIAFS_BITS_PER_BLOCK;
+				err = -EAGAIN;
+			}
+
+			first = ext->physical + (from - ext->logical);
+			last = ext->physical + (to - ext->logical) - 1;
+			span = last / AMNESIAFS_BITS_PER_BLOCK -
+			       first / AMNESIAFS_BITS_PER_BLOCK + 1;
+			credits -= span;
+		}
+
+		if (to < ext_end) {
+			/* keep the part past the hole */
+			tail = *ext;
+			tail.logical = to;
+			tail.len = ext_end - to;
+			if (!(tail.flags & AMNESIAFS_EXTENT_DELALLOC))
+				tail.physical += to - ext->logical;
+
+			err = amnesiafs_extent_insert_at(info, i + 1, &tail);
+			if (err)
+				break;
+			ext = &info->extents[i];
+			ext->len = to - ext->logical;
+		}
+
+		amnesiafs_extent_release(inode, ext, from, to);
+		if (from > ext->logical)
+			ext->len = from - ext->logical;
+		else
+			amnesiafs_extent_delete_at(info, i);
+
+		if (err)
+			break;
+		end = from;
+	}
+
+	return err;
+}
+
+/*
+ * Unmap file blocks [start, end) and save the inode, in as many
+ * transactions as it takes.
+ */
+int amnesiafs_extent_free_range(struct inode *inode, uint64_t start,
+				uint64_t end)
+{
+	struct super_block *sb = inode->i_sb;
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+	int err;
+
+	do {
+		err = amnesiafs_journal_start(sb, AMNESIAFS_FREE_CREDITS);
+		if (err)
+			return err;
+
+		down_write(&info->extent_lock);
+		err = amnesiafs_extent_punch(inode, start, end,
+					     AMNESIAFS_FREE_CREDITS -
+						     AMNESIAFS_REFCOUNT_CREDITS -
+						     AMNESIAFS_SAVE_CREDITS);
+		up_write(&info->extent_lock);
+		if (!err || err == -EAGAIN) {
+			int save_err = amnesiafs_inode_save(inode);
+
+			if (save_err)
+				err = save_err;
+		}
+		amnesiafs_journal_stop(sb);
+	} while (err == -EAGAIN);
+
+	return err;
+}
+
+/*
+ * Stage stored new blocks, returned in block, for the compression cluster
+ * at file block lblk to be written to. The cluster keeps reading from
+ * whatever backs it now until amnesiafs_extent_remap_cluster() swaps them
+ * in, once they're on disk, so a crash in between loses nothing, as with
+ * btrfs's ordered extents. *reserved is what write_begin set aside for
+ * rewriting the cluster, and comes down as for amnesiafs_extent_allocate().
+ */
+int amnesiafs_extent_stage_cluster(struct inode *inode, uint64_t lblk,
+				   unsigned int stored, unsigned int *reserved,
+				   uint64_t *block)
+{
+	struct super_block *sb = inode->i_sb;
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+	uint64_t goal = amnesiafs_inode_goal(sb, info->raw.inode_no);
+	unsigned int claimed;
+	int i, err;
+
+	down_read(&info->extent_lock);
+	i = amnesiafs_extent_find(info, lblk);
+	if (i >= 0 && !(info->extents[i].flags & AMNESIAFS_EXTENT_DELALLOC))
+		goal = info->extents[i].physical +
+		       amnesiafs_extent_stored(&info->extents[i]);
+	up_read(&info->extent_lock);
+
+	claimed = min(*reserved, stored);
+	err = amnesiafs_stage_blocks(sb, goal, claimed, stored - claimed,
+				     block);
+	if (err)
+		return err;
+	*reserved -= claimed;
+	if (*reserved)
+		amnesiafs_release_blocks(sb, *reserved);
+	*reserved = 0;
+
+	return 0;
+}
+
+/*
+ * Replace whatever backs file blocks [lblk, lblk + nr), a compression
+ * cluster, with the stored blocks at block that
+ * amnesiafs_extent_stage_cluster() set aside, now that they've been
+ * written. flags is what the new extent gets: a compressed extent, or a
+ * plain one when the data didn't shrink and stored == nr. Called from I/O
+ * completion; the cluster's pages are still under writeback, so nothing
+ * else maps the range in the meantime.
+ */
+int amnesiafs_extent_remap_cluster(struct inode *inode, uint64_t lblk,
+				   unsigned int nr, unsigned int stored,
+				   uint32_t flags, uint64_t block)
+{
+	struct super_block *sb = inode->i_sb;
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+	struct amnesiafs_extent ext;
+	int err, save_err;
+
+	err = amnesiafs_journal_start(sb, AMNESIAFS_CLUSTER_CREDITS);
+	if (err) {
+		amnesiafs_stage_cancel(sb, block, stored, 0);
+		return err;
+	}
+
+	/*
+	 * Under the one lock hold, so that write_begin can't slip a
+	 * reservation into the hole in between.
+	 */
+	down_write(&info->extent_lock);
+	err = amnesiafs_extent_punch(inode, lblk, lblk + nr,
+				     2 * AMNESIAFS_CLUSTER_BLOCKS);
+	if (!err) {
+		ext.logical = lblk;
+		ext.physical = block;
+		ext.len = nr;
+		ext.flags = flags;
+		err = amnesiafs_extent_insert(info, &ext);
+	}
+	if (err) {
+		amnesiafs_stage_cancel(sb, block, stored, 0);
+		goto out_unlock;
+	}
+	amnesiafs_stage_commit(sb, block, stored);
+	inode_add_bytes(inode, (loff_t)stored * AMNESIAFS_BLOCKSIZE);
+
+	amnesiafs_debug("inode %lu: cluster %llu-%llu in %u blocks at %llu",
+			inode->i_ino, lblk, lblk + nr - 1, stored, block);
+
+out_unlock:
+	up_write(&info->extent_lock);
+	/* the punch may have got part of the way even if it failed */
+	save_err = amnesiafs_inode_save(inode);
+	if (!err)
+		err = save_err;
+	amnesiafs_journal_stop(sb);
+	return err;
+}
+
+/* Does any part of the file live in a compressed cluster? */
+bool amnesiafs_extent_has_compressed(struct amnesiafs_inode_info *info)
+{
+	bool compressed = false;
+	unsigned int i;
+
+	down_read(&info->extent_lock);
+	for (i = 0; i < info->nr_extents && !compressed; i++)
+		compressed = info->extents[i].flags &
+			     AMNESIAFS_EXTENT_COMPRESSED;
+	up_read(&info->extent_lock);
+
+	return compressed;
+}
+
+/*
+ * Allocate unwritten extents over the holes in file blocks [start, end).
+ * They read as zeros until they're written. Delalloc blocks already have
+ * their space reserved and are left to writeback.
+ */
+int amnesiafs_extent_prealloc(struct inode *inode, uint64_t start,
+			      uint64_t end)
+{
+	struct super_block *sb = inode->i_sb;
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+	struct amnesiafs_extent ext;
+	unsigned int count;
+	uint64_t goal;
+	int i, err;
+
+	while (start < end) {
+		err = amnesiafs_journal_start(sb, AMNESIAFS_ALLOC_CREDITS);
+		if (err)
+			return err;
+
+		down_write(&info->extent_lock);
+		if (amnesiafs_extent_lookup(info, start, &ext)) {
+			up_write(&info->extent_lock);
+			amnesiafs_journal_stop(sb);
+			start = ext.logical + ext.len;
+			continue;
+		}
+
+		err = amnesiafs_extent_make_room(info);
+		if (err)
+			goto out_unlock;
+
+		goal = amnesiafs_inode_goal(sb, info->raw.inode_no);
+		i = amnesiafs_extent_find(info, start);
+		if (i >= 0 &&
+		    !(info->extents[i].flags & AMNESIAFS_EXTENT_DELALLOC))
+			goal = info->extents[i].physical + info->extents[i].len;
+
+		count = min_t(uint64_t, min_t(uint64_t, ext.len, end - start),
+			      AMNESIAFS_MAX_ALLOC_BLOCKS);
+		while ((err = amnesiafs_new_blocks(sb, goal, count,
+						   &ext.physical)) == -ENOSPC &&
+		       count > 1)
+			count /= 2;
+		if (err)
+			goto out_unlock;
+
+		ext.len = count;
+		ext.flags = AMNESIAFS_EXTENT_UNWRITTEN;
+		/* can't fail, there's room */
+		amnesiafs_extent_insert(info, &ext);
+		inode_add_bytes(inode, (loff_t)count * AMNESIAFS_BLOCKSIZE);
+		start += count;
+
+out_unlock:
+		up_write(&info->extent_lock);
+		if (!err)
+			err = amnesiafs_inode_save(inode);
+		amnesiafs_journal_stop(sb);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+/*
+ * Point file blocks [dst_start, dst_start + count) of dst, which must be a
+ * hole, at the blocks behind the same number of blocks of src from
+ * src_start. Holes in src stay holes, and it mustn't have any delalloc
+ * blocks in the range. Both inodes are saved.
+ */
+int amnesiafs_extent_clone(struct inode *src, uint64_t src_start,
+			   struct inode *dst, uint64_t dst_start,
+			   uint64_t count)
+{
+	struct super_block *sb = src->i_sb;
+	struct amnesiafs_inode_info *src_info = AMNESIAFS_I(src);
+	struct amnesiafs_inode_info *dst_info = AMNESIAFS_I(dst);
+	struct amnesiafs_extent ext;
+	uint64_t pos = src_start, end = src_start + count, len;
+	bool mapped;
+	int i, err;
+
+	while (pos < end) {
+		err = amnesiafs_journal_start(sb, AMNESIAFS_CLONE_CREDITS);
+		if (err)
+			return err;
+
+		down_write(&src_info->extent_lock);
+		mapped = amnesiafs_extent_lookup(src_info, pos, &ext);
+		if (mapped && !WARN_ON_ONCE(ext.flags &
+					    AMNESIAFS_EXTENT_DELALLOC)) {
+			/* a hint, so it's fine for it to cover the whole extent */
+			i = amnesiafs_extent_find(src_info, pos);
+			src_info->extents[i].flags |= AMNESIAFS_EXTENT_SHARED;
+			amnesiafs_extent_merge(src_info, i);
+		}
+		up_write(&src_info->extent_lock);
+
+		len = min(ext.logical + ext.len - pos, end - pos);
+		if (!mapped) {
+			amnesiafs_journal_stop(sb);
+			pos += len;
+			continue;
+		}
+		if (ext.flags & AMNESIAFS_EXTENT_DELALLOC) {
+			err = -EIO;
+			goto out_stop;
+		}
+		if (ext.flags & AMNESIAFS_EXTENT_COMPRESSED) {
+			/* the caller checks, this is just in case */
+			err = -EOPNOTSUPP;
+			goto out_stop;
+		}
+
+		ext.physical += pos - ext.logical;
+		ext.logical = dst_start + (pos - src_start);
+		ext.len = len;
+		ext.flags |= AMNESIAFS_EXTENT_SHARED;
+
+		err = amnesiafs_refcount_get(sb, ext.physical, len);
+		if (err)
+			goto out_stop;
+
+		down_write(&dst_info->extent_lock);
+		err = amnesiafs_extent_insert(dst_info, &ext);
+		up_write(&dst_info->extent_lock);
+		if (err) {
+			amnesiafs_refcount_put(sb, ext.physical, len);
+			goto out_stop;
+		}
+		inode_add_bytes(dst, len * AMNESIAFS_BLOCKSIZE);
+
+		err = amnesiafs_inode_save(src);
+		if (!err)
+			err = amnesiafs_inode_save(dst);
+out_stop:
+		amnesiafs_journal_stop(sb);
+		if (err)
+			return err;
+		pos += len;
+	}
+
+	return 0;
+}
+
+/*
+ * Give back the reservations of an inode that's going away. Its pages have
+ * been thrown out, so they'll never be allocated.
+ */
+void amnesiafs_extent_release_delalloc(struct inode *inode)
+{
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+	struct amnesiafs_extent *ext;
+	int i = 0;
+
+	down_write(&info->extent_lock);
+	while (i < (int)info->nr_extents) {
+		ext = &info->extents[i];
+		if (ext->flags & AMNESIAFS_EXTENT_DELALLOC) {
+			amnesiafs_extent_release(inode, ext, ext->logical,
+						 ext->logical + ext->len);
+			amnesiafs_extent_delete_at(info, i);
+		} else {
+			i++;
+		}
+	}
+	up_write(&info->extent_lock);
+}
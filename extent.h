@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#ifndef AMNESIAFS_EXTENT_H
+#define AMNESIAFS_EXTENT_H
+
+#include <linux/fs.h>
+
+#include "amnesiafs.h"
+#include "inode.h"
+
+/* how many blocks ext takes up on disk */
+static inline unsigned int
+amnesiafs_extent_stored(const struct amnesiafs_extent *ext)
+{
+	if (ext->flags & AMNESIAFS_EXTENT_COMPRESSED)
+		return AMNESIAFS_EXTENT_STORED(ext->flags);
+	return ext->len;
+}
+
+bool amnesiafs_extent_lookup(struct amnesiafs_inode_info *info, uint64_t lblk,
+			     struct amnesiafs_extent *ext);
+
+int amnesiafs_extent_insert(struct amnesiafs_inode_info *info,
+			    const struct amnesiafs_extent *ext);
+
+int amnesiafs_extent_load(struct super_block *sb,
+			  struct amnesiafs_inode_info *info);
+
+int amnesiafs_extent_store(struct super_block *sb,
+			   struct amnesiafs_inode_info *info);
+
+void amnesiafs_extent_destroy(struct amnesiafs_inode_info *info);
+
+int amnesiafs_extent_reserve(struct inode *inode, uint64_t lblk);
+
+unsigned int amnesiafs_extent_cow_blocks(struct inode *inode, uint64_t lblk);
+
+int amnesiafs_extent_allocate(struct inode *inode, uint64_t lblk,
+			      unsigned int *reserved, uint64_t *block,
+			      bool *unwritten);
+
+int amnesiafs_extent_convert_range(struct inode *inode, uint64_t start,
+				   uint64_t end);
+
+void amnesiafs_extent_cow_cancel(struct inode *inode, uint64_t start,
+				 uint64_t end);
+
+int amnesiafs_extent_free_range(struct inode *inode, uint64_t start,
+				uint64_t end);
+
+int amnesiafs_extent_stage_cluster(struct inode *inode, uint64_t lblk,
+				   unsigned int stored, unsigned int *reserved,
+				   uint64_t *block);
+
+int amnesiafs_extent_remap_cluster(struct inode *inode, uint64_t lblk,
+				   unsigned int nr, unsigned int stored,
+				   uint32_t flags, uint64_t block);
+
+bool amnesiafs_extent_has_compressed(struct amnesiafs_inode_info *info);
+
+int amnesiafs_extent_prealloc(struct inode *inode, uint64_t start,
+			      uint64_t end);
+
+int amnesiafs_extent_clone(struct inode *src, uint64_t src_start,
+			   struct inode *dst, uint64_t dst_start,
+			   uint64_t count);
+
+void amnesiafs_extent_release_delalloc(struct inode *inode);
+
+#endif
@@ -1,113 +1,1546 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 
-#include <linux/buffer_head.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/fs.h>
+#include <linux/highmem.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/sizes.h>
+#include <linux/slab.h>
 #include <linux/uio.h>
+#include <linux/writeback.h>
 
+#include "amnesiafs.h"
+
+#include "alloc.h"
+#include "compress.h"
+#include "crypt.h"
+#include "extent.h"
+#include "file.h"
 #include "inode.h"
+#include "journal.h"
 #include "log.h"
+#include "prealloc.h"
+#include "reclaim.h"
 #include "super.h"
+#include "volume.h"
+
+/*
+ * File data lives in the page cache, a block to a page, and is read and
+ * written with bios built here. Pages bound for consecutive blocks share a
+ * bio, so delayed allocation handing out contiguous runs pays off as large
+ * requests. On a striped volume a run is split where it crosses from one
+ * device to the next.
+ *
+ * With compression on, an aligned cluster of pages that's all new goes to
+ * disk compressed in a bio of its own, as long as that saves at least a
+ * block; anything else is stored raw. Compressed clusters are only ever
+ * read, and rewritten, whole.
+ */
+struct amnesiafs_io {
+	struct super_block *sb;
+	struct bio *bio;
+	/*
+	 * where the next page has to go to join bio, on bdev, and in the
+	 * volume, which is what its encryption tweak follows
+	 */
+	struct block_device *bdev;
+	uint64_t next_block;
+	uint64_t next_volume_block;
+	/* bio's blocks are unwritten ones, to be converted once written */
+	bool unwritten;
+	unsigned int opf;
+	/* the last compressed cluster read, decompressed, and where it's from */
+	void *cluster;
+	uint64_t cluster_block;
+};
+
+/* the file pages of a compressed cluster being written, and the copy */
+struct amnesiafs_cluster_io {
+	unsigned int nr;
+	struct page *pages[AMNESIAFS_CLUSTER_BLOCKS];
+	unsigned int nr_out;
+	struct page *out_pages[AMNESIAFS_CLUSTER_BLOCKS];
+	/* staged for the cluster, see amnesiafs_extent_stage_cluster() */
+	uint64_t block;
+	uint32_t flags;
+};
 
-ssize_t amnesiafs_read_iter(struct kiocb *iocb, struct iov_iter *to)
+static void amnesiafs_read_end_io(struct bio *bio)
 {
-	struct file *file = iocb->ki_filp;
-	struct inode *inode = file->f_mapping->host;
-	struct amnesiafs_inode *amnesiafs_inode =
-		amnesiafs_get_inode_from_generic(inode);
-	struct buffer_head *bh;
-	ssize_t err;
-	ssize_t to_read;
-	ssize_t read = 0;
-	char *buffer;
+	struct bio_vec *bvec;
+	struct bvec_iter_all iter_all;
 
-	amnesiafs_debug("amnesiafs_read_iter");
+	bio_for_each_segment_all(bvec, bio, iter_all) {
+		struct page *page = bvec->bv_page;
 
-	if (iocb->ki_pos >= amnesiafs_inode->file_size) {
-		return 0;
+		if (bio->bi_status) {
+			ClearPageUptodate(page);
+			SetPageError(page);
+		} else {
+			SetPageUptodate(page);
+		}
+		unlock_page(page);
 	}
 
-	bh = sb_bread(inode->i_sb, amnesiafs_inode->data_block_number);
-	if (!bh) {
-		amnesiafs_err("reading the block number [%llu] failed.",
-			      amnesiafs_inode->data_block_number);
-		err = -EIO;
-		goto out;
+	bio_put(bio);
+}
+
+static void amnesiafs_write_end_pages(struct bio *bio, int err)
+{
+	struct bio_vec *bvec;
+	struct bvec_iter_all iter_all;
+
+	bio_for_each_segment_all(bvec, bio, iter_all) {
+		struct page *page = bvec->bv_page;
+
+		if (err) {
+			SetPageError(page);
+			mapping_set_error(page->mapping, err);
+		}
+		end_page_writeback(page);
+	}
+
+	bio_put(bio);
+}
+
+static void amnesiafs_write_end_io(struct bio *bio)
+{
+	amnesiafs_write_end_pages(bio, blk_status_to_errno(bio->bi_status));
+}
+
+/* A cluster's bio carries a copy, its file pages are in cio. */
+static void amnesiafs_cluster_end_pages(struct bio *bio, int err)
+{
+	struct amnesiafs_cluster_io *cio = bio->bi_private;
+	unsigned int i;
+
+	for (i = 0; i < cio->nr; i++) {
+		if (err) {
+			SetPageError(cio->pages[i]);
+			mapping_set_error(cio->pages[i]->mapping, err);
+		}
+		end_page_writeback(cio->pages[i]);
+	}
+
+	for (i = 0; i < cio->nr_out; i++)
+		__free_page(cio->out_pages[i]);
+
+	kfree(cio);
+	bio_put(bio);
+}
+
+static struct inode *amnesiafs_bio_inode(struct bio *bio)
+{
+	struct amnesiafs_cluster_io *cio = bio->bi_private;
+
+	if (cio)
+		return cio->pages[0]->mapping->host;
+	return bio_first_page_all(bio)->mapping->host;
+}
+
+/*
+ * Convert a run of written pages, or give back the copies staged for them
+ * if the write, or converting an earlier run, failed.
+ */
+static int amnesiafs_convert_run(struct inode *inode, pgoff_t start,
+				 pgoff_t end, int err)
+{
+	if (err) {
+		amnesiafs_extent_cow_cancel(inode, start, end);
+		return err;
 	}
+	return amnesiafs_extent_convert_range(inode, start, end);
+}
 
-	buffer = (char *)bh->b_data;
-	to_read = min(amnesiafs_inode->file_size, (uint64_t)iov_iter_iovec(to).iov_len);
-	read = copy_to_iter(buffer, to_read, to);
-	amnesiafs_debug("want %ld bytes, got %ld", to_read, read);
-	if (read <= 0) {
-		brelse(bh);
-		amnesiafs_err("copy_to_iter failed");
-		err = -EFAULT;
+/*
+ * Blocks written into unwritten extents are only marked written once the
+ * data is on disk, or a crash in between would leave them reading as
+ * whatever was there before. Writeback maps every new block that way, so
+ * no commit ever says a block holds data it doesn't have yet; and blocks
+ * replacing ones that hold data, copies of shared blocks and rewritten
+ * clusters, are only swapped in then, so the old data stays until the new
+ * is there. Converting takes a journal handle, so completion hands the bio
+ * to a worker, and its pages stay under writeback until it's done; fsync
+ * waiting on them then finds the conversion in the journal.
+ */
+static void amnesiafs_convert_bio(struct bio *bio)
+{
+	struct amnesiafs_cluster_io *cio = bio->bi_private;
+	struct inode *inode = amnesiafs_bio_inode(bio);
+	struct bio_vec *bvec;
+	struct bvec_iter_all iter_all;
+	pgoff_t start = 0, end = 0;
+	int err = blk_status_to_errno(bio->bi_status);
+
+	if (cio) {
+		start = cio->pages[0]->index;
+		end = start + cio->nr;
+		if (err)
+			amnesiafs_stage_cancel(inode->i_sb, cio->block,
+					       cio->nr_out, 0);
+		else
+			err = amnesiafs_extent_remap_cluster(inode, start,
+							     cio->nr,
+							     cio->nr_out,
+							     cio->flags,
+							     cio->block);
 		goto out;
 	}
 
-	brelse(bh);
-	amnesiafs_debug("returning %lld", max(amnesiafs_inode->file_size - read, (uint64_t)0));
-	return max(amnesiafs_inode->file_size - read, (uint64_t)0);
+	/* the pages are in order, and usually one run */
+	bio_for_each_segment_all(bvec, bio, iter_all) {
+		if (end > start && bvec->bv_page->index == end) {
+			end++;
+			continue;
+		}
+		if (end > start)
+			err = amnesiafs_convert_run(inode, start, end, err);
+		start = bvec->bv_page->index;
+		end = start + 1;
+	}
+	err = amnesiafs_convert_run(inode, start, end, err);
 
 out:
+	if (err && bio->bi_status == BLK_STS_OK)
+		amnesiafs_err("inode %lu: couldn't convert blocks %lu-%lu: %d",
+			      inode->i_ino, start, end - 1, err);
+	if (cio)
+		amnesiafs_cluster_end_pages(bio, err);
+	else
+		amnesiafs_write_end_pages(bio, err);
+}
+
+static void amnesiafs_convert_work(struct work_struct *work)
+{
+	struct amnesiafs_sb_info *sbi =
+		container_of(work, struct amnesiafs_sb_info, convert_work);
+	struct bio_list bios;
+	struct bio *bio;
+
+	spin_lock_irq(&sbi->convert_lock);
+	bios = sbi->convert_bios;
+	bio_list_init(&sbi->convert_bios);
+	spin_unlock_irq(&sbi->convert_lock);
+
+	while ((bio = bio_list_pop(&bios)))
+		amnesiafs_convert_bio(bio);
+}
+
+static void amnesiafs_unwritten_end_io(struct bio *bio)
+{
+	struct amnesiafs_sb_info *sbi =
+		AMNESIAFS_SB(amnesiafs_bio_inode(bio)->i_sb);
+	unsigned long flags;
+
+	spin_lock_irqsave(&sbi->convert_lock, flags);
+	bio_list_add(&sbi->convert_bios, bio);
+	spin_unlock_irqrestore(&sbi->convert_lock, flags);
+
+	queue_work(sbi->convert_wq, &sbi->convert_work);
+}
+
+int amnesiafs_io_init(struct super_block *sb)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+
+	spin_lock_init(&sbi->convert_lock);
+	bio_list_init(&sbi->convert_bios);
+	INIT_WORK(&sbi->convert_work, amnesiafs_convert_work);
+
+	/* writeback may be waiting on it to free memory */
+	sbi->convert_wq = alloc_workqueue("amnesiafs-convert/%s",
+					  WQ_MEM_RECLAIM | WQ_UNBOUND, 1,
+					  sb->s_id);
+	return sbi->convert_wq ? 0 : -ENOMEM;
+}
+
+/* All writeback has finished by now, this waits out the worker itself. */
+void amnesiafs_io_destroy(struct super_block *sb)
+{
+	destroy_workqueue(AMNESIAFS_SB(sb)->convert_wq);
+}
+
+static void amnesiafs_io_submit(struct amnesiafs_io *io)
+{
+	if (!io->bio)
+		return;
+
+	submit_bio(io->bio);
+	io->bio = NULL;
+}
+
+static void amnesiafs_io_add_page(struct amnesiafs_io *io, struct page *page,
+				  uint64_t block, bool unwritten)
+{
+	struct block_device *bdev;
+	uint64_t dev_block;
+
+	bdev = amnesiafs_map_block(io->sb, block, &dev_block, NULL);
+	if (io->bio && (bdev != io->bdev || dev_block != io->next_block ||
+			block != io->next_volume_block ||
+			unwritten != io->unwritten))
+		amnesiafs_io_submit(io);
+
+	for (;;) {
+		if (!io->bio) {
+			io->bio = bio_alloc(GFP_NOFS, BIO_MAX_PAGES);
+			bio_set_dev(io->bio, bdev);
+			io->bio->bi_iter.bi_sector =
+				dev_block * (AMNESIAFS_BLOCKSIZE >> SECTOR_SHIFT);
+			io->bio->bi_opf = io->opf;
+			if (!op_is_write(io->opf))
+				io->bio->bi_end_io = amnesiafs_read_end_io;
+			else if (unwritten)
+				io->bio->bi_end_io = amnesiafs_unwritten_end_io;
+			else
+				io->bio->bi_end_io = amnesiafs_write_end_io;
+			amnesiafs_crypt_set_ctx(io->sb, io->bio, block);
+		}
+
+		if (bio_add_page(io->bio, page, PAGE_SIZE, 0) == PAGE_SIZE)
+			break;
+
+		/* full */
+		amnesiafs_io_submit(io);
+	}
+
+	io->bdev = bdev;
+	io->next_block = dev_block + 1;
+	io->next_volume_block = block + 1;
+	io->unwritten = unwritten;
+}
+
+/*
+ * Build bios for count pages going to volume blocks from block on, one for
+ * each device run they cross. All but the last are chained to it and
+ * submitted, and the last is left for the caller to finish and submit.
+ */
+static struct bio *amnesiafs_bio_chain(struct super_block *sb,
+				       uint64_t block, struct page **pages,
+				       unsigned int count, unsigned int opf)
+{
+	struct block_device *bdev;
+	struct bio *bio = NULL, *prev;
+	uint64_t dev_block;
+	unsigned int run, i, j;
+
+	for (i = 0; i < count; i += run) {
+		bdev = amnesiafs_map_block(sb, block + i, &dev_block, &run);
+		run = min(run, count - i);
+
+		prev = bio;
+		bio = bio_alloc(GFP_NOFS, run);
+		bio_set_dev(bio, bdev);
+		bio->bi_iter.bi_sector =
+			dev_block * (AMNESIAFS_BLOCKSIZE >> SECTOR_SHIFT);
+		bio->bi_opf = opf;
+		amnesiafs_crypt_set_ctx(sb, bio, block + i);
+		for (j = 0; j < run; j++)
+			bio_add_page(bio, pages[i + j], PAGE_SIZE, 0);
+
+		if (prev) {
+			bio_chain(prev, bio);
+			submit_bio(prev);
+		}
+	}
+
+	return bio;
+}
+
+/* Fill a page of a file whose contents live in its inode. */
+static void amnesiafs_read_inline_page(struct amnesiafs_inode_info *info,
+				       struct page *page, loff_t size)
+{
+	char *addr = kmap_atomic(page);
+	size_t len = 0;
+
+	if (!page->index)
+		len = min_t(loff_t, size, AMNESIAFS_INLINE_DATA_MAX);
+
+	memcpy(addr, info->raw.inline_data, len);
+	memset(addr + len, 0, PAGE_SIZE - len);
+	kunmap_atomic(addr);
+
+	flush_dcache_page(page);
+	SetPageUptodate(page);
+	unlock_page(page);
+}
+
+/* Read count blocks from block into buf, waiting for them. */
+static int amnesiafs_read_blocks(struct super_block *sb, uint64_t block,
+				 unsigned int count, void *buf)
+{
+	struct page *pages[AMNESIAFS_CLUSTER_BLOCKS];
+	struct bio *bio;
+	unsigned int i;
+	char *addr;
+	int err = 0;
+
+	for (i = 0; i < count; i++) {
+		pages[i] = alloc_page(GFP_NOFS);
+		if (!pages[i]) {
+			err = -ENOMEM;
+			goto out;
+		}
+	}
+
+	bio = amnesiafs_bio_chain(sb, block, pages, count, REQ_OP_READ);
+	err = submit_bio_wait(bio);
+	bio_put(bio);
+	for (i = 0; !err && i < count; i++) {
+		addr = kmap_atomic(pages[i]);
+		memcpy(buf + i * PAGE_SIZE, addr, PAGE_SIZE);
+		kunmap_atomic(addr);
+	}
+	i = count;
+
+out:
+	while (i--)
+		__free_page(pages[i]);
 	return err;
 }
 
-ssize_t amnesiafs_write_iter(struct kiocb *iocb, struct iov_iter *from)
+/*
+ * Read the compressed cluster ext and decompress it whole into buf, which has
+ * room for AMNESIAFS_CLUSTER_BLOCKS blocks.
+ */
+static int amnesiafs_load_cluster(struct super_block *sb,
+				  const struct amnesiafs_extent *ext, void *buf)
 {
-	struct file *file = iocb->ki_filp;
-	struct inode *inode = file->f_mapping->host;
-	struct amnesiafs_super_block *sb = amnesiafs_get_super(inode->i_sb);
-	struct amnesiafs_inode *amnesiafs_inode =
-		amnesiafs_get_inode_from_generic(inode);
-	struct buffer_head *bh;
-	ssize_t written = 0;
-	ssize_t err;
-	char *buffer;
+	unsigned int stored = AMNESIAFS_EXTENT_STORED(ext->flags);
+	void *raw;
+	int err;
 
-	amnesiafs_debug("amnesiafs_write_iter %s",
-			iocb->ki_filp->f_path.dentry->d_iname);
+	raw = kvmalloc(stored * AMNESIAFS_BLOCKSIZE, GFP_NOFS);
+	if (!raw)
+		return -ENOMEM;
 
-	err = file_update_time(file);
+	err = amnesiafs_read_blocks(sb, ext->physical, stored, raw);
+	if (!err)
+		err = amnesiafs_decompress(
+			sb, AMNESIAFS_EXTENT_ALGO(ext->flags), raw,
+			stored * AMNESIAFS_BLOCKSIZE, buf,
+			AMNESIAFS_CLUSTER_BLOCKS * AMNESIAFS_BLOCKSIZE);
+	kvfree(raw);
+
+	return err;
+}
+
+/*
+ * Fill page from the compressed cluster ext. The cluster is decompressed
+ * whole and kept in io, since readahead usually asks for the rest of its
+ * pages next.
+ */
+static void amnesiafs_read_cluster(struct amnesiafs_io *io, struct page *page,
+				   const struct amnesiafs_extent *ext)
+{
+	char *addr;
+	int err = 0;
+
+	if (!io->cluster) {
+		io->cluster = kvmalloc(AMNESIAFS_CLUSTER_BLOCKS *
+					       AMNESIAFS_BLOCKSIZE,
+				       GFP_NOFS);
+		if (!io->cluster) {
+			err = -ENOMEM;
+			goto out;
+		}
+	}
+
+	/* block 0 is the super block, so it never names a cluster */
+	if (io->cluster_block != ext->physical) {
+		io->cluster_block = 0;
+
+		err = amnesiafs_load_cluster(io->sb, ext, io->cluster);
+		if (err)
+			goto out;
+
+		io->cluster_block = ext->physical;
+	}
+
+	addr = kmap_atomic(page);
+	memcpy(addr,
+	       io->cluster + (page->index - ext->logical) * AMNESIAFS_BLOCKSIZE,
+	       PAGE_SIZE);
+	kunmap_atomic(addr);
+	flush_dcache_page(page);
+	SetPageUptodate(page);
+
+out:
 	if (err) {
-		amnesiafs_err("file_update_time failed");
+		amnesiafs_err("reading cluster at %llu failed: %d",
+			      ext->physical, err);
+		ClearPageUptodate(page);
+		SetPageError(page);
+	}
+	unlock_page(page);
+}
+
+static void amnesiafs_read_page(struct amnesiafs_io *io, struct page *page)
+{
+	struct inode *inode = page->mapping->host;
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+	struct amnesiafs_extent ext;
+	bool mapped;
+
+	down_read(&info->extent_lock);
+	if (amnesiafs_has_inline_data(info)) {
+		amnesiafs_read_inline_page(info, page, i_size_read(inode));
+		up_read(&info->extent_lock);
+		return;
+	}
+	mapped = amnesiafs_extent_lookup(info, page->index, &ext);
+	up_read(&info->extent_lock);
+
+	/* holes and blocks that have never been written back read as zeros */
+	if (!mapped ||
+	    (ext.flags &
+	     (AMNESIAFS_EXTENT_DELALLOC | AMNESIAFS_EXTENT_UNWRITTEN)) ||
+	    page_offset(page) >= i_size_read(inode)) {
+		zero_user(page, 0, PAGE_SIZE);
+		SetPageUptodate(page);
+		unlock_page(page);
+		return;
+	}
+
+	if (ext.flags & AMNESIAFS_EXTENT_COMPRESSED) {
+		amnesiafs_read_cluster(io, page, &ext);
+		return;
+	}
+
+	amnesiafs_io_add_page(io, page,
+			      ext.physical + (page->index - ext.logical), false);
+}
+
+static int amnesiafs_readpage(struct file *file, struct page *page)
+{
+	struct amnesiafs_io io = {
+		.sb = page->mapping->host->i_sb,
+		.opf = REQ_OP_READ,
+	};
+
+	amnesiafs_read_page(&io, page);
+	amnesiafs_io_submit(&io);
+	kvfree(io.cluster);
+
+	return 0;
+}
+
+static void amnesiafs_readahead(struct readahead_control *rac)
+{
+	struct amnesiafs_io io = {
+		.sb = rac->mapping->host->i_sb,
+		.opf = REQ_OP_READ | REQ_RAHEAD,
+	};
+	struct page *page;
+
+	while ((page = readahead_page(rac))) {
+		amnesiafs_read_page(&io, page);
+		put_page(page);
+	}
+
+	amnesiafs_io_submit(&io);
+	kvfree(io.cluster);
+}
+
+/*
+ * Copy the first page of a small file into its inode. Returns -EAGAIN if the
+ * file has stopped being inline, in which case the page goes to disk like
+ * any other.
+ */
+static int amnesiafs_write_inline_page(struct page *page, loff_t size)
+{
+	struct inode *inode = page->mapping->host;
+	struct super_block *sb = inode->i_sb;
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+	size_t len = min_t(loff_t, size, AMNESIAFS_INLINE_DATA_MAX);
+	char *addr;
+	int err;
+
+	err = amnesiafs_journal_start(sb, AMNESIAFS_SAVE_CREDITS);
+	if (err)
+		return err;
+
+	down_write(&info->extent_lock);
+	if (!amnesiafs_has_inline_data(info)) {
+		up_write(&info->extent_lock);
+		amnesiafs_journal_stop(sb);
+		return -EAGAIN;
+	}
+
+	addr = kmap_atomic(page);
+	memcpy(info->raw.inline_data, addr, len);
+	kunmap_atomic(addr);
+	memset(info->raw.inline_data + len, 0,
+	       AMNESIAFS_INLINE_DATA_MAX - len);
+	up_write(&info->extent_lock);
+
+	err = amnesiafs_inode_save(inode);
+	amnesiafs_journal_stop(sb);
+
+	return err;
+}
+
+/*
+ * Blocks write_begin set aside for writing page back over shared or
+ * compressed blocks are kept in page->private until writeback uses them.
+ * A compressed cluster's reservation rides on whichever of its pages had
+ * one taken first.
+ */
+static unsigned int amnesiafs_page_reserved(struct page *page)
+{
+	return PagePrivate(page) ? page_private(page) : 0;
+}
+
+static void amnesiafs_page_set_reserved(struct page *page, unsigned int count)
+{
+	if (PagePrivate(page))
+		detach_page_private(page);
+	if (count)
+		attach_page_private(page, (void *)(unsigned long)count);
+}
+
+/*
+ * Reserve what writing back locked page will take on top of any delalloc
+ * reservation, unless it's been done already.
+ */
+static int amnesiafs_reserve_cow(struct inode *inode, struct page *page)
+{
+	struct page *p;
+	unsigned int count;
+	pgoff_t first, i;
+	bool reserved;
+	int err;
+
+	if (PagePrivate(page))
+		return 0;
+	count = amnesiafs_extent_cow_blocks(inode, page->index);
+	if (!count)
+		return 0;
+
+	/*
+	 * Writeback of the cluster takes every page of it that's locked, so
+	 * holding this one it can't have used up a reservation we find.
+	 */
+	first = round_down(page->index, AMNESIAFS_CLUSTER_BLOCKS);
+	for (i = first; count > 1 && i < first + AMNESIAFS_CLUSTER_BLOCKS;
+	     i++) {
+		p = find_get_page(inode->i_mapping, i);
+		if (!p)
+			continue;
+		reserved = PagePrivate(p);
+		put_page(p);
+		if (reserved)
+			return 0;
+	}
+
+	err = amnesiafs_reserve_blocks(inode->i_sb, count);
+	/* other files may be sitting on blocks taken ahead of appends */
+	if (err == -ENOSPC && amnesiafs_prealloc_trim_all(inode->i_sb))
+		err = amnesiafs_reserve_blocks(inode->i_sb, count);
+	if (err)
+		return err;
+
+	amnesiafs_page_set_reserved(page, count);
+	return 0;
+}
+
+/*
+ * Gather the pages of the cluster [first, first + nr) that page is part of,
+ * locked, into pages. Lower pages are only tried, since whoever holds one
+ * may be waiting for page. For a cluster being rewritten, pages missing from
+ * the page cache are added, and those that aren't up to date are left for
+ * the caller to fill in from the old cluster; for a new one, any missing
+ * page makes this fail with -EAGAIN.
+ */
+static int amnesiafs_lock_cluster(struct page *page, pgoff_t first,
+				  unsigned int nr, bool rewrite,
+				  struct page **pages)
+{
+	struct address_space *mapping = page->mapping;
+	struct page *p;
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		if (first + i == page->index) {
+			pages[i] = page;
+			continue;
+		}
+
+		p = find_get_page(mapping, first + i);
+		if (p && first + i < page->index && !trylock_page(p)) {
+			put_page(p);
+			goto out_busy;
+		} else if (p && first + i > page->index) {
+			lock_page(p);
+		}
+
+		if (p && (p->mapping != mapping ||
+			  (!rewrite && (!PageUptodate(p) || !PageDirty(p))))) {
+			unlock_page(p);
+			put_page(p);
+			goto out_busy;
+		}
+		/*
+		 * Under writeback with the rest, so nothing reads the page
+		 * from the new blocks before they've been written.
+		 */
+		if (!p && rewrite)
+			p = grab_cache_page_nowait(mapping, first + i);
+		if (!p)
+			goto out_busy;
+
+		wait_on_page_writeback(p);
+		pages[i] = p;
+	}
+
+	return 0;
+
+out_busy:
+	while (i--) {
+		if (pages[i] != page) {
+			unlock_page(pages[i]);
+			put_page(pages[i]);
+		}
+	}
+	return -EAGAIN;
+}
+
+/*
+ * Write out the compression cluster page belongs to in one go, if it's a
+ * new one that shrinks, or if it's compressed already and so has to be
+ * rewritten whole. Returns -EAGAIN with page still locked if it should be
+ * written on its own instead.
+ */
+static int amnesiafs_write_cluster(struct amnesiafs_io *io,
+				   struct writeback_control *wbc,
+				   struct page *page)
+{
+	struct inode *inode = page->mapping->host;
+	struct super_block *sb = inode->i_sb;
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+	struct page *pages[AMNESIAFS_CLUSTER_BLOCKS] = {};
+	struct page *out_pages[AMNESIAFS_CLUSTER_BLOCKS] = {};
+	struct amnesiafs_cluster_io *cio = NULL;
+	struct amnesiafs_extent ext;
+	pgoff_t first = round_down(page->index, AMNESIAFS_CLUSTER_BLOCKS);
+	loff_t size = i_size_read(inode);
+	unsigned int algo = AMNESIAFS_SB(sb)->config->compress;
+	unsigned int nr, stored, reserved = 0, taken, i;
+	void *buf = NULL, *out = NULL, *data;
+	struct bio *bio;
+	uint32_t flags;
+	uint64_t block;
+	char *addr;
+	bool rewrite;
+	int len, err;
+
+	nr = min_t(uint64_t, AMNESIAFS_CLUSTER_BLOCKS,
+		   DIV_ROUND_UP(size, PAGE_SIZE) - first);
+
+	down_read(&info->extent_lock);
+	rewrite = amnesiafs_extent_lookup(info, first, &ext) &&
+		  (ext.flags & AMNESIAFS_EXTENT_COMPRESSED);
+	up_read(&info->extent_lock);
+
+	if (rewrite)
+		algo = AMNESIAFS_EXTENT_ALGO(ext.flags);
+	else if (!algo || nr < 2 || ext.flags != AMNESIAFS_EXTENT_DELALLOC ||
+		 ext.logical + ext.len < first + nr)
+		/* only whole clusters that have never been written */
+		return -EAGAIN;
+
+	err = amnesiafs_lock_cluster(page, first, nr, rewrite, pages);
+	if (err)
+		goto out_busy;
+
+	err = -ENOMEM;
+	buf = kvmalloc(AMNESIAFS_CLUSTER_BLOCKS * PAGE_SIZE, GFP_NOFS);
+	out = kvmalloc(nr * PAGE_SIZE, GFP_NOFS);
+	cio = kmalloc(sizeof(*cio), GFP_NOFS);
+	if (!buf || !out || !cio)
+		goto out_unlock;
+
+	/*
+	 * Pages that weren't in the page cache come from the old cluster,
+	 * which is only read in here, once, when it's written back, rather
+	 * than having every write pull in and dirty the whole of it.
+	 */
+	for (i = 0; i < nr; i++) {
+		if (!PageUptodate(pages[i]))
+			break;
+	}
+	if (i < nr) {
+		err = amnesiafs_load_cluster(sb, &ext, buf);
+		if (err)
+			goto out_unlock;
+		/* truncate may have cut the extent short of the cluster */
+		if (ext.logical + ext.len < first + nr)
+			memset(buf + (ext.logical + ext.len - first) * PAGE_SIZE,
+			       0, (first + nr - ext.logical - ext.len) *
+					  PAGE_SIZE);
+
+		for (; i < nr; i++) {
+			if (PageUptodate(pages[i]))
+				continue;
+			addr = kmap_atomic(pages[i]);
+			memcpy(addr, buf + i * PAGE_SIZE, PAGE_SIZE);
+			kunmap_atomic(addr);
+			flush_dcache_page(pages[i]);
+			SetPageUptodate(pages[i]);
+		}
+	}
+
+	/* keep whatever's past the end of file zero on disk */
+	if (first + nr == DIV_ROUND_UP(size, PAGE_SIZE) && (size & ~PAGE_MASK))
+		zero_user_segment(pages[nr - 1], size & ~PAGE_MASK, PAGE_SIZE);
+
+	for (i = 0; i < nr; i++) {
+		addr = kmap_atomic(pages[i]);
+		memcpy(buf + i * PAGE_SIZE, addr, PAGE_SIZE);
+		kunmap_atomic(addr);
+	}
+
+	len = amnesiafs_compress(sb, algo, buf, nr * PAGE_SIZE, out);
+	stored = len > 0 ? DIV_ROUND_UP(len, AMNESIAFS_BLOCKSIZE) : nr;
+	if (stored < nr) {
+		flags = AMNESIAFS_EXTENT_COMPRESSION(algo, stored);
+		data = out;
+	} else if (rewrite) {
+		/* doesn't compress any more, so back to plain blocks */
+		flags = 0;
+		data = buf;
+	} else {
+		err = -EAGAIN;
+		goto out_unlock;
+	}
+
+	for (i = 0; i < stored; i++) {
+		out_pages[i] = alloc_page(GFP_NOFS);
+		if (!out_pages[i])
+			goto out_unlock;
+		addr = kmap_atomic(out_pages[i]);
+		memcpy(addr, data + i * PAGE_SIZE, PAGE_SIZE);
+		kunmap_atomic(addr);
+	}
+
+	for (i = 0; i < nr; i++)
+		reserved += amnesiafs_page_reserved(pages[i]);
+	taken = reserved;
+
+	err = amnesiafs_extent_stage_cluster(inode, first, stored, &reserved,
+					     &block);
+	if (reserved != taken) {
+		for (i = 0; i < nr; i++)
+			amnesiafs_page_set_reserved(pages[i], 0);
+		amnesiafs_page_set_reserved(page, reserved);
+	}
+	if (err == -ENOSPC && !rewrite) {
+		/* written a page at a time it may still fit, as reserved */
+		err = -EAGAIN;
+		goto out_unlock;
+	} else if (err) {
+		amnesiafs_err("inode %lu: couldn't allocate cluster %lu: %d",
+			      inode->i_ino, first, err);
+		goto out_unlock;
+	}
+
+	bio = amnesiafs_bio_chain(sb, block, out_pages, stored, io->opf);
+	bio->bi_end_io = amnesiafs_unwritten_end_io;
+	bio->bi_private = cio;
+
+	cio->block = block;
+	cio->flags = flags;
+	memcpy(cio->out_pages, out_pages, sizeof(out_pages));
+	cio->nr_out = stored;
+	cio->nr = 0;
+	for (i = 0; i < nr; i++) {
+		/* write_cache_pages has seen to page already */
+		if (pages[i] != page)
+			clear_page_dirty_for_io(pages[i]);
+		set_page_writeback(pages[i]);
+		cio->pages[cio->nr++] = pages[i];
+	}
+	for (i = 0; i < nr; i++) {
+		unlock_page(pages[i]);
+		if (pages[i] != page)
+			put_page(pages[i]);
+	}
+
+	submit_bio(bio);
+	kvfree(buf);
+	kvfree(out);
+	return 0;
+
+out_unlock:
+	for (i = 0; i < AMNESIAFS_CLUSTER_BLOCKS && out_pages[i]; i++)
+		__free_page(out_pages[i]);
+	for (i = 0; i < nr; i++) {
+		if (pages[i] != page) {
+			unlock_page(pages[i]);
+			put_page(pages[i]);
+		}
+	}
+	kfree(cio);
+	kvfree(buf);
+	kvfree(out);
+out_busy:
+	if (err == -EAGAIN && !rewrite)
+		return err;
+
+	if (err == -EAGAIN || err == -ENOMEM) {
+		/* the rest of the cluster is still dirty, try again later */
+		redirty_page_for_writepage(wbc, page);
+		unlock_page(page);
+		return err == -EAGAIN ? 0 : err;
+	}
+
+	SetPageError(page);
+	mapping_set_error(page->mapping, err);
+	unlock_page(page);
+	return err;
+}
+
+static int amnesiafs_write_page(struct page *page,
+				struct writeback_control *wbc, void *data)
+{
+	struct amnesiafs_io *io = data;
+	struct inode *inode = page->mapping->host;
+	loff_t size = i_size_read(inode);
+	pgoff_t end_index = size >> PAGE_SHIFT;
+	unsigned int offset = size & ~PAGE_MASK;
+	unsigned int reserved;
+	uint64_t block;
+	bool unwritten;
+	int err;
+
+	/* wholly past the end of file, truncate is about to throw it out */
+	if (page->index > end_index || (page->index == end_index && !offset)) {
+		unlock_page(page);
+		return 0;
+	}
+
+	/* keep whatever's past the end of file zero on disk */
+	if (page->index == end_index)
+		zero_user_segment(page, offset, PAGE_SIZE);
+
+	if (!page->index) {
+		/*
+		 * The page lock keeps conversion out of an inline file until
+		 * we're done with it.
+		 */
+		err = amnesiafs_write_inline_page(page, size);
+		if (err != -EAGAIN) {
+			if (err == -ENOMEM)
+				redirty_page_for_writepage(wbc, page);
+			unlock_page(page);
+			return err;
+		}
+	}
+
+	err = amnesiafs_write_cluster(io, wbc, page);
+	if (err != -EAGAIN)
+		return err;
+
+	reserved = amnesiafs_page_reserved(page);
+	err = amnesiafs_extent_allocate(inode, page->index, &reserved, &block,
+					&unwritten);
+	if (reserved != amnesiafs_page_reserved(page))
+		amnesiafs_page_set_reserved(page, reserved);
+	if (err == -ENOMEM) {
+		redirty_page_for_writepage(wbc, page);
+		unlock_page(page);
+		return err;
+	} else if (err) {
+		amnesiafs_err("inode %lu: couldn't allocate block %lu: %d",
+			      inode->i_ino, page->index, err);
+		SetPageError(page);
+		mapping_set_error(page->mapping, err);
+		unlock_page(page);
+		return err;
+	}
+
+	set_page_writeback(page);
+	unlock_page(page);
+	amnesiafs_io_add_page(io, page, block, unwritten);
+
+	return 0;
+}
+
+static int amnesiafs_writepage(struct page *page, struct writeback_control *wbc)
+{
+	struct amnesiafs_io io = {
+		.sb = page->mapping->host->i_sb,
+		.opf = REQ_OP_WRITE | wbc_to_write_flags(wbc),
+	};
+	int err;
+
+	err = amnesiafs_write_page(page, wbc, &io);
+	amnesiafs_io_submit(&io);
+
+	return err;
+}
+
+static int amnesiafs_writepages(struct address_space *mapping,
+				struct writeback_control *wbc)
+{
+	struct amnesiafs_io io = {
+		.sb = mapping->host->i_sb,
+		.opf = REQ_OP_WRITE | wbc_to_write_flags(wbc),
+	};
+	int err;
+
+	err = write_cache_pages(mapping, wbc, amnesiafs_write_page, &io);
+	amnesiafs_io_submit(&io);
+
+	return err;
+}
+
+/*
+ * How much of a file may be kept in its inode. Nothing, on an encrypted
+ * volume: blk-crypto only sees file data bios, so inline data would sit in
+ * the inode table in the clear.
+ */
+loff_t amnesiafs_inline_max(struct super_block *sb)
+{
+	if (AMNESIAFS_SB(sb)->disk_sb->features & AMNESIAFS_FEATURE_INLINE_CRYPT)
+		return 0;
+	return AMNESIAFS_INLINE_DATA_MAX;
+}
+
+/*
+ * Move an inline file's contents out to a data block, once it's about to
+ * outgrow its inode. The block is reserved like any other buffered write and
+ * allocated when the first page is written back. The caller holds i_rwsem.
+ */
+int amnesiafs_convert_inline(struct inode *inode)
+{
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+	struct page *page = NULL;
+	int err;
+
+	if (!amnesiafs_has_inline_data(info))
+		return 0;
+
+	if (i_size_read(inode)) {
+		page = read_mapping_page(inode->i_mapping, 0, NULL);
+		if (IS_ERR(page))
+			return PTR_ERR(page);
+		lock_page(page);
+
+		err = amnesiafs_extent_reserve(inode, 0);
+		if (err) {
+			unlock_page(page);
+			put_page(page);
+			return err;
+		}
+	}
+
+	down_write(&info->extent_lock);
+	info->raw.flags &= ~AMNESIAFS_INODE_INLINE_DATA;
+	memset(info->raw.inline_data, 0, AMNESIAFS_INLINE_DATA_MAX);
+	up_write(&info->extent_lock);
+
+	if (page) {
+		set_page_dirty(page);
+		unlock_page(page);
+		put_page(page);
+	}
+
+	return 0;
+}
+
+/*
+ * Buffered writes only reserve space here; the block itself is picked when
+ * the page is written back. Small files don't need a block at all. Writing
+ * over a shared block or a compressed cluster reserves the new blocks
+ * writeback will move it to too.
+ */
+static int amnesiafs_write_begin(struct file *file,
+				 struct address_space *mapping, loff_t pos,
+				 unsigned int len, unsigned int flags,
+				 struct page **pagep, void **fsdata)
+{
+	struct inode *inode = mapping->host;
+	struct page *page;
+	int err;
+
+	if (amnesiafs_has_inline_data(AMNESIAFS_I(inode)) &&
+	    pos + len > amnesiafs_inline_max(inode->i_sb)) {
+		err = amnesiafs_convert_inline(inode);
+		if (err)
+			return err;
+	}
+
+	if (!amnesiafs_has_inline_data(AMNESIAFS_I(inode))) {
+		err = amnesiafs_extent_reserve(inode, pos >> PAGE_SHIFT);
+		/* other files may be sitting on blocks taken ahead of appends */
+		if (err == -ENOSPC && amnesiafs_prealloc_trim_all(inode->i_sb))
+			err = amnesiafs_extent_reserve(inode,
+						       pos >> PAGE_SHIFT);
+		if (err)
+			return err;
+	}
+
+	page = grab_cache_page_write_begin(mapping, pos >> PAGE_SHIFT, flags);
+	if (!page)
+		return -ENOMEM;
+
+	if (!PageUptodate(page) && len != PAGE_SIZE) {
+		amnesiafs_readpage(file, page);
+		lock_page(page);
+		if (!PageUptodate(page)) {
+			unlock_page(page);
+			put_page(page);
+			return -EIO;
+		}
+	}
+
+	if (!amnesiafs_has_inline_data(AMNESIAFS_I(inode))) {
+		err = amnesiafs_reserve_cow(inode, page);
+		if (err) {
+			unlock_page(page);
+			put_page(page);
+			return err;
+		}
+	}
+
+	*pagep = page;
+	return 0;
+}
+
+static int amnesiafs_write_end(struct file *file,
+			       struct address_space *mapping, loff_t pos,
+			       unsigned int len, unsigned int copied,
+			       struct page *page, void *fsdata)
+{
+	struct inode *inode = mapping->host;
+
+	if (!PageUptodate(page)) {
+		/* a short copy into a page that was never read in */
+		if (copied < len) {
+			copied = 0;
+			goto out;
+		}
+		SetPageUptodate(page);
+	}
+
+	/* the new size goes to disk with the inode, see write_inode */
+	if (pos + copied > inode->i_size) {
+		i_size_write(inode, pos + copied);
+		mark_inode_dirty(inode);
+	}
+
+	set_page_dirty(page);
+
+out:
+	unlock_page(page);
+	put_page(page);
+
+	return copied;
+}
+
+/* Truncate gives back whatever a page had reserved. */
+static void amnesiafs_invalidatepage(struct page *page, unsigned int offset,
+				     unsigned int length)
+{
+	unsigned int reserved = amnesiafs_page_reserved(page);
+
+	if (!reserved || offset || length != PAGE_SIZE)
+		return;
+
+	amnesiafs_release_blocks(page->mapping->host->i_sb, reserved);
+	amnesiafs_page_set_reserved(page, 0);
+}
+
+/* Clean pages only hold a reservation after a write that copied nothing. */
+static int amnesiafs_releasepage(struct page *page, gfp_t gfp)
+{
+	if (PageDirty(page) || PageWriteback(page))
+		return 0;
+
+	amnesiafs_invalidatepage(page, 0, PAGE_SIZE);
+	return 1;
+}
+
+const struct address_space_operations amnesiafs_aops = {
+	.readpage = amnesiafs_readpage,
+	.readahead = amnesiafs_readahead,
+	.writepage = amnesiafs_writepage,
+	.writepages = amnesiafs_writepages,
+	.write_begin = amnesiafs_write_begin,
+	.write_end = amnesiafs_write_end,
+	.set_page_dirty = __set_page_dirty_nobuffers,
+	.invalidatepage = amnesiafs_invalidatepage,
+	.releasepage = amnesiafs_releasepage,
+};
+
+/*
+ * Zero bytes [from, to) of a single block through the page cache. Unwritten
+ * blocks read as zeros already, but may have data cached over them that's
+ * still waiting to be written, so only what's cached needs zeroing.
+ */
+int amnesiafs_zero_partial(struct inode *inode, loff_t from, loff_t to)
+{
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+	struct amnesiafs_extent ext;
+	struct page *page;
+	bool mapped;
+	int err;
+
+	if (from >= to)
+		return 0;
+
+	down_read(&info->extent_lock);
+	mapped = amnesiafs_extent_lookup(info, from / AMNESIAFS_BLOCKSIZE,
+					 &ext);
+	up_read(&info->extent_lock);
+	if (!mapped)
+		return 0;
+
+	if (ext.flags & AMNESIAFS_EXTENT_UNWRITTEN) {
+		page = find_get_page(inode->i_mapping, from >> PAGE_SHIFT);
+		if (!page)
+			return 0;
+		lock_page(page);
+		if (!PageUptodate(page)) {
+			unlock_page(page);
+			put_page(page);
+			return 0;
+		}
+	} else {
+		page = read_mapping_page(inode->i_mapping, from >> PAGE_SHIFT,
+					 NULL);
+		if (IS_ERR(page))
+			return PTR_ERR(page);
+
+		lock_page(page);
+		err = amnesiafs_reserve_cow(inode, page);
+		if (err) {
+			unlock_page(page);
+			put_page(page);
+			return err;
+		}
+	}
+	zero_user_segment(page, from & ~PAGE_MASK,
+			  ((to - 1) & ~PAGE_MASK) + 1);
+	set_page_dirty(page);
+	unlock_page(page);
+	put_page(page);
+
+	return 0;
+}
+
+/* Zero bytes [from, to) through the page cache, a block at a time. */
+static int amnesiafs_zero_range(struct inode *inode, loff_t from, loff_t to)
+{
+	loff_t next;
+	int err;
+
+	for (; from < to; from = next) {
+		next = min_t(loff_t, round_down(from, AMNESIAFS_BLOCKSIZE) +
+					     AMNESIAFS_BLOCKSIZE,
+			     to);
+		err = amnesiafs_zero_partial(inode, from, next);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+/*
+ * Turn [start, end) into a hole. Partial blocks at the edges are zeroed,
+ * whole ones are freed. Compressed clusters can't be split up, so in a file
+ * that has any the edges are zeroed out to whole clusters.
+ */
+static int amnesiafs_punch_hole(struct inode *inode, loff_t start, loff_t end)
+{
+	loff_t unit = AMNESIAFS_BLOCKSIZE;
+	loff_t first, last;
+	int err;
+
+	if (amnesiafs_extent_has_compressed(AMNESIAFS_I(inode)))
+		unit *= AMNESIAFS_CLUSTER_BLOCKS;
+	first = round_up(start, unit);
+	last = round_down(end, unit);
+
+	err = amnesiafs_zero_range(inode, start, min(end, first));
+	if (err)
+		return err;
+
+	if (last >= first) {
+		err = amnesiafs_zero_range(inode, max(start, last), end);
+		if (err)
+			return err;
+	}
+
+	if (last <= first)
+		return 0;
+
+	/* as with truncate, the pages go before anything needs a handle */
+	truncate_pagecache_range(inode, first, last - 1);
+	return amnesiafs_extent_free_range(inode, first / AMNESIAFS_BLOCKSIZE,
+					   last / AMNESIAFS_BLOCKSIZE);
+}
+
+static long amnesiafs_fallocate(struct file *file, int mode, loff_t offset,
+				loff_t len)
+{
+	struct inode *inode = file_inode(file);
+	loff_t end = offset + len;
+	int err;
+
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+		     FALLOC_FL_ZERO_RANGE))
+		return -EOPNOTSUPP;
+
+	inode_lock(inode);
+
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode)) {
+		err = inode_newsize_ok(inode, end);
+		if (err)
+			goto out;
+	}
+
+	err = amnesiafs_reclaim_sync(inode);
+	if (err)
+		goto out;
+
+	/* what's allocated past the end from here on is the caller's to keep */
+	err = amnesiafs_prealloc_trim(inode);
+	if (err)
+		goto out;
+
+	/* none of this is worth doing for data kept in the inode */
+	err = amnesiafs_convert_inline(inode);
+	if (err)
 		goto out;
+
+	if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+		err = amnesiafs_punch_hole(inode, offset, end);
+		if (err || (mode & FALLOC_FL_PUNCH_HOLE))
+			goto out;
 	}
 
-	bh = sb_bread(inode->i_sb, amnesiafs_inode->data_block_number);
-	if (!bh) {
-		amnesiafs_err("reading the block number [%llu] failed.",
-			      amnesiafs_inode->data_block_number);
-		err = -EIO;
+	err = amnesiafs_extent_prealloc(inode, offset / AMNESIAFS_BLOCKSIZE,
+					DIV_ROUND_UP(end, AMNESIAFS_BLOCKSIZE));
+	if (err)
 		goto out;
+
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode)) {
+		i_size_write(inode, end);
+		mark_inode_dirty(inode);
 	}
 
-	buffer = (char *)bh->b_data;
-	buffer += iocb->ki_pos;
+out:
+	inode_unlock(inode);
+	return err;
+}
+
+/*
+ * Find the next data or hole at or after offset. Unwritten extents count as
+ * data, since they may have dirty pages over them.
+ */
+static loff_t amnesiafs_seek_hole_data(struct inode *inode, loff_t offset,
+				       int whence)
+{
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+	loff_t size = i_size_read(inode);
+	struct amnesiafs_extent ext;
+	uint64_t lblk;
+	loff_t pos;
+	bool mapped;
 
-	written = copy_from_iter(buffer,
-				 min((size_t)AMNESIAFS_BLOCKSIZE,
-				     iov_iter_iovec(from).iov_len),
-				 from);
-	if (written <= 0) {
-		brelse(bh);
-		amnesiafs_err("copy_from_iter failed");
-		err = -EFAULT;
-		goto out;
+	if (offset < 0 || offset >= size)
+		return -ENXIO;
+
+	if (amnesiafs_has_inline_data(info))
+		return whence == SEEK_DATA ? offset : size;
+
+	down_read(&info->extent_lock);
+	lblk = offset / AMNESIAFS_BLOCKSIZE;
+	for (;;) {
+		mapped = amnesiafs_extent_lookup(info, lblk, &ext);
+		pos = max_t(loff_t, offset, ext.logical * AMNESIAFS_BLOCKSIZE);
+		if (pos >= size) {
+			pos = whence == SEEK_DATA ? -ENXIO : size;
+			break;
+		}
+		if (mapped == (whence == SEEK_DATA))
+			break;
+		lblk = ext.logical + ext.len;
 	}
+	up_read(&info->extent_lock);
+
+	return pos;
+}
 
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
-	brelse(bh);
+static loff_t amnesiafs_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct inode *inode = file->f_mapping->host;
 
-	amnesiafs_inode->file_size = written;
-	err = amnesiafs_inode_save(inode->i_sb, amnesiafs_inode);
-	if (err < 0)
+	switch (whence) {
+	case SEEK_DATA:
+	case SEEK_HOLE:
+		inode_lock_shared(inode);
+		offset = amnesiafs_seek_hole_data(inode, offset, whence);
+		inode_unlock_shared(inode);
+		if (offset < 0)
+			return offset;
+		return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+	default:
+		return generic_file_llseek(file, offset, whence);
+	}
+}
+
+/*
+ * Back FICLONE, FICLONERANGE and copy_file_range() by sharing the source's
+ * blocks with the destination instead of copying them. Writes to either
+ * side later get blocks of their own at writeback.
+ */
+static loff_t amnesiafs_remap_file_range(struct file *file_in, loff_t pos_in,
+					 struct file *file_out, loff_t pos_out,
+					 loff_t len, unsigned int remap_flags)
+{
+	struct inode *src = file_inode(file_in);
+	struct inode *dst = file_inode(file_out);
+	uint64_t src_start, dst_start, count;
+	loff_t ret;
+	int err;
+
+	if (remap_flags & ~REMAP_FILE_CAN_SHORTEN)
+		return -EOPNOTSUPP;
+
+	lock_two_nondirectories(src, dst);
+
+	/*
+	 * the clone may reach into blocks dst has yet to free, or has taken
+	 * ahead of appends
+	 */
+	err = amnesiafs_reclaim_sync(dst);
+	if (!err)
+		err = amnesiafs_prealloc_trim(dst);
+	if (err) {
+		ret = err;
+		goto out_unlock;
+	}
+
+	/* only blocks can be shared */
+	err = amnesiafs_convert_inline(src);
+	if (!err)
+		err = amnesiafs_convert_inline(dst);
+	if (err) {
+		ret = err;
+		goto out_unlock;
+	}
+
+	/* compressed clusters can't be shared in part */
+	if (amnesiafs_extent_has_compressed(AMNESIAFS_I(src)) ||
+	    amnesiafs_extent_has_compressed(AMNESIAFS_I(dst))) {
+		ret = -EOPNOTSUPP;
+		goto out_unlock;
+	}
+
+	/* this also writes back both ranges, so there's no delalloc left */
+	ret = generic_remap_file_range_prep(file_in, pos_in, file_out, pos_out,
+					    &len, remap_flags);
+	if (ret < 0 || !len)
+		goto out_unlock;
+
+	src_start = pos_in / AMNESIAFS_BLOCKSIZE;
+	dst_start = pos_out / AMNESIAFS_BLOCKSIZE;
+	count = DIV_ROUND_UP(pos_in + len, AMNESIAFS_BLOCKSIZE) - src_start;
+
+	truncate_inode_pages_range(&dst->i_data, pos_out,
+				   round_up(pos_out + len,
+					    AMNESIAFS_BLOCKSIZE) - 1);
+	err = amnesiafs_extent_free_range(dst, dst_start, dst_start + count);
+	if (!err)
+		err = amnesiafs_extent_clone(src, src_start, dst, dst_start,
+					     count);
+
+	if (!err && pos_out + len > i_size_read(dst)) {
+		i_size_write(dst, pos_out + len);
+		mark_inode_dirty(dst);
+	}
+
+	ret = err ? err : len;
+
+out_unlock:
+	unlock_two_nondirectories(src, dst);
+	return ret;
+}
+
+ssize_t amnesiafs_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file->f_mapping->host;
+	loff_t old_size;
+	ssize_t ret;
+	int err;
+
+	amnesiafs_debug("amnesiafs_write_iter %s",
+			iocb->ki_filp->f_path.dentry->d_iname);
+
+	inode_lock(inode);
+
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
 		goto out;
 
-	return written;
+	old_size = i_size_read(inode);
+	if (iocb->ki_pos + iov_iter_count(from) > old_size) {
+		err = amnesiafs_reclaim_sync(inode);
+		if (err) {
+			ret = err;
+			goto out;
+		}
+	}
+
+	ret = __generic_file_write_iter(iocb, from);
 
 out:
-	return err;
+	inode_unlock(inode);
+	if (ret > 0)
+		ret = generic_write_sync(iocb, ret);
+	return ret;
+}
+
+/*
+ * Streaming reads go in windows of at least this much. The device's own
+ * default is usually 128KiB, which is a few stripes at most and leaves each
+ * readahead call building and tearing down more bios than it needs to.
+ */
+#define AMNESIAFS_READAHEAD_PAGES (SZ_2M / PAGE_SIZE)
+
+static int amnesiafs_file_open(struct inode *inode, struct file *file)
+{
+	file->f_ra.ra_pages = max_t(unsigned int, file->f_ra.ra_pages,
+				    AMNESIAFS_READAHEAD_PAGES);
+	return generic_file_open(inode, file);
+}
+
+/* The last writer to close a file gives back what it didn't append. */
+static int amnesiafs_file_release(struct inode *inode, struct file *file)
+{
+	int err;
+
+	/* our own write access only goes once we're done here */
+	if (!(file->f_mode & FMODE_WRITE) ||
+	    atomic_read(&inode->i_writecount) > 1)
+		return 0;
+
+	inode_lock(inode);
+	err = amnesiafs_prealloc_trim(inode);
+	inode_unlock(inode);
+	if (err)
+		amnesiafs_err("inode %lu: couldn't free blocks past the end: %d",
+			      inode->i_ino, err);
+
+	return 0;
 }
 
 int amnesiafs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
@@ -116,6 +1549,12 @@ int amnesiafs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 	struct super_block *sb = file->f_mapping->host->i_sb;
 
 	ret = generic_file_fsync(file, start, end, datasync);
+	if (!ret)
+		/* concurrent callers end up sharing a single commit */
+		ret = amnesiafs_journal_force(sb);
+	if (!ret)
+		/* generic_file_fsync only flushed the first device */
+		ret = amnesiafs_volume_flush(sb);
 	if (ret == -EIO)
 		amnesiafs_err(
 			"detected IO error when writing metadata buffers. 0x%lx",
@@ -125,7 +1564,14 @@ int amnesiafs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 
 const struct file_operations amnesiafs_file_operations = {
 	.owner = THIS_MODULE,
-	.read_iter = amnesiafs_read_iter,
+	.llseek = amnesiafs_llseek,
+	.open = amnesiafs_file_open,
+	.release = amnesiafs_file_release,
+	.read_iter = generic_file_read_iter,
 	.write_iter = amnesiafs_write_iter,
+	.splice_read = generic_file_splice_read,
+	.splice_write = iter_file_splice_write,
 	.fsync = amnesiafs_fsync,
-};
\ No newline at end of file
+	.fallocate = amnesiafs_fallocate,
+	.remap_file_range = amnesiafs_remap_file_range,
+};
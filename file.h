@@ -3,6 +3,20 @@
 #ifndef AMNESIAFS_FILE_H
 #define AMNESIAFS_FILE_H
 
+#include <linux/fs.h>
+
 extern const struct file_operations amnesiafs_file_operations;
 
+extern const struct address_space_operations amnesiafs_aops;
+
+int amnesiafs_io_init(struct super_block *sb);
+
+void amnesiafs_io_destroy(struct super_block *sb);
+
+loff_t amnesiafs_inline_max(struct super_block *sb);
+
+int amnesiafs_convert_inline(struct inode *inode);
+
+int amnesiafs_zero_partial(struct inode *inode, loff_t from, loff_t to);
+
 #endif
@@ -7,18 +7,27 @@
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/stat.h>
+#include <linux/string.h>
 
 #include "amnesiafs.h"
 #include "super.h"
 #include "inode.h"
 #include "keys.h"
 #include "log.h"
+#include "ram.h"
 
 static struct dentry *amnesiafs_mount(struct file_system_type *type, int flags,
 				      char const *dev, void *data)
 {
-	struct dentry *const entry =
-		mount_bdev(type, flags, dev, data, amnesiafs_fill_super);
+	struct dentry *entry;
+
+	/* no device, see ram.c */
+	if (!dev || !strcmp(dev, "none"))
+		entry = mount_nodev(type, flags, data,
+				    amnesiafs_ram_fill_super);
+	else
+		entry = mount_bdev(type, flags, dev, data,
+				   amnesiafs_fill_super);
 	if (IS_ERR(entry))
 		amnesiafs_err("amnesiafs mounting failed\n");
 	else
@@ -26,12 +35,19 @@ static struct dentry *amnesiafs_mount(struct file_system_type *type, int flags,
 	return entry;
 }
 
+static void amnesiafs_kill_sb(struct super_block *sb)
+{
+	if (sb->s_bdev)
+		kill_block_super(sb);
+	else
+		amnesiafs_ram_kill_sb(sb);
+}
+
 struct file_system_type amnesiafs_fs_type = {
 	.owner = THIS_MODULE,
 	.name = "amnesiafs",
 	.mount = amnesiafs_mount,
-	.kill_sb = kill_block_super,
-	.fs_flags = FS_REQUIRES_DEV,
+	.kill_sb = amnesiafs_kill_sb,
 };
 
 static int __init amnesiafs_init(void)
@@ -39,8 +55,9 @@ static int __init amnesiafs_init(void)
 	int err;
 
 	amnesiafs_inode_cache = kmem_cache_create(
-		"amnesiafs_inode_cache", sizeof(struct amnesiafs_inode), 0,
-		(SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD), NULL);
+		"amnesiafs_inode_cache", sizeof(struct amnesiafs_inode_info), 0,
+		(SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD | SLAB_ACCOUNT),
+		amnesiafs_inode_init_once);
 	if (!amnesiafs_inode_cache)
 		return -ENOMEM;
 
@@ -61,6 +78,8 @@ static void __exit amnesiafs_exit(void)
 	if (err < 0)
 		amnesiafs_err("failed to unregister filesystem\n");
 
+	/* inodes are freed after an RCU grace period */
+	rcu_barrier();
 	kmem_cache_destroy(amnesiafs_inode_cache);
 	unregister_key_type(&amnesiafs_key_type);
 }
@@ -71,3 +90,4 @@ module_exit(amnesiafs_exit);
 MODULE_DESCRIPTION("amnesiafs");
 MODULE_AUTHOR("Louis Taylor");
 MODULE_LICENSE("GPL");
+MODULE_SOFTDEP("pre: crc32c");
@@ -1,224 +1,420 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 
 #include <linux/buffer_head.h>
+#include <linux/pagemap.h>
 #include <linux/slab.h>
 #include <linux/stat.h>
 #include <linux/time.h>
 
 #include "amnesiafs.h"
 
+#include "alloc.h"
+#include "csum.h"
 #include "dir.h"
+#include "extent.h"
 #include "file.h"
 #include "inode.h"
+#include "journal.h"
 #include "log.h"
+#include "names.h"
+#include "prealloc.h"
+#include "reclaim.h"
 #include "super.h"
+#include "volume.h"
+
+/*
+ * the new inode's table block, the parent's, the parent directory's block,
+ * a new directory's block and the bitmap
+ */
+#define AMNESIAFS_CREATE_CREDITS 5
 
 struct kmem_cache *amnesiafs_inode_cache = NULL;
 
 struct amnesiafs_inode *amnesiafs_get_inode_from_generic(struct inode *inode)
 {
-	return inode->i_private;
+	return &AMNESIAFS_I(inode)->raw;
 }
 
-void amnesiafs_destroy_inode(struct inode *inode)
+/* slab constructor, for what survives from one use of an object to the next */
+void amnesiafs_inode_init_once(void *obj)
 {
-	struct amnesiafs_inode *amnesiafs_inode = inode->i_private;
+	struct amnesiafs_inode_info *info = obj;
 
-	amnesiafs_debug("freeing inode %p (%lu)\n", amnesiafs_inode,
-			inode->i_ino);
-	kmem_cache_free(amnesiafs_inode_cache, amnesiafs_inode);
+	init_rwsem(&info->extent_lock);
+	xa_init(&info->cow);
+	INIT_LIST_HEAD(&info->reclaim_entry);
+	INIT_LIST_HEAD(&info->prealloc_entry);
+	inode_init_once(&info->vfs_inode);
+}
+
+struct inode *amnesiafs_alloc_inode(struct super_block *sb)
+{
+	struct amnesiafs_inode_info *info;
+
+	info = kmem_cache_alloc(amnesiafs_inode_cache, GFP_NOFS);
+	if (!info)
+		return NULL;
+
+	memset(&info->raw, 0, sizeof(info->raw));
+	info->extents = NULL;
+	info->nr_extents = info->max_extents = 0;
+	info->prealloc_start = info->prealloc_end = 0;
+	bitmap_zero(info->dir_bloom, AMNESIAFS_DIR_BLOOM_BITS);
+	info->dir_bloom_ready = false;
+
+	return &info->vfs_inode;
 }
 
+void amnesiafs_free_inode(struct inode *inode)
+{
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+
+	amnesiafs_debug("freeing inode %p (%lu)", info, inode->i_ino);
+	amnesiafs_extent_destroy(info);
+	kmem_cache_free(amnesiafs_inode_cache, info);
+}
+
+void amnesiafs_evict_inode(struct inode *inode)
+{
+	int err;
+
+	truncate_inode_pages_final(&inode->i_data);
+
+	if (S_ISREG(inode->i_mode)) {
+		err = amnesiafs_prealloc_trim(inode);
+		if (err)
+			amnesiafs_err("inode %lu: couldn't free blocks past the end: %d",
+				      inode->i_ino, err);
+		amnesiafs_extent_release_delalloc(inode);
+	}
+
+	clear_inode(inode);
+}
+
+/*
+ * Names that aren't found are left as negative dentries, so looking them up
+ * again, as PATH and include path searches do, stops in the dcache. The
+ * directory's Bloom filter answers most of the first misses without reading
+ * its block. Names are found by their hash, see names.c.
+ */
 struct dentry *amnesiafs_lookup(struct inode *parent_inode,
 				struct dentry *child_dentry, unsigned int flags)
 {
-	struct amnesiafs_inode *parent = parent_inode->i_private;
+	struct amnesiafs_inode_info *parent_info = AMNESIAFS_I(parent_inode);
+	struct amnesiafs_inode *parent = &parent_info->raw;
 	struct super_block *sb = parent_inode->i_sb;
 	struct buffer_head *bh;
 	struct amnesiafs_dir_record *record;
+	u64 hash;
 	int i;
 
 	amnesiafs_debug("lookup in: inode=%llu, b=%llu", parent->inode_no,
 			parent->data_block_number);
 
-	bh = sb_bread(sb, parent->data_block_number);
-	BUG_ON(!bh);
+	if (child_dentry->d_name.len > amnesiafs_name_max(sb))
+		return ERR_PTR(-ENAMETOOLONG);
+
+	hash = amnesiafs_name_hash(parent_inode, child_dentry->d_name.name,
+				   child_dentry->d_name.len);
+	if (!amnesiafs_dir_bloom_check(parent_info, hash))
+		goto out_negative;
+
+	/* parent_inode->i_rwsem is held at least shared by the VFS */
+	bh = amnesiafs_dir_bread(sb, parent->data_block_number);
+	if (!bh)
+		return ERR_PTR(-EIO);
+
 	record = (struct amnesiafs_dir_record *)bh->b_data;
-	for (i = 0; i < parent->dir_children_count; i++) {
-		amnesiafs_debug("have file: '%s' (ino=%llu)", record->filename,
-				record->inode_no);
-
-		if (!strcmp(record->filename, child_dentry->d_name.name)) {
-			struct inode *inode =
-				amnesiafs_iget(sb, record->inode_no);
-			inode_init_owner(
-				inode, parent_inode,
-				((struct amnesiafs_inode *)inode->i_private)
-					->mode);
-			d_add(child_dentry, inode);
-			return NULL;
-		}
-		record++;
+	amnesiafs_dir_bloom_fill(parent_inode, record,
+				 parent->dir_children_count);
+	i = amnesiafs_name_find(parent_inode, record,
+				parent->dir_children_count,
+				&child_dentry->d_name, hash);
+	if (i >= 0) {
+		struct inode *inode = amnesiafs_iget(sb, record[i].inode_no);
+
+		brelse(bh);
+		if (IS_ERR(inode))
+			return ERR_CAST(inode);
+
+		d_add(child_dentry, inode);
+		return NULL;
 	}
+	brelse(bh);
+	if (i != -ENOENT)
+		return ERR_PTR(i);
 
-	amnesiafs_err("No inode found for the filename '%s'",
-		      child_dentry->d_name.name);
+out_negative:
+	d_add(child_dentry, NULL);
 	return NULL;
 }
 
-static struct amnesiafs_inode *
-amnesiafs_inode_search(struct super_block *sb, struct amnesiafs_inode *start,
-		       struct amnesiafs_inode *search)
+/*
+ * Read the inode table block holding inode_no and point raw at its slot.
+ * Callers must hold the buffer lock while touching the slot, since other
+ * inodes share the block.
+ */
+static struct buffer_head *
+amnesiafs_inode_table_bread(struct super_block *sb, uint64_t inode_no,
+			    struct amnesiafs_inode **raw)
 {
-	uint64_t count = 0;
-	while (start->inode_no != search->inode_no &&
-	       count < amnesiafs_get_super(sb)->inodes_count) {
-		count++;
-		start++;
+	struct buffer_head *bh;
+
+	if (inode_no < 1 || inode_no > AMNESIAFS_MAX_INODES) {
+		amnesiafs_err("inode number %llu out of range", inode_no);
+		return NULL;
 	}
 
-	if (start->inode_no == search->inode_no) {
-		return start;
+	bh = sb_bread(sb, amnesiafs_inode_table_block(inode_no));
+	if (!bh)
+		return NULL;
+
+	if (amnesiafs_inode_table_verify(sb, bh)) {
+		brelse(bh);
+		return NULL;
 	}
 
-	return NULL;
+	*raw = (struct amnesiafs_inode *)bh->b_data +
+	       amnesiafs_inode_table_slot(inode_no);
+	return bh;
 }
 
-static void amnesiafs_inode_add(struct super_block *vsb,
-				struct amnesiafs_inode *inode)
+/*
+ * Log an inode's table slot, along with its extent map and, for files, its
+ * current size. The caller must hold a journal handle.
+ */
+int amnesiafs_inode_save(struct inode *inode)
 {
-	struct amnesiafs_super_block *sb = amnesiafs_get_super(vsb);
-	struct buffer_head *bh = NULL;
-	struct amnesiafs_inode *inode_iterator = NULL;
-
-	amnesiafs_debug("adding new inode");
-
-	amnesiafs_debug("inode count: %lld", sb->inodes_count);
-	bh = sb_bread(vsb, 1); /* TODO: is this the right block to use? */
-	BUG_ON(!bh);
-
-	inode_iterator = (struct amnesiafs_inode *)bh->b_data;
+	struct super_block *sb = inode->i_sb;
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+	struct amnesiafs_inode *raw;
+	struct buffer_head *bh;
+	int err;
 
-	inode_iterator += sb->inodes_count;
+	bh = amnesiafs_inode_table_bread(sb, info->raw.inode_no, &raw);
+	if (!bh) {
+		amnesiafs_err("couldn't update inode %llu", info->raw.inode_no);
+		return -EIO;
+	}
 
-	memcpy(inode_iterator, inode, sizeof(struct amnesiafs_inode));
-	sb->inodes_count++;
+	/* writeback saves files without i_rwsem, so serialise on the map */
+	down_write(&info->extent_lock);
+	if (S_ISREG(info->raw.mode))
+		info->raw.file_size = i_size_read(inode);
+
+	err = amnesiafs_extent_store(sb, info);
+	if (!err) {
+		lock_buffer(bh);
+		memcpy(raw, &info->raw, sizeof(*raw));
+		unlock_buffer(bh);
+		amnesiafs_journal_dirty(sb, bh);
+		amnesiafs_debug("updated inode %llu", info->raw.inode_no);
+	}
+	up_write(&info->extent_lock);
 
-	mark_buffer_dirty(bh);
-	amnesiafs_sync_super(vsb);
 	brelse(bh);
+	return err;
 }
 
-int amnesiafs_inode_save(struct super_block *sb,
-			 struct amnesiafs_inode *amnesiafs_inode)
+/*
+ * Log inode_no's table slot as unused again, taking back the save of an
+ * inode whose creation failed. The caller must hold a journal handle.
+ */
+static void amnesiafs_inode_clear(struct super_block *sb, uint64_t inode_no)
 {
-	struct amnesiafs_inode *inode_iterator;
+	struct amnesiafs_inode *raw;
 	struct buffer_head *bh;
 
-	bh = sb_bread(sb, 1);
-	BUG_ON(!bh);
+	bh = amnesiafs_inode_table_bread(sb, inode_no, &raw);
+	if (!bh) {
+		amnesiafs_err("couldn't clear inode %llu", inode_no);
+		return;
+	}
 
-	inode_iterator = amnesiafs_inode_search(
-		sb, (struct amnesiafs_inode *)bh->b_data, amnesiafs_inode);
+	lock_buffer(bh);
+	memset(raw, 0, sizeof(*raw));
+	unlock_buffer(bh);
+	amnesiafs_journal_dirty(sb, bh);
+	brelse(bh);
+}
 
-	if (inode_iterator) {
-		memcpy(inode_iterator, amnesiafs_inode,
-		       sizeof(*inode_iterator));
-		amnesiafs_debug("updated inode");
+/*
+ * Changes that don't have to go in with anything else, like a file growing,
+ * only mark the inode dirty and are saved here at writeback. However many
+ * there were, that's one copy into the table per inode, and the journal
+ * writes each table block once per commit. fsync and sync_fs force the
+ * commit afterwards.
+ */
+int amnesiafs_write_inode(struct inode *inode, struct writeback_control *wbc)
+{
+	struct super_block *sb = inode->i_sb;
+	int err;
 
-		mark_buffer_dirty(bh);
-		sync_dirty_buffer(bh);
-	} else {
-		amnesiafs_err("couldn't update inode");
-		return -EIO;
-	}
+	err = amnesiafs_journal_start(sb, AMNESIAFS_SAVE_CREDITS);
+	if (err)
+		return err;
 
-	brelse(bh);
+	err = amnesiafs_inode_save(inode);
+	amnesiafs_journal_stop(sb);
 
-	return 0;
+	return err;
 }
 
 static int amnesiafs_create_fs_object(struct inode *dir, struct dentry *dentry,
 				      umode_t mode)
 {
 	struct inode *inode;
+	struct amnesiafs_inode_info *info;
 	struct amnesiafs_inode *amnesiafs_inode;
 	struct super_block *sb;
 	struct amnesiafs_inode *parent_dir_inode;
 	struct buffer_head *bh;
 	struct amnesiafs_dir_record *dir_contents_datablock;
+	uint64_t ino, hash;
 	int err;
 
 	sb = dir->i_sb;
+	parent_dir_inode = &AMNESIAFS_I(dir)->raw;
 
 	if (!S_ISDIR(mode) && !S_ISREG(mode)) {
 		amnesiafs_err("neither a file nor a directory");
 		return -EINVAL;
 	}
 
+	if (dentry->d_name.len > amnesiafs_name_max(sb))
+		return -ENAMETOOLONG;
+
+	/*
+	 * dir->i_rwsem is held exclusively by the VFS, so nothing else can
+	 * add to or read from the parent's records until we're done.
+	 */
+	if (parent_dir_inode->dir_children_count >=
+	    AMNESIAFS_DIR_RECORDS_PER_BLOCK)
+		return -ENOSPC;
+
+	err = amnesiafs_journal_start(sb, AMNESIAFS_CREATE_CREDITS);
+	if (err)
+		return err;
+
+	err = amnesiafs_new_ino(sb, dir, mode, &ino);
+	if (err)
+		goto out_stop;
+
 	inode = new_inode(sb);
 	if (!inode) {
-		return -ENOMEM;
+		err = -ENOMEM;
+		goto out_free_ino;
 	}
 
 	inode->i_sb = sb;
 	inode->i_op = &amnesiafs_inode_operations;
 	inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
-	inode->i_ino = 1;
+	inode->i_ino = ino;
 
-	amnesiafs_inode = kmem_cache_alloc(amnesiafs_inode_cache, GFP_KERNEL);
+	info = AMNESIAFS_I(inode);
+	amnesiafs_inode = &info->raw;
 	amnesiafs_inode->inode_no = inode->i_ino;
-	inode->i_private = amnesiafs_inode;
 	amnesiafs_inode->mode = mode;
 
 	if (S_ISDIR(mode)) {
 		amnesiafs_debug("new directory creation");
 		amnesiafs_inode->dir_children_count = 0;
+		/* nothing to fill it in from */
+		info->dir_bloom_ready = true;
 		inode->i_fop = &amnesiafs_dir_operations;
+
+		err = amnesiafs_new_blocks(sb, amnesiafs_inode_goal(sb, ino),
+					   1, &amnesiafs_inode->data_block_number);
+		if (err)
+			goto out_iput;
+
+		bh = amnesiafs_dir_new_block(sb,
+					     amnesiafs_inode->data_block_number);
+		if (!bh) {
+			err = -ENOMEM;
+			goto out_free_block;
+		}
+		amnesiafs_journal_dirty(sb, bh);
+		brelse(bh);
 	} else if (S_ISREG(mode)) {
+		/*
+		 * blocks are only allocated once data is written back, and
+		 * not at all while it still fits in the inode
+		 */
 		amnesiafs_debug("new file creation request");
+		if (amnesiafs_inline_max(sb))
+			amnesiafs_inode->flags = AMNESIAFS_INODE_INLINE_DATA;
 		amnesiafs_inode->file_size = 0;
 		inode->i_fop = &amnesiafs_file_operations;
+		inode->i_mapping->a_ops = &amnesiafs_aops;
 	}
 
 	amnesiafs_debug("assigned file operations");
 
-	/* TODO: actually choose a block */
-	amnesiafs_inode->data_block_number = 10;
-
-	amnesiafs_inode_add(sb, amnesiafs_inode);
+	err = amnesiafs_inode_save(inode);
+	if (err)
+		goto out_free_block;
 
-	parent_dir_inode = dir->i_private;
-	bh = sb_bread(sb, parent_dir_inode->data_block_number);
-	BUG_ON(!bh);
+	bh = amnesiafs_dir_bread(sb, parent_dir_inode->data_block_number);
+	if (!bh) {
+		err = -EIO;
+		goto out_clear;
+	}
 
 	dir_contents_datablock = (struct amnesiafs_dir_record *)bh->b_data;
 
 	dir_contents_datablock += parent_dir_inode->dir_children_count;
 
+	hash = amnesiafs_name_hash(dir, dentry->d_name.name, dentry->d_name.len);
+	err = amnesiafs_name_store(dir, dir_contents_datablock, &dentry->d_name,
+				   hash);
+	if (err)
+		goto out_clear_record;
 	dir_contents_datablock->inode_no = amnesiafs_inode->inode_no;
-	strcpy(dir_contents_datablock->filename, dentry->d_name.name);
 
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
-	brelse(bh);
+	amnesiafs_journal_dirty(sb, bh);
 
 	parent_dir_inode->dir_children_count++;
-	err = amnesiafs_inode_save(sb, parent_dir_inode);
+	err = amnesiafs_inode_save(dir);
 	if (err) {
-		return err;
+		parent_dir_inode->dir_children_count--;
+		goto out_clear_record;
 	}
+	brelse(bh);
+	amnesiafs_dir_bloom_add(AMNESIAFS_I(dir), hash);
+	amnesiafs_journal_stop(sb);
 
 	inode_init_owner(inode, dir, mode);
-	d_add(dentry, inode);
+	insert_inode_hash(inode);
+	d_instantiate(dentry, inode);
 
 	return 0;
+
+	/*
+	 * Nothing commits while we hold the handle, so whatever was logged
+	 * can still be taken back.
+	 */
+out_clear_record:
+	memset(dir_contents_datablock, 0, sizeof(*dir_contents_datablock));
+	brelse(bh);
+out_clear:
+	amnesiafs_inode_clear(sb, ino);
+out_free_block:
+	if (amnesiafs_inode->data_block_number)
+		amnesiafs_free_blocks(sb, amnesiafs_inode->data_block_number,
+				      1);
+out_iput:
+	iput(inode);
+out_free_ino:
+	amnesiafs_free_ino(sb, ino, mode);
+out_stop:
+	amnesiafs_journal_stop(sb);
+	return err;
 }
 
 static int amnesiafs_create(struct inode *dir, struct dentry *dentry,
 			    umode_t mode, bool excl)
 {
-	amnesiafs_err("amnesiafs_create not implemented");
 	amnesiafs_debug("trying '%s'", dentry->d_name.name);
 	return amnesiafs_create_fs_object(dir, dentry, mode);
 }
@@ -226,32 +422,108 @@ static int amnesiafs_create(struct inode *dir, struct dentry *dentry,
 static int amnesiafs_mkdir(struct inode *dir, struct dentry *dentry,
 			   umode_t mode)
 {
-	amnesiafs_err("amnesiafs_mkdir not implemented");
 	return amnesiafs_create_fs_object(dir, dentry, S_IFDIR | mode);
 }
 
+static int amnesiafs_truncate(struct inode *inode, loff_t size)
+{
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+	loff_t old_size = i_size_read(inode);
+	int err;
+
+	/* growing would bring blocks still waiting to be freed back */
+	if (size > old_size) {
+		err = amnesiafs_reclaim_sync(inode);
+		if (err)
+			return err;
+	}
+
+	if (size > amnesiafs_inline_max(inode->i_sb)) {
+		err = amnesiafs_convert_inline(inode);
+		if (err)
+			return err;
+	}
+
+	/*
+	 * Drop the page cache first: this waits on writeback, which may need
+	 * a journal handle of its own.
+	 */
+	truncate_setsize(inode, size);
+	if (size < old_size) {
+		down_write(&info->extent_lock);
+		if (amnesiafs_has_inline_data(info))
+			memset(info->raw.inline_data + size, 0,
+			       AMNESIAFS_INLINE_DATA_MAX - size);
+		up_write(&info->extent_lock);
+
+		/*
+		 * zero the rest of the new last block, so the old contents
+		 * don't reappear if the file grows again
+		 */
+		err = amnesiafs_zero_partial(
+			inode, size, round_up(size, AMNESIAFS_BLOCKSIZE));
+		if (err)
+			return err;
+	}
+
+	/* everything past the new end goes in the background */
+	return amnesiafs_reclaim_defer(inode,
+				       DIV_ROUND_UP(size, AMNESIAFS_BLOCKSIZE));
+}
+
+int amnesiafs_setattr(struct dentry *dentry, struct iattr *attr)
+{
+	struct inode *inode = d_inode(dentry);
+	int err;
+
+	err = setattr_prepare(dentry, attr);
+	if (err)
+		return err;
+
+	if ((attr->ia_valid & ATTR_SIZE) && S_ISREG(inode->i_mode) &&
+	    attr->ia_size != i_size_read(inode)) {
+		err = amnesiafs_truncate(inode, attr->ia_size);
+		if (err)
+			return err;
+	}
+
+	setattr_copy(inode, attr);
+	mark_inode_dirty(inode);
+	return 0;
+}
+
 struct inode_operations amnesiafs_inode_operations = {
 	.create = amnesiafs_create,
 	.lookup = amnesiafs_lookup,
 	.mkdir = amnesiafs_mkdir,
+	.setattr = amnesiafs_setattr,
 };
 
-void amnesiafs_fill_inode(struct super_block *sb, struct inode *inode,
-			  struct amnesiafs_inode *amnesiafs_inode)
+static void amnesiafs_fill_inode(struct super_block *sb, struct inode *inode)
 {
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+	struct amnesiafs_inode *amnesiafs_inode = &info->raw;
+	unsigned int i;
+
 	amnesiafs_debug("filling inode %ld", inode->i_ino);
 
-	inode->i_mode = amnesiafs_inode->mode;
+	inode_init_owner(inode, NULL, amnesiafs_inode->mode);
 	inode->i_sb = sb;
 	inode->i_ino = amnesiafs_inode->inode_no;
 	inode->i_op = &amnesiafs_inode_operations;
 	inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
-	inode->i_private = amnesiafs_inode;
 
 	if (S_ISDIR(amnesiafs_inode->mode)) {
 		inode->i_fop = &amnesiafs_dir_operations;
 	} else if (S_ISREG(amnesiafs_inode->mode)) {
 		inode->i_fop = &amnesiafs_file_operations;
+		inode->i_mapping->a_ops = &amnesiafs_aops;
+		inode->i_size = amnesiafs_inode->file_size;
+		for (i = 0; i < info->nr_extents; i++)
+			inode_add_bytes(inode,
+					(loff_t)amnesiafs_extent_stored(
+						&info->extents[i]) *
+						AMNESIAFS_BLOCKSIZE);
 	} else {
 		amnesiafs_err(
 			"inode %lu is neither a directory nor a regular file",
@@ -260,50 +532,65 @@ void amnesiafs_fill_inode(struct super_block *sb, struct inode *inode,
 	}
 }
 
-struct amnesiafs_inode *amnesiafs_get_inode(struct super_block *sb,
-					    uint64_t inode_no)
+/* Read inode inode_no from the inode table into info. */
+static int amnesiafs_read_inode(struct super_block *sb,
+				struct amnesiafs_inode_info *info,
+				uint64_t inode_no)
 {
 	struct buffer_head *bh;
 	struct amnesiafs_inode *inode;
-	struct amnesiafs_inode *inode_buf;
+	int err;
 
-	amnesiafs_debug("gettign sb_read");
+	bh = amnesiafs_inode_table_bread(sb, inode_no, &inode);
+	if (!bh)
+		return -EIO;
 
-	bh = sb_bread(sb, 1);
-	BUG_ON(!bh);
+	lock_buffer(bh);
+	memcpy(&info->raw, inode, sizeof(info->raw));
+	unlock_buffer(bh);
+	brelse(bh);
+
+	if (info->raw.inode_no != inode_no) {
+		amnesiafs_err("inode table slot for %llu holds %llu", inode_no,
+			      info->raw.inode_no);
+		return -EIO;
+	}
 
-	amnesiafs_debug("got sb_read");
+	/* whatever got loaded is freed along with the inode */
+	err = amnesiafs_extent_load(sb, info);
+	if (err)
+		return err;
 
-	inode = (struct amnesiafs_inode *)(bh->b_data);
-	inode_buf = kmem_cache_alloc(amnesiafs_inode_cache, GFP_KERNEL);
-	memcpy(inode_buf, inode, sizeof(*inode_buf));
 	amnesiafs_debug("inode: dir_children_count: %lld mode: %d",
-			inode->dir_children_count, inode->mode);
+			info->raw.dir_children_count, info->raw.mode);
 
-	brelse(bh);
-	return inode_buf;
+	return 0;
 }
 
+/*
+ * Look up an inode, reading it from the inode table only if it isn't already
+ * in the inode cache. Concurrent lookups of the same inode number all get
+ * the same struct inode, so they share one in-memory copy of its metadata.
+ */
 struct inode *amnesiafs_iget(struct super_block *sb, int ino)
 {
 	struct inode *inode;
-	struct amnesiafs_inode *amnesiafs_inode = amnesiafs_get_inode(sb, ino);
+	int err;
 
-	inode = new_inode(sb);
-	inode->i_ino = ino;
-	inode->i_sb = sb;
-	inode->i_op = &amnesiafs_inode_operations;
+	inode = iget_locked(sb, ino);
+	if (!inode)
+		return ERR_PTR(-ENOMEM);
+	if (!(inode->i_state & I_NEW))
+		return inode;
 
-	if (S_ISDIR(amnesiafs_inode->mode))
-		inode->i_fop = &amnesiafs_dir_operations;
-	else if (S_ISREG(amnesiafs_inode->mode))
-		inode->i_fop = &amnesiafs_file_operations;
-	else
-		amnesiafs_err("unknown inode type");
-
-	inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
+	err = amnesiafs_read_inode(sb, AMNESIAFS_I(inode), ino);
+	if (err) {
+		iget_failed(inode);
+		return ERR_PTR(err);
+	}
 
-	inode->i_private = amnesiafs_inode;
+	amnesiafs_fill_inode(sb, inode);
+	unlock_new_inode(inode);
 
 	return inode;
-}
\ No newline at end of file
+}
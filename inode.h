@@ -3,25 +3,111 @@
 #ifndef AMNESIAFS_INODE_H
 #define AMNESIAFS_INODE_H
 
+#include <linux/bitmap.h>
 #include <linux/fs.h>
+#include <linux/rwsem.h>
+#include <linux/xarray.h>
+
+#include "amnesiafs.h"
+
+/*
+ * Journal credits for amnesiafs_inode_save(): the inode table block, and the
+ * extent block along with its bitmap block
+ */
+#define AMNESIAFS_SAVE_CREDITS 3
+
+/* four hashes of a byte each, enough for a directory block's worth of names */
+#define AMNESIAFS_DIR_BLOOM_BITS 256
+
+/* in-memory state for an inode, with the VFS inode embedded */
+struct amnesiafs_inode_info {
+	/*
+	 * the on-disk inode; its extents are only filled in when it's saved,
+	 * the live copy is below
+	 */
+	struct amnesiafs_inode raw;
+
+	/* protects the extent map */
+	struct rw_semaphore extent_lock;
+	/* sorted by logical block */
+	struct amnesiafs_extent *extents;
+	unsigned int nr_extents;
+	unsigned int max_extents;
+	/*
+	 * staged copies of shared blocks under writeback, by file block,
+	 * under extent_lock; see amnesiafs_extent_cow()
+	 */
+	struct xarray cow;
+
+	/* on the super block's reclaim_list, see reclaim.c */
+	struct list_head reclaim_entry;
+
+	/*
+	 * file blocks [prealloc_start, prealloc_end) were taken ahead of
+	 * appends, under extent_lock; and the inode is on the super block's
+	 * prealloc_list, see prealloc.c
+	 */
+	uint64_t prealloc_start;
+	uint64_t prealloc_end;
+	struct list_head prealloc_entry;
+
+	/* for directories, a Bloom filter of their names, see dir.c */
+	DECLARE_BITMAP(dir_bloom, AMNESIAFS_DIR_BLOOM_BITS);
+	bool dir_bloom_ready;
+
+	struct inode vfs_inode;
+};
+
+/* The inode table block holding inode ino, which lives in slot ino - 1. */
+static inline uint64_t amnesiafs_inode_table_block(uint64_t ino)
+{
+	return AMNESIAFS_INODE_TABLE_BLOCK_NUMBER +
+	       (ino - 1) / AMNESIAFS_INODES_PER_BLOCK;
+}
+
+/* Where in its inode table block inode ino is. */
+static inline unsigned int amnesiafs_inode_table_slot(uint64_t ino)
+{
+	return (ino - 1) % AMNESIAFS_INODES_PER_BLOCK;
+}
 
 extern struct kmem_cache *amnesiafs_inode_cache;
 
 extern struct inode_operations amnesiafs_inode_operations;
 
+static inline struct amnesiafs_inode_info *AMNESIAFS_I(struct inode *inode)
+{
+	return container_of(inode, struct amnesiafs_inode_info, vfs_inode);
+}
+
+/*
+ * The flag only changes with both i_rwsem and extent_lock held, so holding
+ * either is enough to test it.
+ */
+static inline bool amnesiafs_has_inline_data(struct amnesiafs_inode_info *info)
+{
+	return info->raw.flags & AMNESIAFS_INODE_INLINE_DATA;
+}
+
 struct dentry *amnesiafs_lookup(struct inode *parent_inode,
 				struct dentry *child_dentry,
 				unsigned int flags);
 
-struct amnesiafs_inode *amnesiafs_get_inode(struct super_block *sb,
-					    uint64_t inode_no);
+int amnesiafs_inode_save(struct inode *inode);
 
-int amnesiafs_inode_save(struct super_block *sb,
-			 struct amnesiafs_inode *amnesiafs_inode);
+int amnesiafs_write_inode(struct inode *inode, struct writeback_control *wbc);
 
 struct amnesiafs_inode *amnesiafs_get_inode_from_generic(struct inode *inode);
 
-void amnesiafs_destroy_inode(struct inode *inode);
+int amnesiafs_setattr(struct dentry *dentry, struct iattr *attr);
+
+void amnesiafs_evict_inode(struct inode *inode);
+
+void amnesiafs_inode_init_once(void *obj);
+
+struct inode *amnesiafs_alloc_inode(struct super_block *sb);
+
+void amnesiafs_free_inode(struct inode *inode);
 
 struct inode *amnesiafs_iget(struct super_block *sb, int ino);
 
@@ -0,0 +1,656 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/completion.h>
+#include <linux/fs.h>
+#include <linux/gfp.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+#include "amnesiafs.h"
+
+#include "alloc.h"
+#include "csum.h"
+#include "journal.h"
+#include "log.h"
+#include "super.h"
+#include "volume.h"
+
+/*
+ * A small write-ahead log for metadata.
+ *
+ * Operations wrap their metadata updates in amnesiafs_journal_start() and
+ * amnesiafs_journal_stop(), modify buffers in memory and hand them to
+ * amnesiafs_journal_dirty() instead of writing them. Everything dirtied
+ * between two commits forms one transaction. A commit copies the
+ * transaction's buffers, writes the copies to the journal followed by a
+ * commit block, and then writes them in place with the super block last.
+ * The super block records the sequence number of the transaction that
+ * wrote it, so mount only replays a transaction whose in-place writes may
+ * not have finished.
+ *
+ * Transactions are committed every AMNESIAFS_COMMIT_INTERVAL, when they fill
+ * up, or when someone calls amnesiafs_journal_force(). Callers that want
+ * a transaction committed while another commit is running wait on
+ * commit_mutex and then find their transaction already done, so any number
+ * of concurrent fsyncs share one commit.
+ *
+ * Only metadata goes through the journal. File data is kept in order with
+ * it by mapping new blocks unwritten, and marking them written in a later
+ * transaction once their bio has completed (see file.c), so a commit never
+ * points a file at blocks that don't hold its data yet. Blocks replacing
+ * ones that already hold data are staged instead, and only swapped in then.
+ *
+ * If a commit fails to write, or a transaction was handed more blocks than
+ * it can hold, the journal is aborted, as with jbd2: the transaction is
+ * dropped, nothing is committed after it, handles can't be started and
+ * forcing the journal fails with -EIO, and the file system goes read-only.
+ * Whatever made it to disk before is consistent.
+ */
+
+#define AMNESIAFS_COMMIT_INTERVAL (5 * HZ)
+
+struct amnesiafs_transaction {
+	uint64_t tid;
+	/* credits reserved by handles that joined this transaction */
+	unsigned int credits;
+	unsigned int nr_blocks;
+	/* dirtied more blocks than it could hold, and can't be committed */
+	bool overflow;
+	struct buffer_head *bhs[AMNESIAFS_JOURNAL_MAX_TRANSACTION];
+};
+
+struct amnesiafs_journal {
+	struct super_block *sb;
+
+	/*
+	 * Held shared by every open handle and exclusively while the running
+	 * transaction is closed, so a closed transaction never holds half of
+	 * an operation.
+	 */
+	struct rw_semaphore barrier;
+
+	/* protects the running transaction's credits and block list */
+	spinlock_t lock;
+	struct amnesiafs_transaction *running;
+
+	/* serialises commits, and is what group commit waiters queue on */
+	struct mutex commit_mutex;
+	uint64_t committed_tid;
+	/* set under commit_mutex when a commit fails, never cleared */
+	bool aborted;
+
+	/* only used under commit_mutex, so they're allocated once up front */
+	struct amnesiafs_transaction transactions[2];
+	struct page *descriptor;
+	struct page *commit;
+	struct page *frozen[AMNESIAFS_JOURNAL_MAX_TRANSACTION];
+
+	struct delayed_work commit_work;
+};
+
+struct amnesiafs_handle {
+	struct amnesiafs_journal *journal;
+	int ref;
+};
+
+struct amnesiafs_journal_io {
+	atomic_t pending;
+	blk_status_t status;
+	struct completion done;
+};
+
+static void amnesiafs_journal_end_io(struct bio *bio)
+{
+	struct amnesiafs_journal_io *io = bio->bi_private;
+
+	if (bio->bi_status)
+		io->status = bio->bi_status;
+	bio_put(bio);
+
+	if (atomic_dec_and_test(&io->pending))
+		complete(&io->done);
+}
+
+static void amnesiafs_journal_io_init(struct amnesiafs_journal_io *io)
+{
+	atomic_set(&io->pending, 1);
+	io->status = BLK_STS_OK;
+	init_completion(&io->done);
+}
+
+static void amnesiafs_journal_submit(struct super_block *sb,
+				     struct amnesiafs_journal_io *io,
+				     uint64_t block, struct page *page,
+				     unsigned int op_flags)
+{
+	struct bio *bio = bio_alloc(GFP_NOFS, 1);
+	struct block_device *bdev;
+	uint64_t dev_block;
+
+	bdev = amnesiafs_map_block(sb, block, &dev_block, NULL);
+	bio_set_dev(bio, bdev);
+	bio->bi_iter.bi_sector = dev_block << (sb->s_blocksize_bits - 9);
+	bio->bi_opf = REQ_OP_WRITE | REQ_SYNC | op_flags;
+	bio_add_page(bio, page, AMNESIAFS_BLOCKSIZE, 0);
+	bio->bi_private = io;
+	bio->bi_end_io = amnesiafs_journal_end_io;
+
+	atomic_inc(&io->pending);
+	submit_bio(bio);
+}
+
+static int amnesiafs_journal_io_wait(struct amnesiafs_journal_io *io)
+{
+	if (!atomic_dec_and_test(&io->pending))
+		wait_for_completion(&io->done);
+
+	return blk_status_to_errno(io->status);
+}
+
+static int
+amnesiafs_journal_write_transaction(struct amnesiafs_journal *journal,
+				    struct amnesiafs_transaction *transaction)
+{
+	struct super_block *sb = journal->sb;
+	uint64_t start = AMNESIAFS_SB(sb)->disk_sb->journal_block;
+	struct amnesiafs_journal_header *header;
+	struct amnesiafs_journal_io io;
+	unsigned int i, super_index = 0;
+	int err;
+
+	header = page_address(journal->descriptor);
+	memset(header, 0, AMNESIAFS_BLOCKSIZE);
+	header->magic = AMNESIAFS_JOURNAL_DESCRIPTOR_MAGIC;
+	header->sequence = transaction->tid;
+	header->nr_blocks = transaction->nr_blocks;
+	for (i = 0; i < transaction->nr_blocks; i++)
+		header->blocks[i] =
+			amnesiafs_volume_block(sb, transaction->bhs[i]);
+
+	amnesiafs_journal_io_init(&io);
+	amnesiafs_journal_submit(sb, &io, start, journal->descriptor, 0);
+	for (i = 0; i < transaction->nr_blocks; i++)
+		amnesiafs_journal_submit(sb, &io, start + 1 + i,
+					 journal->frozen[i], 0);
+	err = amnesiafs_journal_io_wait(&io);
+	if (err)
+		return err;
+
+	/* the commit block must only reach the disk after everything above */
+	header = page_address(journal->commit);
+	memset(header, 0, AMNESIAFS_BLOCKSIZE);
+	header->magic = AMNESIAFS_JOURNAL_COMMIT_MAGIC;
+	header->sequence = transaction->tid;
+
+	amnesiafs_journal_io_init(&io);
+	amnesiafs_journal_submit(sb, &io, start + 1 + transaction->nr_blocks,
+				 journal->commit, REQ_PREFLUSH | REQ_FUA);
+	err = amnesiafs_journal_io_wait(&io);
+	if (err)
+		return err;
+
+	/* checkpoint: everything goes in place, the super block goes last */
+	amnesiafs_journal_io_init(&io);
+	for (i = 0; i < transaction->nr_blocks; i++) {
+		uint64_t block =
+			amnesiafs_volume_block(sb, transaction->bhs[i]);
+
+		if (block == AMNESIAFS_SUPER_BLOCK_NUMBER) {
+			super_index = i;
+			continue;
+		}
+		amnesiafs_journal_submit(sb, &io, block, journal->frozen[i], 0);
+	}
+	err = amnesiafs_journal_io_wait(&io);
+	if (!err)
+		/* the super block's flush only covers its own device */
+		err = amnesiafs_volume_flush(sb);
+	if (err)
+		return err;
+
+	amnesiafs_journal_io_init(&io);
+	amnesiafs_journal_submit(sb, &io, AMNESIAFS_SUPER_BLOCK_NUMBER,
+				 journal->frozen[super_index],
+				 REQ_PREFLUSH | REQ_FUA);
+	return amnesiafs_journal_io_wait(&io);
+}
+
+/*
+ * Returns false if the transaction is full, which only happens if someone
+ * dirtied more blocks than they reserved credits for. The block then can't
+ * be committed, and neither can anything after it: the commit aborts the
+ * journal instead.
+ */
+static bool amnesiafs_journal_add(struct amnesiafs_transaction *transaction,
+				  struct buffer_head *bh)
+{
+	unsigned int i;
+
+	for (i = 0; i < transaction->nr_blocks; i++)
+		if (transaction->bhs[i] == bh)
+			return true;
+
+	if (WARN_ON_ONCE(transaction->nr_blocks >=
+			 AMNESIAFS_JOURNAL_MAX_TRANSACTION)) {
+		transaction->overflow = true;
+		return false;
+	}
+
+	get_bh(bh);
+	transaction->bhs[transaction->nr_blocks++] = bh;
+	return true;
+}
+
+/* Stop writing anything after a failed commit. Called under commit_mutex. */
+static void amnesiafs_journal_abort(struct amnesiafs_journal *journal,
+				    uint64_t tid, int err)
+{
+	struct super_block *sb = journal->sb;
+
+	amnesiafs_err("committing transaction %llu failed: %d, aborting the journal and remounting read-only",
+		      tid, err);
+	WRITE_ONCE(journal->aborted, true);
+	sb->s_flags |= SB_RDONLY;
+}
+
+/*
+ * Commit every transaction up to and including tid. Returns straight away if
+ * another caller already did it, and with -EIO once the journal is aborted.
+ */
+static int amnesiafs_journal_commit(struct amnesiafs_journal *journal,
+				    uint64_t tid)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(journal->sb);
+	struct amnesiafs_transaction *transaction, *next;
+	unsigned int i;
+	int err = 0;
+
+	mutex_lock(&journal->commit_mutex);
+	if (journal->aborted) {
+		err = -EIO;
+		goto out_unlock;
+	}
+	if (journal->committed_tid >= tid)
+		goto out_unlock;
+
+	down_write(&journal->barrier);
+
+	transaction = journal->running;
+	next = transaction == &journal->transactions[0] ?
+		       &journal->transactions[1] :
+		       &journal->transactions[0];
+	next->tid = transaction->tid + 1;
+	next->credits = 0;
+	next->nr_blocks = 0;
+	next->overflow = false;
+
+	spin_lock(&journal->lock);
+	journal->running = next;
+	spin_unlock(&journal->lock);
+
+	if (transaction->nr_blocks) {
+		sbi->disk_sb->journal_sequence = transaction->tid;
+		amnesiafs_alloc_sync_counters(journal->sb);
+		amnesiafs_journal_add(transaction, sbi->sbh);
+
+		for (i = 0; i < transaction->nr_blocks; i++)
+			memcpy(page_address(journal->frozen[i]),
+			       transaction->bhs[i]->b_data,
+			       AMNESIAFS_BLOCKSIZE);
+	}
+
+	up_write(&journal->barrier);
+
+	/* the copies are ours alone, so this needn't hold anyone up */
+	for (i = 0; i < transaction->nr_blocks; i++)
+		amnesiafs_csum_set(journal->sb, transaction->bhs[i],
+				   page_address(journal->frozen[i]));
+
+	if (transaction->overflow) {
+		err = -ENOSPC;
+		amnesiafs_journal_abort(journal, transaction->tid, err);
+	} else if (transaction->nr_blocks) {
+		err = amnesiafs_journal_write_transaction(journal,
+							  transaction);
+		if (err)
+			amnesiafs_journal_abort(journal, transaction->tid, err);
+		else
+			amnesiafs_debug("committed transaction %llu (%u blocks)",
+					transaction->tid,
+					transaction->nr_blocks);
+	}
+
+	for (i = 0; i < transaction->nr_blocks; i++)
+		brelse(transaction->bhs[i]);
+
+	if (!err) {
+		journal->committed_tid = transaction->tid;
+		amnesiafs_alloc_committed(journal->sb, transaction->tid);
+	}
+
+out_unlock:
+	mutex_unlock(&journal->commit_mutex);
+	return err;
+}
+
+static void amnesiafs_journal_commit_work(struct work_struct *work)
+{
+	struct amnesiafs_journal *journal = container_of(
+		to_delayed_work(work), struct amnesiafs_journal, commit_work);
+	uint64_t tid;
+
+	spin_lock(&journal->lock);
+	tid = journal->running->tid;
+	spin_unlock(&journal->lock);
+
+	amnesiafs_journal_commit(journal, tid);
+}
+
+int amnesiafs_journal_start(struct super_block *sb, unsigned int credits)
+{
+	struct amnesiafs_journal *journal = AMNESIAFS_SB(sb)->journal;
+	struct amnesiafs_handle *handle = current->journal_info;
+	uint64_t tid;
+	int err;
+
+	if (handle) {
+		/* nested in another operation, which reserved for both */
+		WARN_ON(handle->journal != journal);
+		handle->ref++;
+		return 0;
+	}
+
+	/* one block is always kept back for the super block */
+	if (WARN_ON(credits >= AMNESIAFS_JOURNAL_MAX_TRANSACTION))
+		return -EINVAL;
+
+	if (READ_ONCE(journal->aborted))
+		return -EIO;
+
+	handle = kmalloc(sizeof(*handle), GFP_NOFS);
+	if (!handle)
+		return -ENOMEM;
+
+	for (;;) {
+		down_read(&journal->barrier);
+
+		spin_lock(&journal->lock);
+		if (journal->running->credits + credits <
+		    AMNESIAFS_JOURNAL_MAX_TRANSACTION) {
+			journal->running->credits += credits;
+			spin_unlock(&journal->lock);
+			break;
+		}
+		tid = journal->running->tid;
+		spin_unlock(&journal->lock);
+
+		/* the running transaction is full, commit it and try again */
+		up_read(&journal->barrier);
+		err = amnesiafs_journal_commit(journal, tid);
+		if (err) {
+			kfree(handle);
+			return err;
+		}
+	}
+
+	handle->journal = journal;
+	handle->ref = 1;
+	current->journal_info = handle;
+
+	return 0;
+}
+
+void amnesiafs_journal_stop(struct super_block *sb)
+{
+	struct amnesiafs_handle *handle = current->journal_info;
+
+	if (WARN_ON(!handle))
+		return;
+
+	if (--handle->ref)
+		return;
+
+	current->journal_info = NULL;
+	up_read(&handle->journal->barrier);
+	kfree(handle);
+}
+
+/*
+ * Add bh to the running transaction. The caller must hold a handle and
+ * have already made its changes to bh->b_data.
+ */
+void amnesiafs_journal_dirty(struct super_block *sb, struct buffer_head *bh)
+{
+	struct amnesiafs_journal *journal = AMNESIAFS_SB(sb)->journal;
+	bool first, added;
+
+	WARN_ON_ONCE(!current->journal_info);
+
+	spin_lock(&journal->lock);
+	first = !journal->running->nr_blocks;
+	added = amnesiafs_journal_add(journal->running, bh);
+	spin_unlock(&journal->lock);
+
+	if (!added) {
+		amnesiafs_err("transaction is full, dropping block %llu",
+			      amnesiafs_volume_block(sb, bh));
+		/* abort the journal now rather than keep going without it */
+		mod_delayed_work(system_wq, &journal->commit_work, 0);
+	} else if (first) {
+		schedule_delayed_work(&journal->commit_work,
+				      AMNESIAFS_COMMIT_INTERVAL);
+	}
+}
+
+/* Commit everything done so far and wait for it to be on disk. */
+int amnesiafs_journal_force(struct super_block *sb)
+{
+	struct amnesiafs_journal *journal = AMNESIAFS_SB(sb)->journal;
+	uint64_t tid;
+
+	spin_lock(&journal->lock);
+	tid = journal->running->tid;
+	spin_unlock(&journal->lock);
+
+	return amnesiafs_journal_commit(journal, tid);
+}
+
+/* The transaction the caller's handle is part of. */
+uint64_t amnesiafs_journal_tid(struct super_block *sb)
+{
+	struct amnesiafs_journal *journal = AMNESIAFS_SB(sb)->journal;
+	uint64_t tid;
+
+	WARN_ON_ONCE(!current->journal_info);
+
+	spin_lock(&journal->lock);
+	tid = journal->running->tid;
+	spin_unlock(&journal->lock);
+
+	return tid;
+}
+
+/*
+ * Write back the last transaction in the journal if it committed but its
+ * in-place writes might not have finished. Called at mount before anything
+ * else reads metadata.
+ */
+int amnesiafs_journal_replay(struct super_block *sb)
+{
+	struct amnesiafs_super_block *disk_sb = AMNESIAFS_SB(sb)->disk_sb;
+	struct amnesiafs_journal_header *header, *commit;
+	struct buffer_head *descriptor_bh, *commit_bh, *bh, *dest;
+	uint64_t start = disk_sb->journal_block;
+	uint64_t i;
+	int err = 0;
+
+	if (disk_sb->journal_blocks < AMNESIAFS_JOURNAL_BLOCKS) {
+		amnesiafs_err("journal of %llu blocks is too small",
+			      disk_sb->journal_blocks);
+		return -EINVAL;
+	}
+
+	descriptor_bh = sb_bread(sb, start);
+	if (!descriptor_bh)
+		return -EIO;
+
+	header = (struct amnesiafs_journal_header *)descriptor_bh->b_data;
+	if (header->magic != AMNESIAFS_JOURNAL_DESCRIPTOR_MAGIC ||
+	    header->sequence <= disk_sb->journal_sequence)
+		goto out_descriptor;
+
+	if (header->nr_blocks > AMNESIAFS_JOURNAL_MAX_TRANSACTION) {
+		amnesiafs_err("journal descriptor claims %llu blocks",
+			      header->nr_blocks);
+		err = -EIO;
+		goto out_descriptor;
+	}
+
+	commit_bh = sb_bread(sb, start + 1 + header->nr_blocks);
+	if (!commit_bh) {
+		err = -EIO;
+		goto out_descriptor;
+	}
+
+	commit = (struct amnesiafs_journal_header *)commit_bh->b_data;
+	if (commit->magic != AMNESIAFS_JOURNAL_COMMIT_MAGIC ||
+	    commit->sequence != header->sequence) {
+		amnesiafs_info("discarding uncommitted transaction %llu",
+			       header->sequence);
+		goto out_commit;
+	}
+
+	/* the super block goes last, as it marks the transaction as done */
+	for (i = 0; i < header->nr_blocks; i++) {
+		if (header->blocks[i] == AMNESIAFS_SUPER_BLOCK_NUMBER)
+			continue;
+		if (header->blocks[i] >= disk_sb->blocks_count) {
+			err = -EIO;
+			goto out_commit;
+		}
+
+		bh = sb_bread(sb, start + 1 + i);
+		dest = amnesiafs_getblk(sb, header->blocks[i]);
+		if (!bh || !dest) {
+			brelse(bh);
+			brelse(dest);
+			err = -EIO;
+			goto out_commit;
+		}
+
+		lock_buffer(dest);
+		memcpy(dest->b_data, bh->b_data, AMNESIAFS_BLOCKSIZE);
+		set_buffer_uptodate(dest);
+		unlock_buffer(dest);
+		mark_buffer_dirty(dest);
+		sync_dirty_buffer(dest);
+
+		brelse(dest);
+		brelse(bh);
+	}
+
+	for (i = 0; i < header->nr_blocks; i++) {
+		if (header->blocks[i] != AMNESIAFS_SUPER_BLOCK_NUMBER)
+			continue;
+
+		bh = sb_bread(sb, start + 1 + i);
+		if (!bh) {
+			err = -EIO;
+			goto out_commit;
+		}
+		dest = AMNESIAFS_SB(sb)->sbh;
+		lock_buffer(dest);
+		memcpy(dest->b_data, bh->b_data, AMNESIAFS_BLOCKSIZE);
+		unlock_buffer(dest);
+		mark_buffer_dirty(dest);
+		err = sync_dirty_buffer(dest);
+		brelse(bh);
+	}
+
+	amnesiafs_info("replayed journal transaction %llu (%llu blocks)",
+		       header->sequence, header->nr_blocks);
+
+out_commit:
+	brelse(commit_bh);
+out_descriptor:
+	brelse(descriptor_bh);
+	return err;
+}
+
+int amnesiafs_journal_init(struct super_block *sb)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	struct amnesiafs_journal *journal;
+	unsigned int i;
+
+	journal = kzalloc(sizeof(*journal), GFP_KERNEL);
+	if (!journal)
+		return -ENOMEM;
+
+	journal->sb = sb;
+	init_rwsem(&journal->barrier);
+	spin_lock_init(&journal->lock);
+	mutex_init(&journal->commit_mutex);
+	INIT_DELAYED_WORK(&journal->commit_work,
+			  amnesiafs_journal_commit_work);
+
+	journal->committed_tid = sbi->disk_sb->journal_sequence;
+	journal->running = &journal->transactions[0];
+	journal->running->tid = journal->committed_tid + 1;
+
+	sbi->journal = journal;
+
+	journal->descriptor = alloc_page(GFP_KERNEL);
+	journal->commit = alloc_page(GFP_KERNEL);
+	if (!journal->descriptor || !journal->commit)
+		goto out_nomem;
+
+	for (i = 0; i < AMNESIAFS_JOURNAL_MAX_TRANSACTION; i++) {
+		journal->frozen[i] = alloc_page(GFP_KERNEL);
+		if (!journal->frozen[i])
+			goto out_nomem;
+	}
+
+	return 0;
+
+out_nomem:
+	amnesiafs_journal_destroy(sb);
+	return -ENOMEM;
+}
+
+/* Commit whatever is left and tear the journal down. */
+void amnesiafs_journal_destroy(struct super_block *sb)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	struct amnesiafs_journal *journal = sbi->journal;
+	unsigned int i;
+
+	if (!journal)
+		return;
+
+	cancel_delayed_work_sync(&journal->commit_work);
+	if (journal->running->nr_blocks)
+		amnesiafs_journal_force(sb);
+
+	/* an aborted journal never got to commit them */
+	for (i = 0; i < journal->running->nr_blocks; i++)
+		brelse(journal->running->bhs[i]);
+
+	for (i = 0; i < AMNESIAFS_JOURNAL_MAX_TRANSACTION; i++)
+		if (journal->frozen[i])
+			__free_page(journal->frozen[i]);
+	if (journal->commit)
+		__free_page(journal->commit);
+	if (journal->descriptor)
+		__free_page(journal->descriptor);
+
+	kfree(journal);
+	sbi->journal = NULL;
+}
@@ -0,0 +1,25 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#ifndef AMNESIAFS_JOURNAL_H
+#define AMNESIAFS_JOURNAL_H
+
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+
+int amnesiafs_journal_init(struct super_block *sb);
+
+void amnesiafs_journal_destroy(struct super_block *sb);
+
+int amnesiafs_journal_replay(struct super_block *sb);
+
+int amnesiafs_journal_start(struct super_block *sb, unsigned int credits);
+
+void amnesiafs_journal_stop(struct super_block *sb);
+
+void amnesiafs_journal_dirty(struct super_block *sb, struct buffer_head *bh);
+
+int amnesiafs_journal_force(struct super_block *sb);
+
+uint64_t amnesiafs_journal_tid(struct super_block *sb);
+
+#endif
@@ -1,23 +1,40 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 
+#include <crypto/hash.h>
+#include <crypto/sha.h>
 #include <linux/slab.h>
 #include <linux/key.h>
 #include <linux/key-type.h>
 #include <keys/user-type.h>
 
+#include "config.h"
+#include "keys.h"
 #include "log.h"
+#include "ram.h"
+
+static void amnesiafs_key_revoke(struct key *key)
+{
+	user_revoke(key);
+	/* a device-less mount's files go with the key, see ram.c */
+	amnesiafs_ram_revoke(key);
+}
 
 struct key_type amnesiafs_key_type = {
 	.name = "amnesiafs",
 	.preparse = user_preparse,
 	.free_preparse = user_free_preparse,
 	.instantiate = generic_key_instantiate,
-	.revoke = user_revoke,
+	.revoke = amnesiafs_key_revoke,
 	.destroy = user_destroy,
 	.describe = user_describe,
 };
 
-int amnesiafs_get_passphrase(char **passphrase, const char *key_desc)
+/*
+ * Read the passphrase of the user's key, and hand back the key itself
+ * rather than revoking it, for the caller to revoke and put when it's done.
+ */
+struct key *amnesiafs_get_key(char **passphrase, size_t *len,
+			      const char *key_desc)
 {
 	int err = 0;
 	struct key *user_key;
@@ -27,12 +44,11 @@ int amnesiafs_get_passphrase(char **passphrase, const char *key_desc)
 
 	if (IS_ERR(user_key)) {
 		amnesiafs_err("Failed to request key: %ld", PTR_ERR(user_key));
-		err = PTR_ERR(user_key);
-		goto out_err;
+		return user_key;
 	}
 
 	*passphrase = kzalloc(user_key->datalen + 1, GFP_KERNEL);
-	if (!passphrase) {
+	if (!*passphrase) {
 		err = -ENOMEM;
 		goto out_err;
 	}
@@ -44,14 +60,64 @@ int amnesiafs_get_passphrase(char **passphrase, const char *key_desc)
 		goto out_key_err;
 	}
 
-	strlcpy(*passphrase, upayload->data, user_key->datalen);
-	amnesiafs_debug("passphrase: '%s'", *passphrase);
+	/* the key is derived from the passphrase, and can hold any byte */
+	*len = min_t(size_t, upayload->datalen, user_key->datalen);
+	memcpy(*passphrase, upayload->data, *len);
+	amnesiafs_debug("read passphrase for key '%s'", key_desc);
 
+out_key_err:
 	up_read(&user_key->sem);
+out_err:
+	if (err) {
+		key_revoke(user_key);
+		key_put(user_key);
+		return ERR_PTR(err);
+	}
+	return user_key;
+}
+
+int amnesiafs_get_passphrase(char **passphrase, size_t *len,
+			     const char *key_desc)
+{
+	struct key *user_key = amnesiafs_get_key(passphrase, len, key_desc);
+
+	if (IS_ERR(user_key))
+		return PTR_ERR(user_key);
 
-out_key_err:
 	/* make sure the passphrase doesn't stay around longer than necessary */
 	key_revoke(user_key);
-out_err:
+	key_put(user_key);
+	return 0;
+}
+
+/*
+ * Derive len bytes, at most a SHA-512 digest, for the purpose named by info
+ * from the mount's key, so that no two uses share key material.
+ */
+int amnesiafs_derive_key(const struct amnesiafs_config *config,
+			 const char *info, u8 *key, unsigned int len)
+{
+	struct crypto_shash *tfm;
+	u8 digest[SHA512_DIGEST_SIZE];
+	int err;
+
+	if (WARN_ON(len > sizeof(digest)))
+		return -EINVAL;
+
+	tfm = crypto_alloc_shash("hmac(sha512)", 0, 0);
+	if (IS_ERR(tfm)) {
+		amnesiafs_err("can't load hmac(sha512): %ld", PTR_ERR(tfm));
+		return PTR_ERR(tfm);
+	}
+
+	err = crypto_shash_setkey(tfm, config->passphrase,
+				  config->passphrase_len);
+	if (!err)
+		err = crypto_shash_tfm_digest(tfm, info, strlen(info), digest);
+	if (!err)
+		memcpy(key, digest, len);
+
+	memzero_explicit(digest, sizeof(digest));
+	crypto_free_shash(tfm);
 	return err;
-}
\ No newline at end of file
+}
@@ -7,8 +7,17 @@
 #include <linux/key-type.h>
 #include <keys/user-type.h>
 
+#include "config.h"
+
 extern struct key_type amnesiafs_key_type;
 
-int amnesiafs_get_passphrase(char **passphrase, const char *key_desc);
+struct key *amnesiafs_get_key(char **passphrase, size_t *len,
+			      const char *key_desc);
+
+int amnesiafs_get_passphrase(char **passphrase, size_t *len,
+			     const char *key_desc);
+
+int amnesiafs_derive_key(const struct amnesiafs_config *config,
+			 const char *info, u8 *key, unsigned int len);
 
 #endif
@@ -3,23 +3,26 @@
 #ifndef AMNESIAFS_LOG_H
 #define AMNESIAFS_LOG_H
 
+#include <linux/printk.h>
+
 void amnesiafs_msg(const char *level, const char *fmt, ...)
 	__attribute__((format(printf, 2, 3)));
 
-void amnesiafs_msg_line_number(const char *level, const char *fname, int lineno,
-			       const char *fxname, const char *fmt, ...)
-	__attribute__((format(printf, 5, 6)));
-
 #define amnesiafs_err(fmt, ...) amnesiafs_msg(KERN_ERR, fmt, ##__VA_ARGS__)
 
 #define amnesiafs_info(fmt, ...) amnesiafs_msg(KERN_INFO, fmt, ##__VA_ARGS__)
 
-#if defined(DEBUG)
+/*
+ * Debug messages go through dynamic debug, so each call site is a static
+ * branch that stays patched out until enabled with something like:
+ *
+ *   echo 'module amnesiafs +pfl' > /sys/kernel/debug/dynamic_debug/control
+ *
+ * When enabled they are rate limited, since several of them sit on the
+ * read, write and lookup paths. Without dynamic debug support they compile
+ * to nothing.
+ */
 #define amnesiafs_debug(fmt, ...)                                              \
-	amnesiafs_msg_line_number(KERN_DEBUG, __FILE__, __LINE__, __func__,    \
-				  fmt, ##__VA_ARGS__)
-#else
-#define amnesiafs_debug(fmt, ...) no_printk(KERN_DEBUG fmt, ##__VA_ARGS__)
-#endif
+	pr_debug_ratelimited("amnesiafs: " fmt "\n", ##__VA_ARGS__)
 
-#endif
\ No newline at end of file
+#endif
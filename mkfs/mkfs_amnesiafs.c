@@ -2,6 +2,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -32,29 +33,118 @@ static int ensure_random_salt(uint8_t *buf)
 	}
 }
 
-static int write_root_inode(int fd)
+/* the same as the kernel's crc32c(), seeded with ~0 and not inverted */
+static uint32_t crc32c(uint32_t crc, const void *data, size_t len)
 {
-	ssize_t written;
+	const uint8_t *p = data;
+	int bit;
 
-	struct amnesiafs_inode root_inode;
+	while (len--) {
+		crc ^= *p++;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+	}
+
+	return crc;
+}
+
+/* the checksum of len bytes at data, with the one at offset taken as 0 */
+static uint32_t checksum(const void *data, size_t len, size_t offset)
+{
+	const uint32_t zero = 0;
+	uint32_t crc;
 
-	root_inode.mode = S_IFDIR;
-	root_inode.inode_no = 1;
-	root_inode.data_block_number = 4;
-	root_inode.dir_children_count = 0;
+	crc = crc32c(~0, data, offset);
+	crc = crc32c(crc, &zero, sizeof(zero));
+	return crc32c(crc, (const uint8_t *)data + offset + sizeof(zero),
+		      len - offset - sizeof(zero));
+}
 
-	written = write(fd, &root_inode, sizeof(root_inode));
+static int write_block(int fd, uint64_t block_number, const void *buf)
+{
+	ssize_t written = pwrite(fd, buf, AMNESIAFS_BLOCKSIZE,
+				 block_number * AMNESIAFS_BLOCKSIZE);
 
-	if (written != sizeof(root_inode)) {
-		printf("Error: wrote the wrong number of bytes (%zd instead of %ld)\n",
-		       written, sizeof(root_inode));
+	if (written != AMNESIAFS_BLOCKSIZE) {
+		printf("Error: wrote the wrong number of bytes (%zd instead of %d)\n",
+		       written, AMNESIAFS_BLOCKSIZE);
 		return 1;
 	}
 
 	return 0;
 }
 
-static int64_t get_available_blocks(int fd)
+static int write_inode_table(int fd)
+{
+	int err;
+	uint64_t i;
+	uint8_t block[AMNESIAFS_BLOCKSIZE] = { 0 };
+	struct amnesiafs_inode *root_inode = (struct amnesiafs_inode *)block;
+
+	/* the root inode always lives in the first slot */
+	root_inode->mode = S_IFDIR;
+	root_inode->inode_no = AMNESIAFS_ROOT_INODE_NUMBER;
+	root_inode->data_block_number = AMNESIAFS_ROOT_DIR_BLOCK_NUMBER;
+	root_inode->dir_children_count = 0;
+	root_inode->checksum = checksum(root_inode, sizeof(*root_inode),
+					offsetof(struct amnesiafs_inode,
+						 checksum));
+
+	for (i = 0; i < AMNESIAFS_INODE_TABLE_BLOCKS; i++) {
+		err = write_block(fd, AMNESIAFS_INODE_TABLE_BLOCK_NUMBER + i,
+				  block);
+		if (err != 0)
+			return err;
+
+		memset(block, 0, sizeof(block));
+	}
+
+	return 0;
+}
+
+static int write_root_dir(int fd)
+{
+	uint8_t block[AMNESIAFS_BLOCKSIZE] = { 0 };
+	uint32_t crc = checksum(block, sizeof(block),
+				AMNESIAFS_DIR_CHECKSUM_OFFSET);
+
+	memcpy(block + AMNESIAFS_DIR_CHECKSUM_OFFSET, &crc, sizeof(crc));
+	return write_block(fd, AMNESIAFS_ROOT_DIR_BLOCK_NUMBER, block);
+}
+
+static int write_bitmap(int fd, uint64_t bitmap_blocks, uint64_t used_blocks)
+{
+	int err;
+	uint64_t i, bit;
+	uint8_t block[AMNESIAFS_BLOCKSIZE];
+
+	for (i = 0; i < bitmap_blocks; i++) {
+		memset(block, 0, sizeof(block));
+
+		/* mark everything up to the end of the bitmap as in use */
+		for (bit = 0; bit < AMNESIAFS_BITS_PER_BLOCK; bit++) {
+			if (i * AMNESIAFS_BITS_PER_BLOCK + bit >= used_blocks)
+				break;
+			block[bit / 8] |= 1 << (bit % 8);
+		}
+
+		err = write_block(fd, AMNESIAFS_BITMAP_BLOCK_NUMBER + i, block);
+		if (err != 0)
+			return err;
+	}
+
+	return 0;
+}
+
+static int write_journal(int fd, uint64_t journal_block)
+{
+	uint8_t block[AMNESIAFS_BLOCKSIZE] = { 0 };
+
+	/* an empty descriptor means there's nothing to replay */
+	return write_block(fd, journal_block, block);
+}
+
+static int64_t get_blocks_count(int fd)
 {
 	uint64_t size_bytes = 0;
 
@@ -63,21 +153,77 @@ static int64_t get_available_blocks(int fd)
 		return err;
 	}
 
-	int64_t blocks = size_bytes / AMNESIAFS_BLOCKSIZE;
+	return size_bytes / AMNESIAFS_BLOCKSIZE;
+}
+
+/* Claim devices 1 to nr_devices - 1 for the volume. */
+static int write_member_headers(const int *fds, uint64_t nr_devices,
+				const uint8_t *volume_uuid)
+{
+	int err;
+	uint64_t i;
+	struct amnesiafs_member_header header = {
+		.magic = AMNESIAFS_MEMBER_MAGIC,
+	};
+
+	memcpy(header.volume_uuid, volume_uuid, sizeof(header.volume_uuid));
 
-	/* reserve one block for the superblock */
-	return blocks - 1;
+	for (i = 1; i < nr_devices; i++) {
+		header.index = i;
+		err = write_block(fds[i], 0, &header);
+		if (err != 0)
+			return err;
+	}
+
+	return 0;
 }
 
-static int write_superblock(int fd)
+static int write_superblock(const int *fds, uint64_t nr_devices)
 {
 	int err = 0;
-	ssize_t written;
 	uint8_t salt[16];
+	uint8_t volume_uuid[16];
+	uint64_t bitmap_blocks;
+	uint64_t journal_block;
+	uint64_t refcount_block;
+	uint64_t used_blocks;
+	uint64_t per_device;
+	int64_t sizes[AMNESIAFS_MAX_DEVICES];
+	int64_t blocks = 0, smallest = INT64_MAX;
+	uint64_t i;
+
+	for (i = 0; i < nr_devices; i++) {
+		sizes[i] = get_blocks_count(fds[i]);
+		if (sizes[i] < 0) {
+			return sizes[i];
+		}
+		blocks += sizes[i];
+		if (sizes[i] < smallest)
+			smallest = sizes[i];
+	}
+
+	/* the bitmap is sized for all of it, even what striping can't use */
+	bitmap_blocks = (blocks + AMNESIAFS_BITS_PER_BLOCK - 1) /
+			AMNESIAFS_BITS_PER_BLOCK;
+	journal_block = AMNESIAFS_BITMAP_BLOCK_NUMBER + bitmap_blocks;
+	refcount_block = journal_block + AMNESIAFS_JOURNAL_BLOCKS;
+	used_blocks = refcount_block + AMNESIAFS_REFCOUNT_BLOCKS;
 
-	int64_t blocks = get_available_blocks(fd);
-	if (blocks < 0) {
-		return blocks;
+	/*
+	 * Each device holds the same number of whole stripes past data_start,
+	 * so the smallest one decides how much of the rest gets used.
+	 */
+	if (nr_devices > 1) {
+		per_device = 0;
+		if ((uint64_t)smallest > used_blocks)
+			per_device = (smallest - used_blocks) /
+				     AMNESIAFS_DEFAULT_STRIPE_BLOCKS *
+				     AMNESIAFS_DEFAULT_STRIPE_BLOCKS;
+		blocks = used_blocks + nr_devices * per_device;
+	}
+	if ((uint64_t)blocks <= used_blocks) {
+		printf("Error: device is too small (%ld blocks)\n", blocks);
+		return 1;
 	}
 
 	/* get a fresh salt for every amnesiafs device */
@@ -86,55 +232,100 @@ static int write_superblock(int fd)
 		return err;
 	}
 
+	if (getrandom(volume_uuid, sizeof(volume_uuid), 0) !=
+	    sizeof(volume_uuid)) {
+		return -errno;
+	}
+
 	struct amnesiafs_super_block sb = {
 		.version = 1,
 		.magic = AMNESIAFS_MAGIC,
-		.inodes_count = 0,
-		.blocks_available = blocks,
+		.inodes_count = 1,
+		.blocks_available = blocks - used_blocks,
+		.blocks_count = blocks,
+		.bitmap_blocks = bitmap_blocks,
+		.journal_block = journal_block,
+		.journal_blocks = AMNESIAFS_JOURNAL_BLOCKS,
+		.journal_sequence = 0,
+		/* nothing's shared, so the table's contents don't matter */
+		.refcount_block = refcount_block,
+		.refcount_blocks = AMNESIAFS_REFCOUNT_BLOCKS,
+		.refcount_count = 0,
+		.nr_devices = nr_devices,
+		.stripe_blocks = AMNESIAFS_DEFAULT_STRIPE_BLOCKS,
+		.data_start = used_blocks,
+		.features = AMNESIAFS_FEATURE_CSUM |
+			    AMNESIAFS_FEATURE_ENCRYPTED_NAMES,
 	};
 
 	/* copy salt */
 	memcpy(&sb.salt, salt, sizeof(sb.salt));
+	memcpy(&sb.volume_uuid, volume_uuid, sizeof(sb.volume_uuid));
 
-	written = write(fd, &sb, sizeof(sb));
-	if (written != AMNESIAFS_BLOCKSIZE) {
-		printf("Error: wrote the wrong number of bytes (%zd instead of %d)\n",
-		       written, AMNESIAFS_BLOCKSIZE);
-		return 1;
-	}
+	for (i = 0; i < nr_devices; i++)
+		sb.devices[i].blocks = sizes[i];
 
-	return 0;
+	sb.checksum = checksum(&sb, sizeof(sb),
+			       offsetof(struct amnesiafs_super_block, checksum));
+
+	err = write_member_headers(fds, nr_devices, volume_uuid);
+	if (err != 0)
+		return err;
+
+	err = write_block(fds[0], AMNESIAFS_SUPER_BLOCK_NUMBER, &sb);
+	if (err != 0)
+		return err;
+
+	err = write_bitmap(fds[0], bitmap_blocks, used_blocks);
+	if (err != 0)
+		return err;
+
+	return write_journal(fds[0], journal_block);
 }
 
 int main(int argc, char *argv[])
 {
-	int fd;
+	int fds[AMNESIAFS_MAX_DEVICES];
+	int nr_devices = argc - 1;
+	int i;
 	int err = 0;
 
-	if (argc != 2) {
-		printf("Usage: %s device\n", argv[0]);
+	if (argc < 2 || nr_devices > AMNESIAFS_MAX_DEVICES) {
+		printf("Usage: %s device [device...]\n", argv[0]);
+		printf("A volume can stripe across up to %d devices; the first is the one to mount.\n",
+		       AMNESIAFS_MAX_DEVICES);
 		return 1;
 	}
 
-	fd = open(argv[1], O_RDWR);
-	if (fd == -1) {
-		perror("Error opening device");
-		return 1;
+	for (i = 0; i < nr_devices; i++) {
+		fds[i] = open(argv[i + 1], O_RDWR);
+		if (fds[i] == -1) {
+			perror("Error opening device");
+			err = 1;
+			goto out;
+		}
 	}
 
-	err = write_superblock(fd);
+	err = write_superblock(fds, nr_devices);
 	if (err != 0) {
 		perror("Error writing superblock");
 		goto out;
 	}
 
-	err = write_root_inode(fd);
+	err = write_inode_table(fds[0]);
+	if (err != 0) {
+		perror("Error writing inode table");
+		goto out;
+	}
+
+	err = write_root_dir(fds[0]);
 	if (err != 0) {
-		perror("Error writing root inode");
+		perror("Error writing root directory");
 		goto out;
 	}
 
 out:
-	close(fd);
+	while (i--)
+		close(fds[i]);
 	return err;
 }
@@ -0,0 +1,259 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <crypto/aes.h>
+#include <crypto/skcipher.h>
+#include <linux/fs.h>
+#include <linux/jhash.h>
+#include <linux/kernel.h>
+#include <linux/scatterlist.h>
+#include <linux/siphash.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "amnesiafs.h"
+
+#include "dir.h"
+#include "keys.h"
+#include "log.h"
+#include "names.h"
+#include "super.h"
+
+/*
+ * With AMNESIAFS_FEATURE_ENCRYPTED_NAMES, directory records hold names
+ * encrypted with AES-256-CBC with ciphertext stealing, like fscrypt's
+ * filenames, with the directory's inode number as the IV. Names are padded
+ * with zeros to a multiple of 16 bytes, so their exact length doesn't show.
+ *
+ * Each record also carries a SipHash of the directory and the plaintext
+ * name, under a key of its own. Lookup hashes the name it's after once and
+ * compares that against each record. Only on a match does it encrypt the
+ * name, once, to compare ciphertexts: a name always encrypts the same way
+ * in the same directory. So lookup never decrypts anything; only readdir
+ * does. The same hash feeds the directory's Bloom filter.
+ *
+ * Both keys are derived from the passphrase.
+ */
+
+#define AMNESIAFS_NAMES_KEY_SIZE 32
+
+int amnesiafs_names_init(struct super_block *sb)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	struct crypto_sync_skcipher *tfm;
+	u8 raw[AMNESIAFS_NAMES_KEY_SIZE];
+	int err;
+
+	if (!(sbi->disk_sb->features & AMNESIAFS_FEATURE_ENCRYPTED_NAMES))
+		return 0;
+
+	tfm = crypto_alloc_sync_skcipher("cts(cbc(aes))", 0, 0);
+	if (IS_ERR(tfm)) {
+		amnesiafs_err("can't load cts(cbc(aes)): %ld", PTR_ERR(tfm));
+		return PTR_ERR(tfm);
+	}
+
+	err = amnesiafs_derive_key(sbi->config, "amnesiafs names", raw,
+				   sizeof(raw));
+	if (!err)
+		err = crypto_sync_skcipher_setkey(tfm, raw, sizeof(raw));
+	if (!err)
+		err = amnesiafs_derive_key(sbi->config, "amnesiafs name hash",
+					   (u8 *)&sbi->names_hash_key,
+					   sizeof(sbi->names_hash_key));
+	memzero_explicit(raw, sizeof(raw));
+	if (err) {
+		crypto_free_sync_skcipher(tfm);
+		return err;
+	}
+
+	sbi->names_tfm = tfm;
+	return 0;
+}
+
+void amnesiafs_names_destroy(struct super_block *sb)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+
+	if (!sbi->names_tfm)
+		return;
+
+	crypto_free_sync_skcipher(sbi->names_tfm);
+	sbi->names_tfm = NULL;
+	memzero_explicit(&sbi->names_hash_key, sizeof(sbi->names_hash_key));
+}
+
+/* The longest name a directory can hold. */
+unsigned int amnesiafs_name_max(struct super_block *sb)
+{
+	if (AMNESIAFS_SB(sb)->names_tfm)
+		return AMNESIAFS_ENCRYPTED_NAME_MAX;
+	return AMNESIAFS_FILENAME_MAX - 1;
+}
+
+/* How long the ciphertext of a len byte name is. */
+static unsigned int amnesiafs_name_padded(unsigned int len)
+{
+	return min_t(unsigned int, round_up(max_t(unsigned int, len, 1),
+					    AES_BLOCK_SIZE),
+		     AMNESIAFS_ENCRYPTED_NAME_MAX);
+}
+
+/* En- or decrypt the len bytes at buf in place. */
+static int amnesiafs_name_crypt(struct inode *dir, u8 *buf, unsigned int len,
+				bool encrypt)
+{
+	struct crypto_sync_skcipher *tfm = AMNESIAFS_SB(dir->i_sb)->names_tfm;
+	SYNC_SKCIPHER_REQUEST_ON_STACK(req, tfm);
+	u64 iv[AES_BLOCK_SIZE / sizeof(u64)] = { dir->i_ino };
+	struct scatterlist sg;
+	int err;
+
+	sg_init_one(&sg, buf, len);
+	skcipher_request_set_sync_tfm(req, tfm);
+	skcipher_request_set_callback(req, 0, NULL, NULL);
+	skcipher_request_set_crypt(req, &sg, &sg, len, iv);
+	err = encrypt ? crypto_skcipher_encrypt(req) :
+			crypto_skcipher_decrypt(req);
+	skcipher_request_zero(req);
+
+	if (err)
+		amnesiafs_err("directory %lu: name %scryption failed: %d",
+			      dir->i_ino, encrypt ? "en" : "de", err);
+	return err;
+}
+
+/*
+ * Encrypt name into buf, which has room for AMNESIAFS_ENCRYPTED_NAME_MAX
+ * bytes, and return the length of the ciphertext.
+ */
+static int amnesiafs_name_encrypt(struct inode *dir, const struct qstr *name,
+				  u8 *buf)
+{
+	unsigned int len = amnesiafs_name_padded(name->len);
+	int err;
+
+	memset(buf, 0, len);
+	memcpy(buf, name->name, name->len);
+	err = amnesiafs_name_crypt(dir, buf, len, true);
+	return err ? err : len;
+}
+
+/* What the directory's records are looked up and filtered by. */
+u64 amnesiafs_name_hash(struct inode *dir, const char *name, unsigned int len)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(dir->i_sb);
+
+	if (!sbi->names_tfm)
+		return jhash(name, len, 0);
+
+	return siphash_2u64(dir->i_ino,
+			    siphash(name, len, &sbi->names_hash_key),
+			    &sbi->names_hash_key);
+}
+
+/* The hash of the name in record, without decrypting it. */
+u64 amnesiafs_name_record_hash(struct inode *dir,
+			       const struct amnesiafs_dir_record *record)
+{
+	if (AMNESIAFS_SB(dir->i_sb)->names_tfm)
+		return record->name_hash;
+
+	return amnesiafs_name_hash(dir, record->filename,
+				   strnlen(record->filename,
+					   AMNESIAFS_FILENAME_MAX));
+}
+
+/*
+ * The index of the record for name among the first count, or -ENOENT.
+ * hash is amnesiafs_name_hash() of name.
+ */
+int amnesiafs_name_find(struct inode *dir,
+			const struct amnesiafs_dir_record *records,
+			unsigned int count, const struct qstr *name, u64 hash)
+{
+	u8 *buf = NULL;
+	int i, len = 0, err = -ENOENT;
+
+	if (!AMNESIAFS_SB(dir->i_sb)->names_tfm) {
+		i = amnesiafs_dir_find(records, count, name->name, name->len);
+		return i < 0 ? -ENOENT : i;
+	}
+
+	for (i = amnesiafs_dir_find_hash(records, 0, count, hash); i >= 0;
+	     i = amnesiafs_dir_find_hash(records, i + 1, count, hash)) {
+		if (!buf) {
+			/* the scatterlist can't point at the stack */
+			buf = kmalloc(AMNESIAFS_ENCRYPTED_NAME_MAX, GFP_NOFS);
+			if (!buf)
+				return -ENOMEM;
+			len = amnesiafs_name_encrypt(dir, name, buf);
+			if (len < 0) {
+				err = len;
+				break;
+			}
+		}
+
+		if (records[i].name_len == len &&
+		    !memcmp(records[i].name, buf, len)) {
+			err = i;
+			break;
+		}
+	}
+
+	kfree(buf);
+	return err;
+}
+
+/* Fill in record's name and hash for name. */
+int amnesiafs_name_store(struct inode *dir,
+			 struct amnesiafs_dir_record *record,
+			 const struct qstr *name, u64 hash)
+{
+	int len;
+
+	if (!AMNESIAFS_SB(dir->i_sb)->names_tfm) {
+		memcpy(record->filename, name->name, name->len);
+		record->filename[name->len] = '\0';
+		return 0;
+	}
+
+	len = amnesiafs_name_encrypt(dir, name, record->name);
+	if (len < 0)
+		return len;
+	record->name_hash = hash;
+	record->name_len = len;
+
+	return 0;
+}
+
+/*
+ * Copy the name in record to buf, which has room for AMNESIAFS_FILENAME_MAX
+ * bytes and mustn't be on the stack, and return its length.
+ */
+int amnesiafs_name_load(struct inode *dir,
+			const struct amnesiafs_dir_record *record, char *buf)
+{
+	unsigned int len;
+	int err;
+
+	if (!AMNESIAFS_SB(dir->i_sb)->names_tfm) {
+		len = strnlen(record->filename, AMNESIAFS_FILENAME_MAX);
+		memcpy(buf, record->filename, len);
+		return len;
+	}
+
+	len = record->name_len;
+	if (len < AES_BLOCK_SIZE || len > AMNESIAFS_ENCRYPTED_NAME_MAX) {
+		amnesiafs_err("directory %lu: bad name length %u", dir->i_ino,
+			      len);
+		return -EIO;
+	}
+
+	memcpy(buf, record->name, len);
+	err = amnesiafs_name_crypt(dir, (u8 *)buf, len, false);
+	if (err)
+		return err;
+
+	/* without the padding */
+	return strnlen(buf, len);
+}
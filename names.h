@@ -0,0 +1,33 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#ifndef AMNESIAFS_NAMES_H
+#define AMNESIAFS_NAMES_H
+
+#include <linux/fs.h>
+
+#include "amnesiafs.h"
+
+int amnesiafs_names_init(struct super_block *sb);
+
+void amnesiafs_names_destroy(struct super_block *sb);
+
+unsigned int amnesiafs_name_max(struct super_block *sb);
+
+u64 amnesiafs_name_hash(struct inode *dir, const char *name,
+			unsigned int len);
+
+u64 amnesiafs_name_record_hash(struct inode *dir,
+			       const struct amnesiafs_dir_record *record);
+
+int amnesiafs_name_find(struct inode *dir,
+			const struct amnesiafs_dir_record *records,
+			unsigned int count, const struct qstr *name, u64 hash);
+
+int amnesiafs_name_store(struct inode *dir,
+			 struct amnesiafs_dir_record *record,
+			 const struct qstr *name, u64 hash);
+
+int amnesiafs_name_load(struct inode *dir,
+			const struct amnesiafs_dir_record *record, char *buf);
+
+#endif
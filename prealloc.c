@@ -0,0 +1,175 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/percpu_counter.h>
+#include <linux/sizes.h>
+#include <linux/spinlock.h>
+
+#include "amnesiafs.h"
+
+#include "extent.h"
+#include "inode.h"
+#include "log.h"
+#include "prealloc.h"
+#include "super.h"
+
+/*
+ * Files that are appended to a little at a time, like logs, would otherwise
+ * get a short run of blocks at every writeback, interleaved with those of
+ * every other file being appended to at the same time. So when writeback
+ * allocates up to the end of a file that's still open for writing, it takes
+ * a window of blocks past the end as well, in the same run, mapped as
+ * unwritten extents like fallocate's. Later appends land in the window and
+ * need no allocation of their own. The window is as big as the file, so it
+ * doubles as the file grows, up to AMNESIAFS_PREALLOC_MAX_BLOCKS.
+ *
+ * Whatever's left past the end of file is given back when the last writer
+ * closes it, when it's evicted, and when a write runs out of space. Only
+ * the in-memory range records which blocks were taken this way, so after a
+ * crash they stay allocated past the end, like fallocate -n would leave
+ * them, until the file is truncated.
+ */
+
+#define AMNESIAFS_PREALLOC_MIN_BLOCKS 16
+#define AMNESIAFS_PREALLOC_MAX_BLOCKS (SZ_8M / AMNESIAFS_BLOCKSIZE)
+
+void amnesiafs_prealloc_init(struct super_block *sb)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+
+	spin_lock_init(&sbi->prealloc_lock);
+	INIT_LIST_HEAD(&sbi->prealloc_list);
+}
+
+/*
+ * How many blocks to take past file block end, where an allocation of count
+ * blocks is about to finish, or 0 if this isn't an append worth helping.
+ * The caller holds extent_lock.
+ */
+unsigned int amnesiafs_prealloc_window(struct inode *inode, uint64_t end,
+				       unsigned int count)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(inode->i_sb);
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+	uint64_t window;
+
+	/* nothing may be mapped past a truncate until its blocks are freed */
+	if (atomic_read(&inode->i_writecount) <= 0 ||
+	    (info->raw.flags & AMNESIAFS_INODE_RECLAIM) ||
+	    sbi->config->compress ||
+	    end < DIV_ROUND_UP(i_size_read(inode), AMNESIAFS_BLOCKSIZE))
+		return 0;
+
+	window = clamp_t(uint64_t, rounddown_pow_of_two(end),
+			 AMNESIAFS_PREALLOC_MIN_BLOCKS,
+			 AMNESIAFS_PREALLOC_MAX_BLOCKS);
+	/* back off as the volume fills up */
+	window = min_t(uint64_t, window,
+		       percpu_counter_read_positive(&sbi->free_blocks) / 64);
+	if (window < AMNESIAFS_PREALLOC_MIN_BLOCKS)
+		return 0;
+
+	amnesiafs_debug("inode %lu: %u blocks to %llu, %llu more ahead",
+			inode->i_ino, count, end, window);
+
+	return window;
+}
+
+/*
+ * Note that file blocks [start, end) were taken ahead of appends. The caller
+ * holds extent_lock for writing.
+ */
+void amnesiafs_prealloc_track(struct inode *inode, uint64_t start,
+			      uint64_t end)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(inode->i_sb);
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+
+	if (!info->prealloc_end)
+		info->prealloc_start = start;
+	info->prealloc_end = end;
+
+	spin_lock(&sbi->prealloc_lock);
+	if (list_empty(&info->prealloc_entry))
+		list_add_tail(&info->prealloc_entry, &sbi->prealloc_list);
+	spin_unlock(&sbi->prealloc_lock);
+}
+
+/*
+ * Give back the blocks taken ahead of appends that are still past the end
+ * of file. The caller holds i_rwsem, or the inode is being evicted.
+ */
+int amnesiafs_prealloc_trim(struct inode *inode)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(inode->i_sb);
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+	uint64_t start, end;
+
+	spin_lock(&sbi->prealloc_lock);
+	list_del_init(&info->prealloc_entry);
+	spin_unlock(&sbi->prealloc_lock);
+
+	down_write(&info->extent_lock);
+	start = max_t(uint64_t, info->prealloc_start,
+		      DIV_ROUND_UP(i_size_read(inode), AMNESIAFS_BLOCKSIZE));
+	end = info->prealloc_end;
+	info->prealloc_start = info->prealloc_end = 0;
+	up_write(&info->extent_lock);
+
+	if (start >= end)
+		return 0;
+
+	amnesiafs_debug("inode %lu: giving back blocks %llu-%llu",
+			inode->i_ino, start, end - 1);
+	return amnesiafs_extent_free_range(inode, start, end);
+}
+
+/*
+ * Trim every file that can be had without waiting, for a write that ran out
+ * of space. Files whose i_rwsem is held, the caller's own among them, are
+ * passed over. Returns whether any was trimmed.
+ */
+bool amnesiafs_prealloc_trim_all(struct super_block *sb)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	struct amnesiafs_inode_info *info;
+	struct list_head *pos;
+	struct inode *inode;
+	unsigned int nr = 0;
+	bool trimmed = false;
+
+	spin_lock(&sbi->prealloc_lock);
+	list_for_each(pos, &sbi->prealloc_list)
+		nr++;
+	spin_unlock(&sbi->prealloc_lock);
+
+	while (nr--) {
+		spin_lock(&sbi->prealloc_lock);
+		info = list_first_entry_or_null(&sbi->prealloc_list,
+						struct amnesiafs_inode_info,
+						prealloc_entry);
+		if (!info) {
+			spin_unlock(&sbi->prealloc_lock);
+			break;
+		}
+		/* busy ones stay behind the rest */
+		list_move_tail(&info->prealloc_entry, &sbi->prealloc_list);
+		/* on its way out, eviction trims it */
+		inode = igrab(&info->vfs_inode);
+		spin_unlock(&sbi->prealloc_lock);
+		if (!inode)
+			continue;
+
+		if (inode_trylock(inode)) {
+			if (!amnesiafs_prealloc_trim(inode))
+				trimmed = true;
+			inode_unlock(inode);
+		}
+		iput(inode);
+	}
+
+	return trimmed;
+}
@@ -0,0 +1,20 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#ifndef AMNESIAFS_PREALLOC_H
+#define AMNESIAFS_PREALLOC_H
+
+#include <linux/fs.h>
+
+void amnesiafs_prealloc_init(struct super_block *sb);
+
+unsigned int amnesiafs_prealloc_window(struct inode *inode, uint64_t end,
+				       unsigned int count);
+
+void amnesiafs_prealloc_track(struct inode *inode, uint64_t start,
+			      uint64_t end);
+
+int amnesiafs_prealloc_trim(struct inode *inode);
+
+bool amnesiafs_prealloc_trim_all(struct super_block *sb);
+
+#endif
@@ -0,0 +1,617 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <crypto/skcipher.h>
+#include <linux/backing-dev.h>
+#include <linux/fs.h>
+#include <linux/highmem.h>
+#include <linux/kernel.h>
+#include <linux/key.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/pagemap.h>
+#include <linux/rwsem.h>
+#include <linux/scatterlist.h>
+#include <linux/slab.h>
+#include <linux/stat.h>
+#include <linux/writeback.h>
+#include <linux/xarray.h>
+
+#include "amnesiafs.h"
+
+#include "config.h"
+#include "keys.h"
+#include "log.h"
+#include "ram.h"
+
+/*
+ * Mounting "none" gives a file system without a device. Files live in
+ * memory, encrypted: each file keeps a store of pages holding its data
+ * encrypted with AES-256-XTS, under a key derived from the user's, with
+ * the inode and page numbers as the tweak. The page cache is only a
+ * decrypted cache over that store. Writeback encrypts dirty pages into it
+ * rather than to a device, after which reclaim is free to drop them, and
+ * reading them back decrypts them again. Store pages aren't on the LRU, so
+ * nothing ever reaches a block device or swap.
+ *
+ * The mount keeps the user's key, rather than revoking it once read as a
+ * volume does, and revokes it itself at umount. Revoking it before then
+ * throws away the data key and every file's contents at once: files are
+ * left empty, and reading or writing them fails with -EKEYREVOKED.
+ *
+ * Whatever is forgotten is wiped rather than just freed: cached pages are
+ * zeroed as they leave the page cache, whether they're truncated, evicted
+ * or reclaimed, and store pages when they're let go of.
+ */
+
+#define AMNESIAFS_RAM_KEY_SIZE 64
+
+struct amnesiafs_ram_sb_info {
+	struct super_block *sb;
+	/* on amnesiafs_ram_mounts, to be found when the key is revoked */
+	struct list_head list;
+	struct key *key;
+
+	/* the data key, NULL once it's been revoked */
+	struct rw_semaphore lock;
+	struct crypto_sync_skcipher *tfm;
+};
+
+struct amnesiafs_ram_inode {
+	/* encrypted pages of the file, by index */
+	struct xarray store;
+	struct inode vfs_inode;
+};
+
+static LIST_HEAD(amnesiafs_ram_mounts);
+static DEFINE_MUTEX(amnesiafs_ram_mounts_lock);
+
+static const struct super_operations amnesiafs_ram_super_operations;
+static const struct inode_operations amnesiafs_ram_dir_inode_operations;
+static const struct inode_operations amnesiafs_ram_file_inode_operations;
+static const struct file_operations amnesiafs_ram_file_operations;
+static const struct address_space_operations amnesiafs_ram_aops;
+
+static inline struct amnesiafs_ram_sb_info *
+AMNESIAFS_RAM_SB(struct super_block *sb)
+{
+	return sb->s_fs_info;
+}
+
+static inline struct amnesiafs_ram_inode *AMNESIAFS_RAM_I(struct inode *inode)
+{
+	return container_of(inode, struct amnesiafs_ram_inode, vfs_inode);
+}
+
+/* Free the store pages of inode from index on. */
+static void amnesiafs_ram_free_store(struct inode *inode, pgoff_t index)
+{
+	struct xarray *store = &AMNESIAFS_RAM_I(inode)->store;
+	struct page *page;
+	unsigned long i;
+
+	xa_for_each_start(store, i, page, index) {
+		xa_erase(store, i);
+		clear_highpage(page);
+		__free_page(page);
+		cond_resched();
+	}
+}
+
+static int amnesiafs_ram_crypt_locked(struct inode *inode,
+				      struct crypto_sync_skcipher *tfm,
+				      struct page *dst, struct page *src,
+				      pgoff_t index, bool encrypt)
+{
+	SYNC_SKCIPHER_REQUEST_ON_STACK(req, tfm);
+	u64 iv[2] = { inode->i_ino, index };
+	struct scatterlist src_sg, dst_sg;
+	int err;
+
+	sg_init_table(&src_sg, 1);
+	sg_set_page(&src_sg, src, PAGE_SIZE, 0);
+	sg_init_table(&dst_sg, 1);
+	sg_set_page(&dst_sg, dst, PAGE_SIZE, 0);
+	skcipher_request_set_sync_tfm(req, tfm);
+	skcipher_request_set_callback(req, 0, NULL, NULL);
+	skcipher_request_set_crypt(req, &src_sg, &dst_sg, PAGE_SIZE, iv);
+	err = encrypt ? crypto_skcipher_encrypt(req) :
+			crypto_skcipher_decrypt(req);
+	skcipher_request_zero(req);
+
+	return err;
+}
+
+/* En- or decrypt page index of inode from src into dst. */
+static int amnesiafs_ram_crypt(struct inode *inode, struct page *dst,
+			       struct page *src, pgoff_t index, bool encrypt)
+{
+	struct amnesiafs_ram_sb_info *sbi = AMNESIAFS_RAM_SB(inode->i_sb);
+	int err = -EKEYREVOKED;
+
+	down_read(&sbi->lock);
+	if (sbi->tfm)
+		err = amnesiafs_ram_crypt_locked(inode, sbi->tfm, dst, src,
+						 index, encrypt);
+	up_read(&sbi->lock);
+
+	if (err && err != -EKEYREVOKED)
+		amnesiafs_err("inode %lu: page %lu %scryption failed: %d",
+			      inode->i_ino, index, encrypt ? "en" : "de", err);
+	return err;
+}
+
+/* Fill a locked page from the store, where it has never been, with zeros. */
+static int amnesiafs_ram_fill_page(struct page *page)
+{
+	struct inode *inode = page->mapping->host;
+	struct page *store;
+	int err;
+
+	store = xa_load(&AMNESIAFS_RAM_I(inode)->store, page->index);
+	if (!store) {
+		zero_user(page, 0, PAGE_SIZE);
+		SetPageUptodate(page);
+		return 0;
+	}
+
+	err = amnesiafs_ram_crypt(inode, page, store, page->index, false);
+	if (err)
+		return err;
+	SetPageUptodate(page);
+	return 0;
+}
+
+/* Throw away the contents of a file, its key gone. */
+static void amnesiafs_ram_forget(struct inode *inode)
+{
+	if (!S_ISREG(inode->i_mode))
+		return;
+
+	inode_lock(inode);
+	truncate_setsize(inode, 0);
+	amnesiafs_ram_free_store(inode, 0);
+	inode_unlock(inode);
+}
+
+/*
+ * Drop the data key and every file's contents. Called with
+ * amnesiafs_ram_mounts_lock held, which keeps sb from being killed.
+ */
+static void amnesiafs_ram_discard(struct super_block *sb)
+{
+	struct amnesiafs_ram_sb_info *sbi = AMNESIAFS_RAM_SB(sb);
+	struct inode *inode, *toput = NULL;
+
+	amnesiafs_info("key revoked, discarding files");
+
+	down_write(&sbi->lock);
+	crypto_free_sync_skcipher(sbi->tfm);
+	sbi->tfm = NULL;
+	up_write(&sbi->lock);
+
+	spin_lock(&sb->s_inode_list_lock);
+	list_for_each_entry(inode, &sb->s_inodes, i_sb_list) {
+		spin_lock(&inode->i_lock);
+		if (inode->i_state & (I_FREEING | I_WILL_FREE | I_NEW)) {
+			spin_unlock(&inode->i_lock);
+			continue;
+		}
+		__iget(inode);
+		spin_unlock(&inode->i_lock);
+		spin_unlock(&sb->s_inode_list_lock);
+
+		iput(toput);
+		toput = inode;
+		amnesiafs_ram_forget(inode);
+		cond_resched();
+
+		spin_lock(&sb->s_inode_list_lock);
+	}
+	spin_unlock(&sb->s_inode_list_lock);
+	iput(toput);
+}
+
+/* Called as key is revoked, see keys.c. */
+void amnesiafs_ram_revoke(struct key *key)
+{
+	struct amnesiafs_ram_sb_info *sbi;
+
+	mutex_lock(&amnesiafs_ram_mounts_lock);
+	list_for_each_entry(sbi, &amnesiafs_ram_mounts, list) {
+		if (sbi->key == key)
+			amnesiafs_ram_discard(sbi->sb);
+	}
+	mutex_unlock(&amnesiafs_ram_mounts_lock);
+}
+
+static struct inode *amnesiafs_ram_new_inode(struct super_block *sb,
+					     const struct inode *dir,
+					     umode_t mode)
+{
+	struct inode *inode = new_inode(sb);
+
+	if (!inode)
+		return NULL;
+
+	inode->i_ino = get_next_ino();
+	inode_init_owner(inode, dir, mode);
+	inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
+	inode->i_mapping->a_ops = &amnesiafs_ram_aops;
+	mapping_set_gfp_mask(inode->i_mapping, GFP_HIGHUSER);
+
+	if (S_ISDIR(mode)) {
+		inode->i_op = &amnesiafs_ram_dir_inode_operations;
+		inode->i_fop = &simple_dir_operations;
+		/* for "." */
+		inc_nlink(inode);
+	} else {
+		inode->i_op = &amnesiafs_ram_file_inode_operations;
+		inode->i_fop = &amnesiafs_ram_file_operations;
+	}
+
+	return inode;
+}
+
+static int amnesiafs_ram_mknod(struct inode *dir, struct dentry *dentry,
+			       umode_t mode)
+{
+	struct inode *inode;
+
+	if (!S_ISDIR(mode) && !S_ISREG(mode))
+		return -EINVAL;
+
+	inode = amnesiafs_ram_new_inode(dir->i_sb, dir, mode);
+	if (!inode)
+		return -ENOSPC;
+
+	d_instantiate(dentry, inode);
+	/* the dentry's reference keeps it around until it's unlinked */
+	dget(dentry);
+	dir->i_mtime = dir->i_ctime = current_time(dir);
+
+	return 0;
+}
+
+static int amnesiafs_ram_create(struct inode *dir, struct dentry *dentry,
+				umode_t mode, bool excl)
+{
+	return amnesiafs_ram_mknod(dir, dentry, mode | S_IFREG);
+}
+
+static int amnesiafs_ram_mkdir(struct inode *dir, struct dentry *dentry,
+			       umode_t mode)
+{
+	int err = amnesiafs_ram_mknod(dir, dentry, mode | S_IFDIR);
+
+	if (!err)
+		inc_nlink(dir);
+	return err;
+}
+
+static int amnesiafs_ram_setattr(struct dentry *dentry, struct iattr *attr)
+{
+	struct inode *inode = d_inode(dentry);
+	struct page *page;
+	pgoff_t index;
+	int err;
+
+	err = setattr_prepare(dentry, attr);
+	if (err)
+		return err;
+
+	if (attr->ia_valid & ATTR_SIZE) {
+		/*
+		 * Truncation zeroes the partial page past the end, but only
+		 * if it's cached, and the store has a copy of its own.
+		 */
+		if (attr->ia_size < inode->i_size &&
+		    (attr->ia_size & ~PAGE_MASK)) {
+			page = read_mapping_page(inode->i_mapping,
+						 attr->ia_size >> PAGE_SHIFT,
+						 NULL);
+			if (IS_ERR(page))
+				return PTR_ERR(page);
+			lock_page(page);
+			zero_user_segment(page, attr->ia_size & ~PAGE_MASK,
+					  PAGE_SIZE);
+			set_page_dirty(page);
+			unlock_page(page);
+			put_page(page);
+		}
+		truncate_setsize(inode, attr->ia_size);
+		index = DIV_ROUND_UP(attr->ia_size, PAGE_SIZE);
+		amnesiafs_ram_free_store(inode, index);
+	}
+
+	setattr_copy(inode, attr);
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+static struct inode *amnesiafs_ram_alloc_inode(struct super_block *sb)
+{
+	struct amnesiafs_ram_inode *ri = kmalloc(sizeof(*ri), GFP_KERNEL);
+
+	if (!ri)
+		return NULL;
+
+	inode_init_once(&ri->vfs_inode);
+	xa_init(&ri->store);
+	return &ri->vfs_inode;
+}
+
+static void amnesiafs_ram_free_inode(struct inode *inode)
+{
+	kfree(AMNESIAFS_RAM_I(inode));
+}
+
+static void amnesiafs_ram_evict_inode(struct inode *inode)
+{
+	truncate_inode_pages_final(&inode->i_data);
+	amnesiafs_ram_free_store(inode, 0);
+	clear_inode(inode);
+}
+
+static const struct super_operations amnesiafs_ram_super_operations = {
+	.alloc_inode = amnesiafs_ram_alloc_inode,
+	.free_inode = amnesiafs_ram_free_inode,
+	.statfs = simple_statfs,
+	.drop_inode = generic_delete_inode,
+	.evict_inode = amnesiafs_ram_evict_inode,
+};
+
+static const struct inode_operations amnesiafs_ram_dir_inode_operations = {
+	.create = amnesiafs_ram_create,
+	.lookup = simple_lookup,
+	.link = simple_link,
+	.unlink = simple_unlink,
+	.mkdir = amnesiafs_ram_mkdir,
+	.rmdir = simple_rmdir,
+	.rename = simple_rename,
+	.setattr = amnesiafs_ram_setattr,
+};
+
+static const struct inode_operations amnesiafs_ram_file_inode_operations = {
+	.setattr = amnesiafs_ram_setattr,
+	.getattr = simple_getattr,
+};
+
+static const struct file_operations amnesiafs_ram_file_operations = {
+	.owner = THIS_MODULE,
+	.llseek = generic_file_llseek,
+	.read_iter = generic_file_read_iter,
+	.write_iter = generic_file_write_iter,
+	.mmap = generic_file_mmap,
+	.fsync = noop_fsync,
+	.splice_read = generic_file_splice_read,
+	.splice_write = iter_file_splice_write,
+};
+
+static int amnesiafs_ram_readpage(struct file *file, struct page *page)
+{
+	int err = amnesiafs_ram_fill_page(page);
+
+	if (err)
+		SetPageError(page);
+	unlock_page(page);
+	return err;
+}
+
+static int amnesiafs_ram_write_begin(struct file *file,
+				     struct address_space *mapping, loff_t pos,
+				     unsigned int len, unsigned int flags,
+				     struct page **pagep, void **fsdata)
+{
+	struct amnesiafs_ram_sb_info *sbi =
+		AMNESIAFS_RAM_SB(mapping->host->i_sb);
+	struct page *page;
+	int err;
+
+	if (!READ_ONCE(sbi->tfm))
+		return -EKEYREVOKED;
+
+	page = grab_cache_page_write_begin(mapping, pos >> PAGE_SHIFT, flags);
+	if (!page)
+		return -ENOMEM;
+
+	/* the rest of the page may only be in the store */
+	if (!PageUptodate(page) && len != PAGE_SIZE) {
+		err = amnesiafs_ram_fill_page(page);
+		if (err) {
+			unlock_page(page);
+			put_page(page);
+			return err;
+		}
+	}
+
+	*pagep = page;
+	return 0;
+}
+
+/* Encrypt a dirty page into the store, for it to be let go of. */
+static int amnesiafs_ram_writepage(struct page *page,
+				   struct writeback_control *wbc)
+{
+	struct inode *inode = page->mapping->host;
+	struct xarray *store = &AMNESIAFS_RAM_I(inode)->store;
+	struct page *out;
+	int err;
+
+	/* truncated in the meantime */
+	if (page->index >= DIV_ROUND_UP(i_size_read(inode), PAGE_SIZE))
+		goto out;
+
+	out = xa_load(store, page->index);
+	if (!out) {
+		out = alloc_page(GFP_NOFS | __GFP_HIGHMEM | __GFP_ZERO |
+				 __GFP_NOWARN);
+		if (!out)
+			goto redirty;
+		err = xa_err(xa_store(store, page->index, out,
+				      GFP_NOFS | __GFP_NOWARN));
+		if (err) {
+			__free_page(out);
+			goto redirty;
+		}
+	}
+
+	err = amnesiafs_ram_crypt(inode, out, page, page->index, true);
+	/* with the key gone, so is the file's content */
+	if (err && err != -EKEYREVOKED)
+		goto redirty;
+
+out:
+	set_page_writeback(page);
+	unlock_page(page);
+	end_page_writeback(page);
+	return 0;
+
+redirty:
+	redirty_page_for_writepage(wbc, page);
+	unlock_page(page);
+	return 0;
+}
+
+/* Pages leaving the page cache, however they go, are wiped. */
+static void amnesiafs_ram_freepage(struct page *page)
+{
+	clear_highpage(page);
+}
+
+static const struct address_space_operations amnesiafs_ram_aops = {
+	.readpage = amnesiafs_ram_readpage,
+	.writepage = amnesiafs_ram_writepage,
+	.write_begin = amnesiafs_ram_write_begin,
+	.write_end = simple_write_end,
+	.set_page_dirty = __set_page_dirty_nobuffers,
+	.freepage = amnesiafs_ram_freepage,
+};
+
+/* Set up the data key, from the user's key, which the mount holds on to. */
+static int amnesiafs_ram_key_init(struct super_block *sb,
+				  struct amnesiafs_config *config)
+{
+	struct amnesiafs_ram_sb_info *sbi = AMNESIAFS_RAM_SB(sb);
+	struct crypto_sync_skcipher *tfm;
+	u8 raw[AMNESIAFS_RAM_KEY_SIZE];
+	struct key *key;
+	int err;
+
+	key = amnesiafs_get_key(&config->passphrase, &config->passphrase_len,
+				config->key_desc);
+	if (IS_ERR(key))
+		return PTR_ERR(key);
+	/* revoked and put by amnesiafs_ram_kill_sb() from here on */
+	sbi->key = key;
+
+	tfm = crypto_alloc_sync_skcipher("xts(aes)", 0, 0);
+	if (IS_ERR(tfm)) {
+		amnesiafs_err("can't load xts(aes): %ld", PTR_ERR(tfm));
+		return PTR_ERR(tfm);
+	}
+
+	err = amnesiafs_derive_key(config, "amnesiafs ram", raw, sizeof(raw));
+	if (!err)
+		err = crypto_sync_skcipher_setkey(tfm, raw, sizeof(raw));
+	memzero_explicit(raw, sizeof(raw));
+	if (err) {
+		crypto_free_sync_skcipher(tfm);
+		return err;
+	}
+	sbi->tfm = tfm;
+
+	mutex_lock(&amnesiafs_ram_mounts_lock);
+	list_add(&sbi->list, &amnesiafs_ram_mounts);
+	mutex_unlock(&amnesiafs_ram_mounts_lock);
+
+	/* revoked before it was listed, and so never discarded */
+	return key_validate(key);
+}
+
+int amnesiafs_ram_fill_super(struct super_block *sb, void *data, int silent)
+{
+	struct amnesiafs_ram_sb_info *sbi;
+	struct amnesiafs_config *config;
+	struct inode *root;
+	int err;
+
+	/* on failure, amnesiafs_ram_kill_sb() tears down what's set up */
+	sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
+	if (!sbi)
+		return -ENOMEM;
+	sbi->sb = sb;
+	INIT_LIST_HEAD(&sbi->list);
+	init_rwsem(&sbi->lock);
+	sb->s_fs_info = sbi;
+
+	config = kzalloc(sizeof(*config), GFP_KERNEL);
+	if (!config)
+		return -ENOMEM;
+
+	err = amnesiafs_parse_options((char *)data, config);
+	if (err)
+		goto out;
+
+	err = -EINVAL;
+	if (!config->key_desc) {
+		amnesiafs_err("missing key_id");
+		goto out;
+	}
+	if (config->nr_devices || config->compress || config->discard ||
+	    config->inlinecrypt) {
+		amnesiafs_err("option needs a device");
+		goto out;
+	}
+
+	err = amnesiafs_ram_key_init(sb, config);
+	if (err)
+		goto out;
+
+	/* so that dirty pages get written back into the store */
+	err = super_setup_bdi(sb);
+	if (err)
+		goto out;
+
+	sb->s_maxbytes = MAX_LFS_FILESIZE;
+	sb->s_blocksize = PAGE_SIZE;
+	sb->s_blocksize_bits = PAGE_SHIFT;
+	sb->s_magic = AMNESIAFS_MAGIC;
+	sb->s_op = &amnesiafs_ram_super_operations;
+	sb->s_time_gran = 1;
+
+	err = -ENOMEM;
+	root = amnesiafs_ram_new_inode(sb, NULL, S_IFDIR | 0755);
+	sb->s_root = d_make_root(root);
+	if (!sb->s_root)
+		goto out;
+
+	err = 0;
+out:
+	amnesiafs_free_config(config);
+	return err;
+}
+
+void amnesiafs_ram_kill_sb(struct super_block *sb)
+{
+	struct amnesiafs_ram_sb_info *sbi = AMNESIAFS_RAM_SB(sb);
+
+	if (sbi) {
+		mutex_lock(&amnesiafs_ram_mounts_lock);
+		list_del_init(&sbi->list);
+		mutex_unlock(&amnesiafs_ram_mounts_lock);
+	}
+
+	/* evicting every inode wipes its pages and frees its store */
+	kill_litter_super(sb);
+	if (!sbi)
+		return;
+
+	if (sbi->tfm)
+		crypto_free_sync_skcipher(sbi->tfm);
+	if (sbi->key) {
+		key_revoke(sbi->key);
+		key_put(sbi->key);
+	}
+	kfree(sbi);
+}
@@ -0,0 +1,15 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#ifndef AMNESIAFS_RAM_H
+#define AMNESIAFS_RAM_H
+
+#include <linux/fs.h>
+#include <linux/key.h>
+
+int amnesiafs_ram_fill_super(struct super_block *sb, void *data, int silent);
+
+void amnesiafs_ram_kill_sb(struct super_block *sb);
+
+void amnesiafs_ram_revoke(struct key *key);
+
+#endif
@@ -0,0 +1,276 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <linux/bio.h>
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+#include "amnesiafs.h"
+
+#include "config.h"
+#include "extent.h"
+#include "inode.h"
+#include "journal.h"
+#include "log.h"
+#include "reclaim.h"
+#include "super.h"
+#include "volume.h"
+
+/* the inode table block, and the extent block along with its bitmap block */
+#define AMNESIAFS_RECLAIM_CREDITS 3
+
+/*
+ * Truncating a file only cuts its size and marks the inode; the blocks past
+ * the new end are freed afterwards by a worker, so truncating a huge or
+ * badly fragmented file costs no more than a small one. The mark goes to
+ * disk along with reclaim_from, where the doomed blocks start, so after a
+ * crash they're still owned by the inode and the next mount hands them
+ * back to the worker.
+ *
+ * Until the worker is done nothing new may be mapped from reclaim_from on.
+ * Paths that might, like writes past the end of file or fallocate, call
+ * amnesiafs_reclaim_sync() under i_rwsem first to finish the job inline.
+ *
+ * With the discard mount option the worker also discards what it's about to
+ * free, in one chain of requests per inode. That happens before the blocks
+ * go back to the allocator, so it can't catch anything written there
+ * afterwards.
+ */
+
+static void amnesiafs_reclaim_work(struct work_struct *work);
+
+void amnesiafs_reclaim_init(struct super_block *sb)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+
+	spin_lock_init(&sbi->reclaim_lock);
+	INIT_LIST_HEAD(&sbi->reclaim_list);
+	INIT_WORK(&sbi->reclaim_work, amnesiafs_reclaim_work);
+}
+
+/* Put inode on the worker's list, unless it's there already. */
+static void amnesiafs_reclaim_queue(struct inode *inode)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(inode->i_sb);
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+
+	spin_lock(&sbi->reclaim_lock);
+	if (list_empty(&info->reclaim_entry)) {
+		/* dropped by the worker */
+		ihold(inode);
+		list_add_tail(&info->reclaim_entry, &sbi->reclaim_list);
+	}
+	spin_unlock(&sbi->reclaim_lock);
+
+	queue_work(system_unbound_wq, &sbi->reclaim_work);
+}
+
+/* Hand the inodes left marked by the last mount back to the worker. */
+void amnesiafs_reclaim_resume(struct super_block *sb)
+{
+	struct amnesiafs_inode *raw;
+	struct buffer_head *bh;
+	struct inode *inode;
+	uint64_t i, slot;
+
+	for (i = 0; i < AMNESIAFS_INODE_TABLE_BLOCKS; i++) {
+		bh = sb_bread(sb, AMNESIAFS_INODE_TABLE_BLOCK_NUMBER + i);
+		if (!bh) {
+			amnesiafs_err("reading inode table block %llu failed",
+				      i);
+			continue;
+		}
+
+		raw = (struct amnesiafs_inode *)bh->b_data;
+		for (slot = 0; slot < AMNESIAFS_INODES_PER_BLOCK;
+		     slot++, raw++) {
+			if (!raw->inode_no ||
+			    !(raw->flags & AMNESIAFS_INODE_RECLAIM))
+				continue;
+
+			inode = amnesiafs_iget(sb, raw->inode_no);
+			if (IS_ERR(inode)) {
+				amnesiafs_err("inode %llu: couldn't resume freeing blocks: %ld",
+					      raw->inode_no, PTR_ERR(inode));
+				continue;
+			}
+			amnesiafs_reclaim_queue(inode);
+			iput(inode);
+		}
+		brelse(bh);
+	}
+}
+
+/* Wait for the worker to get through everything queued so far. */
+void amnesiafs_reclaim_flush(struct super_block *sb)
+{
+	flush_work(&AMNESIAFS_SB(sb)->reclaim_work);
+}
+
+static int amnesiafs_reclaim_save(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	int err;
+
+	err = amnesiafs_journal_start(sb, AMNESIAFS_RECLAIM_CREDITS);
+	if (err)
+		return err;
+	err = amnesiafs_inode_save(inode);
+	amnesiafs_journal_stop(sb);
+	return err;
+}
+
+/*
+ * Leave file blocks from from on to the worker. The caller holds i_rwsem
+ * and has already cut i_size down.
+ */
+int amnesiafs_reclaim_defer(struct inode *inode, uint64_t from)
+{
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+	struct amnesiafs_extent *last;
+	bool pending, moved;
+
+	down_write(&info->extent_lock);
+	last = info->nr_extents ? &info->extents[info->nr_extents - 1] : NULL;
+	pending = info->raw.flags & AMNESIAFS_INODE_RECLAIM;
+	if (!pending && (!last || last->logical + last->len <= from)) {
+		/* nothing to free */
+		up_write(&info->extent_lock);
+		return 0;
+	}
+	moved = !pending || from < info->raw.reclaim_from;
+	if (moved)
+		info->raw.reclaim_from = from;
+	info->raw.flags |= AMNESIAFS_INODE_RECLAIM;
+	up_write(&info->extent_lock);
+
+	if (moved) {
+		int err = amnesiafs_reclaim_save(inode);
+
+		if (err)
+			return err;
+	}
+
+	amnesiafs_reclaim_queue(inode);
+	return 0;
+}
+
+/*
+ * Discard the blocks that freeing file blocks from from on will give back:
+ * those of extents that are neither shared nor only reserved, and whole
+ * compressed clusters. Runs that line up are merged.
+ */
+static void amnesiafs_reclaim_discard(struct inode *inode, uint64_t from)
+{
+	struct super_block *sb = inode->i_sb;
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+	struct amnesiafs_extent *ext;
+	struct bio *bio = NULL;
+	uint64_t start = 0, count = 0, block, len;
+	unsigned int i;
+
+	down_read(&info->extent_lock);
+	for (i = 0; i < info->nr_extents; i++) {
+		ext = &info->extents[i];
+		if (ext->logical + ext->len <= from ||
+		    (ext->flags & (AMNESIAFS_EXTENT_DELALLOC |
+				   AMNESIAFS_EXTENT_SHARED)))
+			continue;
+
+		if (ext->flags & AMNESIAFS_EXTENT_COMPRESSED) {
+			/* a cluster straddling from only loses its tail */
+			if (ext->logical < from)
+				continue;
+			block = ext->physical;
+			len = AMNESIAFS_EXTENT_STORED(ext->flags);
+		} else {
+			block = ext->physical;
+			len = ext->len;
+			if (ext->logical < from) {
+				block += from - ext->logical;
+				len -= from - ext->logical;
+			}
+		}
+
+		if (count && start + count == block) {
+			count += len;
+			continue;
+		}
+		if (count)
+			amnesiafs_volume_discard(sb, start, count, &bio);
+		start = block;
+		count = len;
+	}
+	up_read(&info->extent_lock);
+
+	if (count)
+		amnesiafs_volume_discard(sb, start, count, &bio);
+	if (bio) {
+		if (submit_bio_wait(bio))
+			amnesiafs_debug("inode %lu: discard failed",
+					inode->i_ino);
+		bio_put(bio);
+	}
+}
+
+/*
+ * Free whatever's waiting to be freed in inode right away. The caller holds
+ * i_rwsem.
+ */
+int amnesiafs_reclaim_sync(struct inode *inode)
+{
+	struct amnesiafs_inode_info *info = AMNESIAFS_I(inode);
+	uint64_t from;
+	int err;
+
+	if (!(info->raw.flags & AMNESIAFS_INODE_RECLAIM))
+		return 0;
+
+	from = info->raw.reclaim_from;
+	if (AMNESIAFS_SB(inode->i_sb)->config->discard)
+		amnesiafs_reclaim_discard(inode, from);
+
+	err = amnesiafs_extent_free_range(inode, from, U64_MAX);
+	if (err)
+		return err;
+
+	down_write(&info->extent_lock);
+	info->raw.flags &= ~AMNESIAFS_INODE_RECLAIM;
+	info->raw.reclaim_from = 0;
+	up_write(&info->extent_lock);
+
+	return amnesiafs_reclaim_save(inode);
+}
+
+static void amnesiafs_reclaim_work(struct work_struct *work)
+{
+	struct amnesiafs_sb_info *sbi =
+		container_of(work, struct amnesiafs_sb_info, reclaim_work);
+	struct amnesiafs_inode_info *info;
+	struct inode *inode;
+	int err;
+
+	for (;;) {
+		spin_lock(&sbi->reclaim_lock);
+		info = list_first_entry_or_null(&sbi->reclaim_list,
+						struct amnesiafs_inode_info,
+						reclaim_entry);
+		if (info)
+			list_del_init(&info->reclaim_entry);
+		spin_unlock(&sbi->reclaim_lock);
+		if (!info)
+			break;
+
+		inode = &info->vfs_inode;
+		inode_lock(inode);
+		err = amnesiafs_reclaim_sync(inode);
+		inode_unlock(inode);
+		if (err)
+			/* left marked, for the next mount to try again */
+			amnesiafs_err("inode %lu: freeing blocks failed: %d",
+				      inode->i_ino, err);
+		iput(inode);
+	}
+}
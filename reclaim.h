@@ -0,0 +1,18 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#ifndef AMNESIAFS_RECLAIM_H
+#define AMNESIAFS_RECLAIM_H
+
+#include <linux/fs.h>
+
+void amnesiafs_reclaim_init(struct super_block *sb);
+
+void amnesiafs_reclaim_resume(struct super_block *sb);
+
+void amnesiafs_reclaim_flush(struct super_block *sb);
+
+int amnesiafs_reclaim_defer(struct inode *inode, uint64_t from);
+
+int amnesiafs_reclaim_sync(struct inode *inode);
+
+#endif
@@ -0,0 +1,351 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/string.h>
+
+#include "amnesiafs.h"
+
+#include "alloc.h"
+#include "journal.h"
+#include "log.h"
+#include "refcount.h"
+#include "super.h"
+
+/*
+ * The refcount table is small enough to keep in memory in full, like the
+ * bitmap. Updates change the in-memory copy and then log every table block
+ * from the first changed entry onwards, since inserting shifts the rest.
+ */
+
+int amnesiafs_refcount_init(struct super_block *sb)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	struct amnesiafs_super_block *disk_sb = sbi->disk_sb;
+	struct buffer_head *bh;
+	uint64_t i;
+
+	if (disk_sb->refcount_blocks != AMNESIAFS_REFCOUNT_BLOCKS ||
+	    disk_sb->refcount_count > AMNESIAFS_MAX_REFCOUNTS) {
+		amnesiafs_err("bad refcount table: %llu entries in %llu blocks",
+			      disk_sb->refcount_count,
+			      disk_sb->refcount_blocks);
+		return -EINVAL;
+	}
+
+	sbi->refcounts = kvmalloc(AMNESIAFS_REFCOUNT_BLOCKS *
+					  AMNESIAFS_BLOCKSIZE,
+				  GFP_KERNEL);
+	if (!sbi->refcounts)
+		return -ENOMEM;
+
+	for (i = 0; i < DIV_ROUND_UP(disk_sb->refcount_count,
+				     AMNESIAFS_REFCOUNTS_PER_BLOCK);
+	     i++) {
+		bh = sb_bread(sb, disk_sb->refcount_block + i);
+		if (!bh) {
+			amnesiafs_err("reading refcount block %llu failed", i);
+			amnesiafs_refcount_destroy(sb);
+			return -EIO;
+		}
+		memcpy((char *)sbi->refcounts + i * AMNESIAFS_BLOCKSIZE,
+		       bh->b_data, AMNESIAFS_BLOCKSIZE);
+		brelse(bh);
+	}
+
+	return 0;
+}
+
+void amnesiafs_refcount_destroy(struct super_block *sb)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+
+	kvfree(sbi->refcounts);
+	sbi->refcounts = NULL;
+}
+
+/* the index of the last entry starting at or before block, or -1 */
+static int amnesiafs_refcount_find(struct amnesiafs_sb_info *sbi,
+				   uint64_t block)
+{
+	int lo = 0, hi = (int)sbi->disk_sb->refcount_count - 1, found = -1;
+
+	while (lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (sbi->refcounts[mid].start <= block) {
+			found = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	return found;
+}
+
+static bool amnesiafs_refcount_contains(const struct amnesiafs_refcount *ref,
+					uint64_t block)
+{
+	return block >= ref->start && block - ref->start < ref->len;
+}
+
+static void amnesiafs_refcount_insert_at(struct amnesiafs_sb_info *sbi, int i,
+					 uint64_t start, uint32_t len,
+					 uint32_t count)
+{
+	struct amnesiafs_refcount *refcounts = sbi->refcounts;
+
+	memmove(&refcounts[i + 1], &refcounts[i],
+		(sbi->disk_sb->refcount_count - i) * sizeof(*refcounts));
+	refcounts[i].start = start;
+	refcounts[i].len = len;
+	refcounts[i].count = count;
+	sbi->disk_sb->refcount_count++;
+}
+
+static void amnesiafs_refcount_delete_at(struct amnesiafs_sb_info *sbi, int i)
+{
+	struct amnesiafs_refcount *refcounts = sbi->refcounts;
+
+	memmove(&refcounts[i], &refcounts[i + 1],
+		(sbi->disk_sb->refcount_count - i - 1) * sizeof(*refcounts));
+	sbi->disk_sb->refcount_count--;
+}
+
+/*
+ * Make sure no entry straddles block, so that a range starting or ending
+ * there covers whole entries.
+ */
+static int amnesiafs_refcount_split(struct amnesiafs_sb_info *sbi,
+				    uint64_t block)
+{
+	struct amnesiafs_refcount *ref;
+	int i = amnesiafs_refcount_find(sbi, block);
+
+	if (i < 0 || !amnesiafs_refcount_contains(&sbi->refcounts[i], block) ||
+	    sbi->refcounts[i].start == block)
+		return 0;
+
+	if (sbi->disk_sb->refcount_count >= AMNESIAFS_MAX_REFCOUNTS)
+		return -ENOSPC;
+
+	ref = &sbi->refcounts[i];
+	amnesiafs_refcount_insert_at(sbi, i + 1, block,
+				     ref->len - (block - ref->start),
+				     ref->count);
+	ref->len = block - ref->start;
+
+	return 0;
+}
+
+/* the index of the first entry starting at or after block */
+static int amnesiafs_refcount_lower_bound(struct amnesiafs_sb_info *sbi,
+					  uint64_t block)
+{
+	int i = amnesiafs_refcount_find(sbi, block);
+
+	if (i < 0 || sbi->refcounts[i].start < block)
+		i++;
+	return i;
+}
+
+/* where the hole in the table starting at pos ends, no later than end */
+static uint64_t amnesiafs_refcount_gap_end(struct amnesiafs_sb_info *sbi,
+					   int i, uint64_t end)
+{
+	if (i < (int)sbi->disk_sb->refcount_count)
+		return min(end, sbi->refcounts[i].start);
+	return end;
+}
+
+/* Fold together neighbouring entries in [first, last] that line up. */
+static void amnesiafs_refcount_merge(struct amnesiafs_sb_info *sbi, int first,
+				     int last)
+{
+	struct amnesiafs_refcount *refcounts = sbi->refcounts;
+	int i = max(first, 1);
+
+	while (i <= last && i < (int)sbi->disk_sb->refcount_count) {
+		struct amnesiafs_refcount *prev = &refcounts[i - 1];
+
+		if (prev->start + prev->len == refcounts[i].start &&
+		    prev->count == refcounts[i].count &&
+		    (uint64_t)prev->len + refcounts[i].len <= U32_MAX) {
+			prev->len += refcounts[i].len;
+			amnesiafs_refcount_delete_at(sbi, i);
+			last--;
+		} else {
+			i++;
+		}
+	}
+}
+
+/*
+ * Log the table blocks holding entries [first, end), along with the super
+ * block for the entry count.
+ */
+static void amnesiafs_refcount_sync(struct super_block *sb, uint64_t first,
+				    uint64_t end)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	struct buffer_head *bh;
+	uint64_t i;
+
+	for (i = first / AMNESIAFS_REFCOUNTS_PER_BLOCK;
+	     i < DIV_ROUND_UP(end, AMNESIAFS_REFCOUNTS_PER_BLOCK); i++) {
+		/* the whole block is rewritten, no need to read it */
+		bh = sb_getblk(sb, sbi->disk_sb->refcount_block + i);
+		if (!bh) {
+			amnesiafs_err("couldn't update refcount block %llu", i);
+			continue;
+		}
+
+		lock_buffer(bh);
+		memcpy(bh->b_data, (char *)sbi->refcounts + i * AMNESIAFS_BLOCKSIZE,
+		       AMNESIAFS_BLOCKSIZE);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+
+		amnesiafs_journal_dirty(sb, bh);
+		brelse(bh);
+	}
+
+	amnesiafs_sync_super(sb);
+}
+
+/*
+ * Take another reference to blocks [start, start + len), for a reflink. The
+ * caller holds a journal handle with AMNESIAFS_REFCOUNT_CREDITS to spare.
+ */
+int amnesiafs_refcount_get(struct super_block *sb, uint64_t start,
+			   unsigned int len)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	struct amnesiafs_refcount *refcounts = sbi->refcounts;
+	uint64_t *nr = &sbi->disk_sb->refcount_count;
+	uint64_t end = start + len, pos, gap_end, old_nr;
+	unsigned int gaps = 0;
+	int i, first, err;
+
+	mutex_lock(&sbi->refcount_mutex);
+
+	old_nr = *nr;
+	first = max(amnesiafs_refcount_find(sbi, start), 0);
+
+	err = amnesiafs_refcount_split(sbi, start);
+	if (!err)
+		err = amnesiafs_refcount_split(sbi, end);
+	if (err)
+		goto out_sync;
+
+	/* count the new entries first, so as not to stop half way */
+	i = amnesiafs_refcount_lower_bound(sbi, start);
+	for (pos = start; pos < end;) {
+		if (i < (int)*nr && refcounts[i].start == pos) {
+			pos += refcounts[i++].len;
+		} else {
+			pos = amnesiafs_refcount_gap_end(sbi, i, end);
+			gaps++;
+		}
+	}
+	if (*nr + gaps > AMNESIAFS_MAX_REFCOUNTS) {
+		err = -ENOSPC;
+		goto out_sync;
+	}
+
+	/* blocks without an entry had one reference, and now have two */
+	i = amnesiafs_refcount_lower_bound(sbi, start);
+	for (pos = start; pos < end;) {
+		if (i < (int)*nr && refcounts[i].start == pos) {
+			refcounts[i].count++;
+			pos += refcounts[i++].len;
+		} else {
+			gap_end = amnesiafs_refcount_gap_end(sbi, i, end);
+			amnesiafs_refcount_insert_at(sbi, i++, pos, gap_end - pos,
+						     2);
+			pos = gap_end;
+		}
+	}
+	amnesiafs_refcount_merge(sbi, first, i);
+
+out_sync:
+	amnesiafs_refcount_sync(sb, first, max(old_nr, *nr));
+	mutex_unlock(&sbi->refcount_mutex);
+	return err;
+}
+
+/*
+ * Drop a reference to blocks [start, start + len), freeing those that had
+ * no other. The caller holds a journal handle with AMNESIAFS_REFCOUNT_CREDITS
+ * to spare, plus the bitmap blocks covering the range.
+ */
+void amnesiafs_refcount_put(struct super_block *sb, uint64_t start,
+			    unsigned int len)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	struct amnesiafs_refcount *refcounts = sbi->refcounts;
+	uint64_t *nr = &sbi->disk_sb->refcount_count;
+	uint64_t end = start + len, pos, gap_end, old_nr;
+	int i, first;
+
+	if (!READ_ONCE(*nr)) {
+		amnesiafs_free_blocks(sb, start, len);
+		return;
+	}
+
+	mutex_lock(&sbi->refcount_mutex);
+
+	old_nr = *nr;
+	first = max(amnesiafs_refcount_find(sbi, start), 0);
+
+	if (amnesiafs_refcount_split(sbi, start) ||
+	    amnesiafs_refcount_split(sbi, end)) {
+		/* leaving them allocated is the only safe thing left to do */
+		amnesiafs_err("refcount table full, leaking blocks %llu-%llu",
+			      start, end - 1);
+		goto out_sync;
+	}
+
+	i = amnesiafs_refcount_lower_bound(sbi, start);
+	for (pos = start; pos < end;) {
+		if (i < (int)*nr && refcounts[i].start == pos) {
+			pos += refcounts[i].len;
+			if (--refcounts[i].count == 1)
+				amnesiafs_refcount_delete_at(sbi, i);
+			else
+				i++;
+		} else {
+			gap_end = amnesiafs_refcount_gap_end(sbi, i, end);
+			amnesiafs_free_blocks(sb, pos, gap_end - pos);
+			pos = gap_end;
+		}
+	}
+	amnesiafs_refcount_merge(sbi, first, i);
+
+out_sync:
+	amnesiafs_refcount_sync(sb, first, max(old_nr, *nr));
+	mutex_unlock(&sbi->refcount_mutex);
+}
+
+/* Does block have more than one owner? */
+bool amnesiafs_refcount_shared(struct super_block *sb, uint64_t block)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	bool shared;
+	int i;
+
+	if (!READ_ONCE(sbi->disk_sb->refcount_count))
+		return false;
+
+	mutex_lock(&sbi->refcount_mutex);
+	i = amnesiafs_refcount_find(sbi, block);
+	shared = i >= 0 &&
+		 amnesiafs_refcount_contains(&sbi->refcounts[i], block);
+	mutex_unlock(&sbi->refcount_mutex);
+
+	return shared;
+}
@@ -0,0 +1,25 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#ifndef AMNESIAFS_REFCOUNT_H
+#define AMNESIAFS_REFCOUNT_H
+
+#include <linux/fs.h>
+
+#include "amnesiafs.h"
+
+/* the most blocks one refcount table update logs, besides freed blocks */
+#define AMNESIAFS_REFCOUNT_CREDITS AMNESIAFS_REFCOUNT_BLOCKS
+
+int amnesiafs_refcount_init(struct super_block *sb);
+
+void amnesiafs_refcount_destroy(struct super_block *sb);
+
+int amnesiafs_refcount_get(struct super_block *sb, uint64_t start,
+			   unsigned int len);
+
+void amnesiafs_refcount_put(struct super_block *sb, uint64_t start,
+			    unsigned int len);
+
+bool amnesiafs_refcount_shared(struct super_block *sb, uint64_t block);
+
+#endif
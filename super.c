@@ -3,32 +3,89 @@
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/init.h>
+#include <linux/kdev_t.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/stat.h>
+#include <linux/statfs.h>
 
 #include "amnesiafs.h"
+#include "alloc.h"
+#include "compress.h"
 #include "config.h"
+#include "crypt.h"
+#include "csum.h"
 #include "dir.h"
+#include "file.h"
 #include "inode.h"
+#include "journal.h"
 #include "keys.h"
 #include "log.h"
+#include "names.h"
+#include "prealloc.h"
+#include "reclaim.h"
+#include "refcount.h"
+#include "super.h"
+#include "volume.h"
 
 struct amnesiafs_super_block *amnesiafs_get_super(struct super_block *sb)
 {
-	return sb->s_fs_info;
+	return AMNESIAFS_SB(sb)->disk_sb;
 }
 
 static void amnesiafs_put_super(struct super_block *sb)
 {
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+
+	/* sync_fs has already emptied it, this is just to be safe */
+	amnesiafs_reclaim_flush(sb);
+	amnesiafs_io_destroy(sb);
+	amnesiafs_journal_destroy(sb);
+	amnesiafs_names_destroy(sb);
+	amnesiafs_crypt_destroy(sb);
+	amnesiafs_compress_destroy(sb);
+	amnesiafs_refcount_destroy(sb);
+	amnesiafs_alloc_destroy(sb);
+	amnesiafs_volume_destroy(sb);
+	brelse(sbi->sbh);
+	amnesiafs_free_config(sbi->config);
+	kfree(sbi);
+	sb->s_fs_info = NULL;
+
 	amnesiafs_debug("amnesiafs super block destroyed");
 }
 
+/* Answered from the in-memory counters alone, without any I/O or locks. */
+static int amnesiafs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+	struct super_block *sb = dentry->d_sb;
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	uint64_t free = percpu_counter_read_positive(&sbi->free_blocks);
+	uint64_t reserved = READ_ONCE(sbi->reserved_blocks);
+
+	buf->f_type = AMNESIAFS_MAGIC;
+	buf->f_bsize = AMNESIAFS_BLOCKSIZE;
+	buf->f_blocks = sbi->disk_sb->blocks_count;
+	/* delayed allocations have already spoken for their blocks */
+	buf->f_bfree = free - min(free, reserved);
+	buf->f_bavail = buf->f_bfree;
+	buf->f_files = AMNESIAFS_MAX_INODES;
+	buf->f_ffree = percpu_counter_read_positive(&sbi->free_inodes);
+	buf->f_namelen = amnesiafs_name_max(sb);
+	buf->f_fsid = u64_to_fsid(huge_encode_dev(sb->s_bdev->bd_dev));
+
+	return 0;
+}
+
 const struct super_operations amnesiafs_super_operations = {
 	.put_super = amnesiafs_put_super,
-	.statfs = simple_statfs,
-	.destroy_inode = amnesiafs_destroy_inode,
+	.sync_fs = amnesiafs_sync_fs,
+	.statfs = amnesiafs_statfs,
+	.write_inode = amnesiafs_write_inode,
+	.alloc_inode = amnesiafs_alloc_inode,
+	.free_inode = amnesiafs_free_inode,
+	.evict_inode = amnesiafs_evict_inode,
 };
 
 int amnesiafs_fill_super(struct super_block *sb, void *data, int silent)
@@ -37,6 +94,7 @@ int amnesiafs_fill_super(struct super_block *sb, void *data, int silent)
 	struct inode *root = NULL;
 	struct buffer_head *bh = NULL;
 	struct amnesiafs_super_block *sb_disk;
+	struct amnesiafs_sb_info *sbi;
 
 	struct amnesiafs_config *config =
 		kzalloc(sizeof(struct amnesiafs_config), GFP_KERNEL);
@@ -53,21 +111,49 @@ int amnesiafs_fill_super(struct super_block *sb, void *data, int silent)
 		goto out_err;
 	}
 
-	err = amnesiafs_get_passphrase(&config->passphrase, config->key_desc);
+	err = amnesiafs_get_passphrase(&config->passphrase,
+				       &config->passphrase_len,
+				       config->key_desc);
 	if (err)
-		goto out_key_err;
+		goto out_err;
+
+	err = -ENOMEM;
+	sbi = kzalloc(sizeof(struct amnesiafs_sb_info), GFP_KERNEL);
+	if (!sbi)
+		goto out_err;
+
+	spin_lock_init(&sbi->inode_lock);
+	spin_lock_init(&sbi->bitmap_lock);
+	mutex_init(&sbi->refcount_mutex);
+	sbi->config = config;
+
+	err = -EINVAL;
+	if (!sb_set_blocksize(sb, AMNESIAFS_BLOCKSIZE)) {
+		amnesiafs_err("device doesn't support %d byte blocks",
+			      AMNESIAFS_BLOCKSIZE);
+		goto out_sbi_err;
+	}
 
 	/* read the block at 0 */
-	bh = sb_bread(sb, 0);
-	BUG_ON(!bh);
+	err = -EIO;
+	bh = sb_bread(sb, AMNESIAFS_SUPER_BLOCK_NUMBER);
+	if (!bh)
+		goto out_sbi_err;
 
 	sb_disk = (struct amnesiafs_super_block *)bh->b_data;
 
 	/* make sure the magic number is what we're expecting */
+	err = -EINVAL;
 	if (sb_disk->magic != AMNESIAFS_MAGIC) {
 		amnesiafs_info("magic mismatch: wanted 0x%x, read 0x%llx",
 			       AMNESIAFS_MAGIC, sb_disk->magic);
-		return -EINVAL;
+		goto out_bh_err;
+	}
+
+	if (!amnesiafs_super_verify(sb_disk)) {
+		amnesiafs_err("super block checksum mismatch");
+		err = -EBADMSG;
+		goto out_bh_err;
 	}
 
 	amnesiafs_debug(
@@ -75,57 +161,117 @@ int amnesiafs_fill_super(struct super_block *sb, void *data, int silent)
 		sb_disk->version, sb_disk->inodes_count,
 		sb_disk->blocks_available);
 
-	sb->s_blocksize = AMNESIAFS_BLOCKSIZE;
-	/* number of bits the blocksize requires, I think ??? */
-	sb->s_blocksize_bits = PAGE_SHIFT;
+	sbi->sbh = bh;
+	sbi->disk_sb = sb_disk;
+
 	sb->s_magic = AMNESIAFS_MAGIC;
-	sb->s_fs_info = sb_disk;
+	sb->s_fs_info = sbi;
 	sb->s_op = &amnesiafs_super_operations;
 	sb->s_time_gran = 1;
+	sb->s_maxbytes = (loff_t)AMNESIAFS_BLOCKSIZE * U32_MAX;
+	amnesiafs_reclaim_init(sb);
+	amnesiafs_prealloc_init(sb);
 
-	root = new_inode(sb);
-	if (!root) {
-		amnesiafs_err("inode allocation failed\n");
-		return -ENOMEM;
-	}
+	err = amnesiafs_compress_init(sb);
+	if (err)
+		goto out_bh_err;
 
-	root->i_ino = 1;
-	root->i_sb = sb;
-	root->i_op = &amnesiafs_inode_operations;
-	root->i_fop = &amnesiafs_dir_operations;
-	root->i_atime = root->i_mtime = root->i_ctime = current_time(root);
-	inode_init_owner(root, NULL, S_IFDIR);
+	err = amnesiafs_io_init(sb);
+	if (err)
+		goto out_compress_err;
 
-	root->i_private = amnesiafs_get_inode(sb, 1);
+	err = amnesiafs_volume_init(sb);
+	if (err)
+		goto out_io_err;
+
+	err = amnesiafs_journal_replay(sb);
+	if (err)
+		goto out_volume_err;
+
+	err = amnesiafs_alloc_init(sb);
+	if (err)
+		goto out_volume_err;
+
+	err = amnesiafs_refcount_init(sb);
+	if (err)
+		goto out_alloc_err;
+
+	err = amnesiafs_journal_init(sb);
+	if (err)
+		goto out_refcount_err;
+
+	err = amnesiafs_crypt_init(sb);
+	if (err)
+		goto out_journal_err;
+
+	err = amnesiafs_names_init(sb);
+	if (err)
+		goto out_crypt_err;
+
+	/* every key has been derived from it by now */
+	kfree_sensitive(config->passphrase);
+	config->passphrase = NULL;
+	config->passphrase_len = 0;
+
+	root = amnesiafs_iget(sb, AMNESIAFS_ROOT_INODE_NUMBER);
+	if (IS_ERR(root)) {
+		amnesiafs_err("root inode lookup failed\n");
+		err = PTR_ERR(root);
+		goto out_names_err;
+	}
 
 	sb->s_root = d_make_root(root);
 	if (!sb->s_root) {
 		amnesiafs_err("root creation failed\n");
-		return -ENOMEM;
+		err = -ENOMEM;
+		goto out_names_err;
 	}
 
+	amnesiafs_reclaim_resume(sb);
+
 	return 0;
 
-out_key_err:
-	if (config->passphrase)
-		kfree(config->passphrase);
+out_names_err:
+	amnesiafs_names_destroy(sb);
+out_crypt_err:
+	amnesiafs_crypt_destroy(sb);
+out_journal_err:
+	amnesiafs_journal_destroy(sb);
+out_refcount_err:
+	amnesiafs_refcount_destroy(sb);
+out_alloc_err:
+	amnesiafs_alloc_destroy(sb);
+out_volume_err:
+	amnesiafs_volume_destroy(sb);
+out_io_err:
+	amnesiafs_io_destroy(sb);
+out_compress_err:
+	amnesiafs_compress_destroy(sb);
+out_bh_err:
+	sb->s_fs_info = NULL;
+	brelse(bh);
+out_sbi_err:
+	kfree(sbi);
 out_err:
-	if (config->key_desc)
-		kfree(config->key_desc);
-	kfree(config);
+	amnesiafs_free_config(config);
 	return err;
 }
 
+/*
+ * Log the super block in the running transaction. It's updated in place in
+ * sbh, so there's nothing to copy. The caller must hold a journal handle.
+ */
 void amnesiafs_sync_super(struct super_block *vsb)
 {
-	struct buffer_head *bh = NULL;
-	struct amnesiafs_super_block *sb = amnesiafs_get_super(vsb);
+	amnesiafs_journal_dirty(vsb, AMNESIAFS_SB(vsb)->sbh);
+}
 
-	bh = sb_bread(vsb, 4);
-	BUG_ON(!bh);
+int amnesiafs_sync_fs(struct super_block *sb, int wait)
+{
+	if (!wait)
+		return 0;
 
-	bh->b_data = (char *)sb;
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
-	brelse(bh);
-}
\ No newline at end of file
+	/* this also lets go of the inodes the worker holds before umount */
+	amnesiafs_reclaim_flush(sb);
+	return amnesiafs_journal_force(sb);
+}
@@ -3,9 +3,132 @@
 #ifndef AMNESIAFS_SUPER_H
 #define AMNESIAFS_SUPER_H
 
+#include <linux/bio.h>
 #include <linux/fs.h>
+#include <linux/mutex.h>
+#include <linux/percpu_counter.h>
+#include <linux/shrinker.h>
+#include <linux/siphash.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 
 #include "amnesiafs.h"
+#include "config.h"
+
+struct amnesiafs_compress_pool;
+struct amnesiafs_group;
+struct blk_crypto_key;
+struct amnesiafs_journal;
+struct crypto_sync_skcipher;
+
+/*
+ * Locking:
+ *
+ * - directory contents are protected by the directory's i_rwsem, which the
+ *   VFS takes shared for lookup and readdir and exclusive for create and
+ *   mkdir
+ * - each inode table block is protected by its buffer lock while a slot in
+ *   it is being written
+ * - inode numbers and data blocks come from the allocators in alloc.c,
+ *   which only take a spinlock around the in-memory bookkeeping and never
+ *   hold it across I/O; bitmap_lock, busy_lock and the block group locks
+ *   never nest
+ * - the refcount table is protected by refcount_mutex, which nests inside
+ *   extent_lock and outside bitmap_lock and the block group locks
+ * - metadata buffers are only modified inside a journal handle, see
+ *   journal.c
+ */
+struct amnesiafs_sb_info {
+	/* on-disk super block, lives in sbh->b_data */
+	struct amnesiafs_super_block *disk_sb;
+	struct buffer_head *sbh;
+
+	/* the volume's devices, in device table order, see volume.c */
+	struct block_device *devices[AMNESIAFS_MAX_DEVICES];
+	unsigned int nr_devices;
+
+	struct amnesiafs_config *config;
+
+	/* the file data key with inlinecrypt, NULL otherwise, see crypt.c */
+	struct blk_crypto_key *crypt_key;
+
+	struct amnesiafs_journal *journal;
+
+	/* protects disk_sb->inodes_count and inode_bitmap */
+	spinlock_t inode_lock;
+	unsigned long *inode_bitmap;
+
+	/*
+	 * The block groups, each with a lock of its own for its part of
+	 * bitmap, see alloc.c
+	 */
+	struct amnesiafs_group *groups;
+	unsigned int nr_groups;
+	unsigned int inodes_per_group;
+	unsigned long *bitmap;
+	/* where allocations without a goal carry on from */
+	uint64_t alloc_cursor;
+
+	/* protects reserved_blocks and free_blocks */
+	spinlock_t bitmap_lock;
+	/* blocks promised to delayed allocations, see extent.c */
+	uint64_t reserved_blocks;
+
+	/*
+	 * Runs freed by transactions that haven't committed yet, oldest
+	 * first, and how many blocks they hold: they stay set in bitmap until
+	 * then, see alloc.c
+	 */
+	spinlock_t busy_lock;
+	struct list_head busy;
+	uint64_t busy_blocks;
+
+	/*
+	 * Live free counts, so statfs never takes a lock. free_blocks goes
+	 * into disk_sb->blocks_available at commit; free inodes follow from
+	 * disk_sb->inodes_count, which stays exact under inode_lock.
+	 */
+	struct percpu_counter free_blocks;
+	struct percpu_counter free_inodes;
+
+	/*
+	 * protects refcounts and disk_sb->refcount_count, the number of
+	 * entries in it
+	 */
+	struct mutex refcount_mutex;
+	struct amnesiafs_refcount *refcounts;
+
+	/* inodes with blocks waiting to be freed, see reclaim.c */
+	spinlock_t reclaim_lock;
+	struct list_head reclaim_list;
+	struct work_struct reclaim_work;
+
+	/* written bios whose unwritten blocks need converting, see file.c */
+	spinlock_t convert_lock;
+	struct bio_list convert_bios;
+	struct work_struct convert_work;
+	struct workqueue_struct *convert_wq;
+
+	/* files holding blocks taken ahead of appends, see prealloc.c */
+	spinlock_t prealloc_lock;
+	struct list_head prealloc_list;
+
+	/*
+	 * a pool of compression transforms for each algorithm, loaded as
+	 * needed and given back under memory pressure, see compress.c
+	 */
+	struct amnesiafs_compress_pool *compress_pools;
+	struct shrinker compress_shrinker;
+
+	/* for encrypted names, see names.c */
+	struct crypto_sync_skcipher *names_tfm;
+	siphash_key_t names_hash_key;
+};
+
+static inline struct amnesiafs_sb_info *AMNESIAFS_SB(struct super_block *sb)
+{
+	return sb->s_fs_info;
+}
 
 extern const struct super_operations amnesiafs_super_operations;
 
@@ -13,6 +136,8 @@ int amnesiafs_fill_super(struct super_block *sb, void *data, int silent);
 
 void amnesiafs_sync_super(struct super_block *vsb);
 
+int amnesiafs_sync_fs(struct super_block *sb, int wait);
+
 struct amnesiafs_super_block *amnesiafs_get_super(struct super_block *sb);
 
 #endif
@@ -0,0 +1,706 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * KUnit tests for the parts of amnesiafs that don't need a device: option
+ * parsing, directory records, the inode table layout, checksums and the
+ * block and inode allocators. They build into a module of their own, with
+ * `make kunit`, and run when it's loaded; tests/run-kunit.sh does that in a
+ * virtual machine.
+ *
+ * The code under test is included here rather than linked, so that its
+ * static helpers can be reached, and the journal is stubbed out. Only the
+ * allocator paths that stay in memory are covered, since logging bitmap
+ * blocks needs a real buffer cache.
+ *
+ * The benchmarks time the hot helpers and fail when their cost stops being
+ * independent of what they have to skip, which is what a linear scan
+ * creeping back in looks like.
+ */
+
+#include <kunit/test.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+
+#include "../alloc.c"
+#include "../config.c"
+#include "../csum.c"
+#include "../log.c"
+
+#include "../dir.h"
+#include "../inode.h"
+
+void amnesiafs_journal_dirty(struct super_block *sb, struct buffer_head *bh)
+{
+}
+
+int amnesiafs_journal_force(struct super_block *sb)
+{
+	return 0;
+}
+
+uint64_t amnesiafs_journal_tid(struct super_block *sb)
+{
+	return 0;
+}
+
+void amnesiafs_sync_super(struct super_block *sb)
+{
+}
+
+/* a super block with nr_groups empty block groups and no inodes in use */
+struct amnesiafs_test_volume {
+	struct super_block sb;
+	struct amnesiafs_sb_info sbi;
+	struct amnesiafs_super_block disk_sb;
+};
+
+static int amnesiafs_test_volume_init(struct kunit *test,
+				      unsigned int nr_groups)
+{
+	struct amnesiafs_test_volume *vol;
+	struct amnesiafs_sb_info *sbi;
+	uint64_t start, end;
+	unsigned int g;
+
+	vol = kunit_kzalloc(test, sizeof(*vol), GFP_KERNEL);
+	if (!vol)
+		return -ENOMEM;
+	test->priv = vol;
+
+	sbi = &vol->sbi;
+	vol->sb.s_fs_info = sbi;
+	sbi->disk_sb = &vol->disk_sb;
+	vol->disk_sb.features = AMNESIAFS_FEATURE_CSUM;
+	vol->disk_sb.blocks_count = (uint64_t)nr_groups * AMNESIAFS_GROUP_BLOCKS;
+	vol->disk_sb.bitmap_blocks = nr_groups;
+	spin_lock_init(&sbi->inode_lock);
+	spin_lock_init(&sbi->bitmap_lock);
+	spin_lock_init(&sbi->busy_lock);
+	INIT_LIST_HEAD(&sbi->busy);
+
+	/* as amnesiafs_groups_init() would find it */
+	sbi->nr_groups = nr_groups;
+	sbi->inodes_per_group =
+		max_t(uint64_t, AMNESIAFS_INODES_PER_BLOCK,
+		      rounddown(AMNESIAFS_MAX_INODES / nr_groups,
+				AMNESIAFS_INODES_PER_BLOCK));
+	sbi->bitmap = kvzalloc(nr_groups * AMNESIAFS_BLOCKSIZE, GFP_KERNEL);
+	sbi->groups = kvcalloc(nr_groups, sizeof(*sbi->groups), GFP_KERNEL);
+	sbi->inode_bitmap = bitmap_zalloc(AMNESIAFS_MAX_INODES, GFP_KERNEL);
+	if (!sbi->bitmap || !sbi->groups || !sbi->inode_bitmap)
+		goto out_free;
+
+	for (g = 0; g < nr_groups; g++) {
+		spin_lock_init(&sbi->groups[g].lock);
+		INIT_LIST_HEAD(&sbi->groups[g].busy);
+		sbi->groups[g].free_blocks = AMNESIAFS_GROUP_BLOCKS;
+		amnesiafs_group_inodes(sbi, g, &start, &end);
+		sbi->groups[g].free_inodes = end - start;
+	}
+
+	if (percpu_counter_init(&sbi->free_blocks, vol->disk_sb.blocks_count,
+				GFP_KERNEL))
+		goto out_free;
+	if (percpu_counter_init(&sbi->free_inodes, AMNESIAFS_MAX_INODES,
+				GFP_KERNEL)) {
+		percpu_counter_destroy(&sbi->free_blocks);
+		goto out_free;
+	}
+
+	return 0;
+
+out_free:
+	bitmap_free(sbi->inode_bitmap);
+	kvfree(sbi->groups);
+	kvfree(sbi->bitmap);
+	test->priv = NULL;
+	return -ENOMEM;
+}
+
+static int amnesiafs_test_init(struct kunit *test)
+{
+	return amnesiafs_test_volume_init(test, 4);
+}
+
+static void amnesiafs_test_exit(struct kunit *test)
+{
+	struct amnesiafs_test_volume *vol = test->priv;
+
+	if (vol)
+		amnesiafs_alloc_destroy(&vol->sb);
+}
+
+static struct amnesiafs_sb_info *amnesiafs_test_sbi(struct kunit *test)
+{
+	return &((struct amnesiafs_test_volume *)test->priv)->sbi;
+}
+
+/* a buffer of one zeroed block, for the checksum code to work on */
+static struct buffer_head *amnesiafs_test_bh(struct kunit *test,
+					     sector_t blocknr)
+{
+	struct buffer_head *bh = kunit_kzalloc(test, sizeof(*bh), GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, bh);
+	bh->b_data = kunit_kzalloc(test, AMNESIAFS_BLOCKSIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, bh->b_data);
+	bh->b_size = AMNESIAFS_BLOCKSIZE;
+	bh->b_blocknr = blocknr;
+
+	return bh;
+}
+
+/* How long op takes, in nanoseconds, averaged over n runs. */
+#define amnesiafs_bench(n, op)                                                 \
+	({                                                                     \
+		u64 __start = ktime_get_ns();                                  \
+		unsigned int __i;                                              \
+                                                                               \
+		for (__i = 0; __i < (n); __i++)                                \
+			op;                                                    \
+		div_u64(ktime_get_ns() - __start, (n));                        \
+	})
+
+/* config.c */
+
+static struct amnesiafs_config *amnesiafs_test_parse(struct kunit *test,
+						     const char *options,
+						     int *err)
+{
+	struct amnesiafs_config *config;
+	char *copy;
+
+	config = kzalloc(sizeof(*config), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, config);
+	copy = kunit_kzalloc(test, strlen(options) + 1, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, copy);
+	strcpy(copy, options);
+
+	*err = amnesiafs_parse_options(copy, config);
+	return config;
+}
+
+static void amnesiafs_test_options(struct kunit *test)
+{
+	struct amnesiafs_config *config;
+	int err;
+
+	config = amnesiafs_test_parse(
+		test,
+		"key_name=k,compress=zstd,device=/dev/a,,device=/dev/b,discard,inlinecrypt",
+		&err);
+	KUNIT_EXPECT_EQ(test, err, 0);
+	KUNIT_EXPECT_STREQ(test, config->key_desc, "k");
+	KUNIT_EXPECT_EQ(test, config->compress,
+			(unsigned int)AMNESIAFS_COMPRESS_ZSTD);
+	KUNIT_EXPECT_EQ(test, config->nr_devices, 2U);
+	KUNIT_EXPECT_STREQ(test, config->devices[1], "/dev/b");
+	KUNIT_EXPECT_TRUE(test, config->discard);
+	KUNIT_EXPECT_TRUE(test, config->inlinecrypt);
+	amnesiafs_free_config(config);
+
+	config = amnesiafs_test_parse(test, "compress=lz4,compress=none", &err);
+	KUNIT_EXPECT_EQ(test, err, 0);
+	KUNIT_EXPECT_EQ(test, config->compress,
+			(unsigned int)AMNESIAFS_COMPRESS_NONE);
+	KUNIT_EXPECT_FALSE(test, config->discard);
+	amnesiafs_free_config(config);
+}
+
+static void amnesiafs_test_bad_options(struct kunit *test)
+{
+	static const char *const bad[] = {
+		"toot=42",
+		"compress=gzip",
+		"discard=1",
+		"key_name",
+	};
+	struct amnesiafs_config *config;
+	char devices[AMNESIAFS_MAX_DEVICES * 12] = "";
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < ARRAY_SIZE(bad); i++) {
+		config = amnesiafs_test_parse(test, bad[i], &err);
+		KUNIT_EXPECT_EQ_MSG(test, err, -EINVAL, "options \"%s\"",
+				    bad[i]);
+		amnesiafs_free_config(config);
+	}
+
+	/* one more than the volume's other devices can be */
+	for (i = 0; i < AMNESIAFS_MAX_DEVICES; i++)
+		strcat(devices, i ? ",device=d" : "device=d");
+	config = amnesiafs_test_parse(test, devices, &err);
+	KUNIT_EXPECT_EQ(test, err, -EINVAL);
+	amnesiafs_free_config(config);
+}
+
+static struct kunit_case amnesiafs_config_cases[] = {
+	KUNIT_CASE(amnesiafs_test_options),
+	KUNIT_CASE(amnesiafs_test_bad_options),
+	{}
+};
+
+static struct kunit_suite amnesiafs_config_suite = {
+	.name = "amnesiafs_config",
+	.test_cases = amnesiafs_config_cases,
+};
+
+/* directory records and their checksums */
+
+static void amnesiafs_test_dir_records(struct kunit *test,
+				       struct amnesiafs_dir_record *records,
+				       unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		snprintf(records[i].filename, AMNESIAFS_FILENAME_MAX,
+			 "file-%u", i);
+		records[i].inode_no = i + 2;
+	}
+}
+
+static void amnesiafs_test_dir_find(struct kunit *test)
+{
+	struct amnesiafs_dir_record *records;
+	unsigned int n = AMNESIAFS_DIR_RECORDS_PER_BLOCK;
+
+	records = kunit_kzalloc(test, n * sizeof(*records), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, records);
+	amnesiafs_test_dir_records(test, records, n);
+
+	KUNIT_EXPECT_EQ(test, amnesiafs_dir_find(records, n, "file-0", 6), 0);
+	KUNIT_EXPECT_EQ(test, amnesiafs_dir_find(records, n, "file-14", 7),
+			14);
+	/* only the first count records are in use */
+	KUNIT_EXPECT_EQ(test, amnesiafs_dir_find(records, 14, "file-14", 7),
+			-1);
+	/* prefixes and extensions of a name don't match it */
+	KUNIT_EXPECT_EQ(test, amnesiafs_dir_find(records, n, "file-1", 5), -1);
+	KUNIT_EXPECT_EQ(test, amnesiafs_dir_find(records, n, "file-10x", 8),
+			-1);
+	KUNIT_EXPECT_EQ(test, amnesiafs_dir_find(records, 0, "file-0", 6), -1);
+}
+
+static void amnesiafs_test_dir_find_hash(struct kunit *test)
+{
+	struct amnesiafs_dir_record *records;
+	unsigned int n = AMNESIAFS_DIR_RECORDS_PER_BLOCK;
+	unsigned int i;
+
+	records = kunit_kzalloc(test, n * sizeof(*records), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, records);
+	for (i = 0; i < n; i++)
+		records[i].name_hash = i % 4;
+
+	KUNIT_EXPECT_EQ(test, amnesiafs_dir_find_hash(records, 0, n, 2), 2);
+	/* collisions are walked one at a time */
+	KUNIT_EXPECT_EQ(test, amnesiafs_dir_find_hash(records, 3, n, 2), 6);
+	KUNIT_EXPECT_EQ(test, amnesiafs_dir_find_hash(records, 7, n, 2), 10);
+	KUNIT_EXPECT_EQ(test, amnesiafs_dir_find_hash(records, 11, n, 2), 14);
+	KUNIT_EXPECT_EQ(test, amnesiafs_dir_find_hash(records, 15, n, 2), -1);
+	/* only the first count records are in use */
+	KUNIT_EXPECT_EQ(test, amnesiafs_dir_find_hash(records, 11, 14, 2), -1);
+	KUNIT_EXPECT_EQ(test, amnesiafs_dir_find_hash(records, 0, n, 4), -1);
+}
+
+static void amnesiafs_test_dir_csum(struct kunit *test)
+{
+	struct amnesiafs_test_volume *vol = test->priv;
+	struct buffer_head *bh = amnesiafs_test_bh(test, 1000);
+
+	set_buffer_amnesiafs_dir(bh);
+	amnesiafs_test_dir_records(test,
+				   (struct amnesiafs_dir_record *)bh->b_data,
+				   3);
+	amnesiafs_csum_set(&vol->sb, bh, bh->b_data);
+	KUNIT_EXPECT_EQ(test, amnesiafs_dir_verify(&vol->sb, bh), 0);
+	KUNIT_EXPECT_TRUE(test, buffer_amnesiafs_verified(bh));
+
+	/* checked only the first time */
+	bh->b_data[0] ^= 1;
+	KUNIT_EXPECT_EQ(test, amnesiafs_dir_verify(&vol->sb, bh), 0);
+	clear_buffer_amnesiafs_verified(bh);
+	KUNIT_EXPECT_EQ(test, amnesiafs_dir_verify(&vol->sb, bh), -EBADMSG);
+	KUNIT_EXPECT_FALSE(test, buffer_amnesiafs_verified(bh));
+
+	/* volumes without checksums aren't checked */
+	vol->disk_sb.features = 0;
+	KUNIT_EXPECT_EQ(test, amnesiafs_dir_verify(&vol->sb, bh), 0);
+}
+
+static void amnesiafs_test_super_csum(struct kunit *test)
+{
+	struct amnesiafs_test_volume *vol = test->priv;
+	struct buffer_head *bh =
+		amnesiafs_test_bh(test, AMNESIAFS_SUPER_BLOCK_NUMBER);
+	struct amnesiafs_super_block *disk_sb = (void *)bh->b_data;
+
+	disk_sb->magic = AMNESIAFS_MAGIC;
+	disk_sb->features = AMNESIAFS_FEATURE_CSUM;
+	amnesiafs_csum_set(&vol->sb, bh, bh->b_data);
+	KUNIT_EXPECT_TRUE(test, amnesiafs_super_verify(disk_sb));
+
+	disk_sb->blocks_count++;
+	KUNIT_EXPECT_FALSE(test, amnesiafs_super_verify(disk_sb));
+}
+
+static struct kunit_case amnesiafs_dir_cases[] = {
+	KUNIT_CASE(amnesiafs_test_dir_find),
+	KUNIT_CASE(amnesiafs_test_dir_find_hash),
+	KUNIT_CASE(amnesiafs_test_dir_csum),
+	KUNIT_CASE(amnesiafs_test_super_csum),
+	{}
+};
+
+static struct kunit_suite amnesiafs_dir_suite = {
+	.name = "amnesiafs_dir",
+	.init = amnesiafs_test_init,
+	.exit = amnesiafs_test_exit,
+	.test_cases = amnesiafs_dir_cases,
+};
+
+/* the inode table */
+
+static void amnesiafs_test_inode_table_layout(struct kunit *test)
+{
+	uint64_t ino;
+
+	KUNIT_EXPECT_EQ(test, amnesiafs_inode_table_block(1),
+			(uint64_t)AMNESIAFS_INODE_TABLE_BLOCK_NUMBER);
+	KUNIT_EXPECT_EQ(test, amnesiafs_inode_table_slot(1), 0U);
+	KUNIT_EXPECT_EQ(test,
+			amnesiafs_inode_table_block(AMNESIAFS_MAX_INODES),
+			(uint64_t)AMNESIAFS_INODE_TABLE_BLOCK_NUMBER +
+				AMNESIAFS_INODE_TABLE_BLOCKS - 1);
+
+	/* every inode has a slot of its own, and the slots run in order */
+	for (ino = 1; ino <= AMNESIAFS_MAX_INODES; ino++)
+		KUNIT_ASSERT_EQ(test,
+				(amnesiafs_inode_table_block(ino) -
+				 AMNESIAFS_INODE_TABLE_BLOCK_NUMBER) *
+						AMNESIAFS_INODES_PER_BLOCK +
+					amnesiafs_inode_table_slot(ino),
+				ino - 1);
+}
+
+static void amnesiafs_test_inode_csum(struct kunit *test)
+{
+	struct amnesiafs_test_volume *vol = test->priv;
+	struct buffer_head *bh =
+		amnesiafs_test_bh(test, amnesiafs_inode_table_block(17));
+	struct amnesiafs_inode *raw = (void *)bh->b_data;
+
+	raw[amnesiafs_inode_table_slot(17)].inode_no = 17;
+	raw[amnesiafs_inode_table_slot(18)].inode_no = 18;
+	amnesiafs_csum_set(&vol->sb, bh, bh->b_data);
+	KUNIT_EXPECT_NE(test, raw[0].checksum, 0U);
+	/* empty slots stay all zero */
+	KUNIT_EXPECT_EQ(test, raw[2].checksum, 0U);
+	KUNIT_EXPECT_EQ(test, amnesiafs_inode_table_verify(&vol->sb, bh), 0);
+
+	clear_buffer_amnesiafs_verified(bh);
+	raw[1].file_size = 1;
+	KUNIT_EXPECT_EQ(test, amnesiafs_inode_table_verify(&vol->sb, bh),
+			-EBADMSG);
+}
+
+static struct kunit_case amnesiafs_inode_cases[] = {
+	KUNIT_CASE(amnesiafs_test_inode_table_layout),
+	KUNIT_CASE(amnesiafs_test_inode_csum),
+	{}
+};
+
+static struct kunit_suite amnesiafs_inode_suite = {
+	.name = "amnesiafs_inode",
+	.init = amnesiafs_test_init,
+	.exit = amnesiafs_test_exit,
+	.test_cases = amnesiafs_inode_cases,
+};
+
+/* alloc.c */
+
+static void amnesiafs_test_ino_group(struct kunit *test)
+{
+	struct amnesiafs_sb_info *sbi = amnesiafs_test_sbi(test);
+	uint64_t first, end, prev_end = 0;
+	unsigned int g;
+
+	KUNIT_EXPECT_EQ(test, sbi->inodes_per_group, 256U);
+	KUNIT_EXPECT_EQ(test, amnesiafs_ino_group(sbi, 1), 0U);
+	KUNIT_EXPECT_EQ(test, amnesiafs_ino_group(sbi, 256), 0U);
+	KUNIT_EXPECT_EQ(test, amnesiafs_ino_group(sbi, 257), 1U);
+	KUNIT_EXPECT_EQ(test, amnesiafs_ino_group(sbi, AMNESIAFS_MAX_INODES),
+			3U);
+
+	/* the slices cover the table exactly, each inode in its own group's */
+	for (g = 0; g < sbi->nr_groups; g++) {
+		amnesiafs_group_inodes(sbi, g, &first, &end);
+		KUNIT_EXPECT_EQ(test, first, prev_end);
+		KUNIT_EXPECT_EQ(test, amnesiafs_ino_group(sbi, first + 1), g);
+		KUNIT_EXPECT_EQ(test, amnesiafs_ino_group(sbi, end), g);
+		prev_end = end;
+	}
+	KUNIT_EXPECT_EQ(test, prev_end, (uint64_t)AMNESIAFS_MAX_INODES);
+
+	/* the last group takes what the rounding leaves over */
+	sbi->nr_groups = 3;
+	sbi->inodes_per_group = 336;
+	KUNIT_EXPECT_EQ(test, amnesiafs_ino_group(sbi, AMNESIAFS_MAX_INODES),
+			2U);
+	amnesiafs_group_inodes(sbi, 2, &first, &end);
+	KUNIT_EXPECT_EQ(test, end, (uint64_t)AMNESIAFS_MAX_INODES);
+	sbi->nr_groups = 4;
+	sbi->inodes_per_group = 256;
+}
+
+static void amnesiafs_test_group_new_blocks(struct kunit *test)
+{
+	struct amnesiafs_sb_info *sbi = amnesiafs_test_sbi(test);
+	unsigned long found;
+
+	/* the goal is honoured when it's free */
+	KUNIT_ASSERT_TRUE(test, amnesiafs_group_new_blocks(sbi, 1,
+							   AMNESIAFS_GROUP_BLOCKS +
+								   100,
+							   8, &found, NULL));
+	KUNIT_EXPECT_EQ(test, found, AMNESIAFS_GROUP_BLOCKS + 100UL);
+	KUNIT_EXPECT_EQ(test, sbi->groups[1].free_blocks,
+			AMNESIAFS_GROUP_BLOCKS - 8U);
+
+	/* and the run after it taken when it isn't */
+	KUNIT_ASSERT_TRUE(test, amnesiafs_group_new_blocks(sbi, 1,
+							   AMNESIAFS_GROUP_BLOCKS +
+								   104,
+							   4, &found, NULL));
+	KUNIT_EXPECT_EQ(test, found, AMNESIAFS_GROUP_BLOCKS + 108UL);
+
+	/* a goal outside the group means the start of it */
+	KUNIT_ASSERT_TRUE(test, amnesiafs_group_new_blocks(sbi, 2, 5, 1,
+							   &found, NULL));
+	KUNIT_EXPECT_EQ(test, found, 2UL * AMNESIAFS_GROUP_BLOCKS);
+
+	/* runs never cross into the next group */
+	bitmap_set(sbi->bitmap, 0, AMNESIAFS_GROUP_BLOCKS - 4);
+	sbi->groups[0].free_blocks = 4;
+	KUNIT_EXPECT_FALSE(test,
+			   amnesiafs_group_new_blocks(sbi, 0, 0, 8, &found,
+						      NULL));
+	KUNIT_EXPECT_TRUE(test,
+			  amnesiafs_group_new_blocks(sbi, 0, 0, 4, &found,
+						      NULL));
+	KUNIT_EXPECT_EQ(test, found, AMNESIAFS_GROUP_BLOCKS - 4UL);
+	KUNIT_EXPECT_EQ(test, sbi->groups[0].free_blocks, 0U);
+	KUNIT_EXPECT_FALSE(test,
+			   amnesiafs_group_new_blocks(sbi, 0, 0, 1, &found,
+						      NULL));
+}
+
+static void amnesiafs_test_new_ino(struct kunit *test)
+{
+	struct amnesiafs_test_volume *vol = test->priv;
+	struct amnesiafs_sb_info *sbi = &vol->sbi;
+	struct inode dir = { .i_ino = AMNESIAFS_ROOT_INODE_NUMBER };
+	uint64_t ino, sub;
+	unsigned int g;
+
+	/* top level directories spread out over the groups */
+	for (g = 0; g < sbi->nr_groups; g++)
+		KUNIT_ASSERT_EQ(test,
+				amnesiafs_new_ino(&vol->sb, &dir, S_IFDIR,
+						  &ino),
+				0);
+	for (g = 0; g < sbi->nr_groups; g++)
+		KUNIT_EXPECT_EQ(test, sbi->groups[g].dirs, 1U);
+	KUNIT_EXPECT_EQ(test, vol->disk_sb.inodes_count,
+			(uint64_t)sbi->nr_groups);
+
+	/* and what's in them stays with them */
+	dir.i_ino = ino;
+	KUNIT_ASSERT_EQ(test, amnesiafs_new_ino(&vol->sb, &dir, S_IFREG, &sub),
+			0);
+	KUNIT_EXPECT_EQ(test, amnesiafs_ino_group(sbi, sub),
+			amnesiafs_ino_group(sbi, ino));
+	KUNIT_EXPECT_EQ(test, amnesiafs_inode_goal(&vol->sb, sub),
+			(uint64_t)amnesiafs_ino_group(sbi, ino) *
+				AMNESIAFS_GROUP_BLOCKS);
+	KUNIT_EXPECT_EQ(test, percpu_counter_sum(&sbi->free_inodes),
+			(s64)AMNESIAFS_MAX_INODES - 5);
+}
+
+/* A failed create leaves the counts as they were before it. */
+static void amnesiafs_test_free_ino(struct kunit *test)
+{
+	struct amnesiafs_test_volume *vol = test->priv;
+	struct amnesiafs_sb_info *sbi = &vol->sbi;
+	struct inode dir = { .i_ino = AMNESIAFS_ROOT_INODE_NUMBER };
+	unsigned int group, free_inodes;
+	uint64_t ino, again;
+
+	KUNIT_ASSERT_EQ(test, amnesiafs_new_ino(&vol->sb, &dir, S_IFDIR, &ino),
+			0);
+	group = amnesiafs_ino_group(sbi, ino);
+	free_inodes = sbi->groups[group].free_inodes;
+
+	amnesiafs_free_ino(&vol->sb, ino, S_IFDIR);
+	KUNIT_EXPECT_EQ(test, vol->disk_sb.inodes_count, (uint64_t)0);
+	KUNIT_EXPECT_EQ(test, sbi->groups[group].free_inodes, free_inodes + 1);
+	KUNIT_EXPECT_EQ(test, sbi->groups[group].dirs, 0U);
+	KUNIT_EXPECT_FALSE(test, test_bit(ino - 1, sbi->inode_bitmap));
+	KUNIT_EXPECT_EQ(test, percpu_counter_sum(&sbi->free_inodes),
+			(s64)AMNESIAFS_MAX_INODES);
+
+	/* and the number is handed out again */
+	dir.i_ino = ino;
+	KUNIT_ASSERT_EQ(test,
+			amnesiafs_new_ino(&vol->sb, &dir, S_IFREG, &again), 0);
+	KUNIT_EXPECT_EQ(test, again, ino);
+}
+
+static struct kunit_case amnesiafs_alloc_cases[] = {
+	KUNIT_CASE(amnesiafs_test_ino_group),
+	KUNIT_CASE(amnesiafs_test_group_new_blocks),
+	KUNIT_CASE(amnesiafs_test_new_ino),
+	KUNIT_CASE(amnesiafs_test_free_ino),
+	{}
+};
+
+static struct kunit_suite amnesiafs_alloc_suite = {
+	.name = "amnesiafs_alloc",
+	.init = amnesiafs_test_init,
+	.exit = amnesiafs_test_exit,
+	.test_cases = amnesiafs_alloc_cases,
+};
+
+/* benchmarks */
+
+#define AMNESIAFS_BENCH_RUNS 10000
+
+/* how much slower than the easy case the hard one may be */
+#define AMNESIAFS_BENCH_SLACK 4
+
+/* Take a block at goal and give it back, as allocation does it. */
+static void amnesiafs_bench_alloc_one(struct amnesiafs_sb_info *sbi,
+				      unsigned int group, uint64_t goal)
+{
+	unsigned long found;
+
+	if (amnesiafs_group_new_blocks(sbi, group, goal, 1, &found, NULL)) {
+		bitmap_clear(sbi->bitmap, found, 1);
+		sbi->groups[group].free_blocks++;
+	}
+}
+
+/*
+ * Allocating at a goal should cost the same however much of the group
+ * before it is full; a search from the start of the group would not.
+ */
+static void amnesiafs_bench_group_new_blocks(struct kunit *test)
+{
+	struct amnesiafs_sb_info *sbi = amnesiafs_test_sbi(test);
+	uint64_t full = AMNESIAFS_GROUP_BLOCKS - 64;
+	u64 empty_ns, crowded_ns;
+
+	bitmap_set(sbi->bitmap, 0, full);
+	sbi->groups[0].free_blocks -= full;
+
+	empty_ns = amnesiafs_bench(
+		AMNESIAFS_BENCH_RUNS,
+		amnesiafs_bench_alloc_one(sbi, 1, AMNESIAFS_GROUP_BLOCKS + 1));
+	crowded_ns = amnesiafs_bench(AMNESIAFS_BENCH_RUNS,
+				     amnesiafs_bench_alloc_one(sbi, 0, full));
+
+	kunit_info(test, "block at goal: %llu ns empty, %llu ns crowded",
+		   empty_ns, crowded_ns);
+	KUNIT_EXPECT_LE(test, crowded_ns,
+			AMNESIAFS_BENCH_SLACK * max_t(u64, empty_ns, 50));
+}
+
+/* Looking up an inode's group is arithmetic, however many groups. */
+static void amnesiafs_bench_ino_group(struct kunit *test)
+{
+	struct amnesiafs_sb_info *sbi = amnesiafs_test_sbi(test);
+	unsigned int nr_groups = sbi->nr_groups;
+	u64 few_ns, many_ns;
+	uint64_t sum = 0;
+
+	few_ns = amnesiafs_bench(
+		AMNESIAFS_BENCH_RUNS,
+		sum += amnesiafs_ino_group(sbi, AMNESIAFS_MAX_INODES - __i % 7));
+
+	sbi->nr_groups = AMNESIAFS_MAX_INODES / AMNESIAFS_INODES_PER_BLOCK;
+	sbi->inodes_per_group = AMNESIAFS_INODES_PER_BLOCK;
+	many_ns = amnesiafs_bench(
+		AMNESIAFS_BENCH_RUNS,
+		sum += amnesiafs_ino_group(sbi, AMNESIAFS_MAX_INODES - __i % 7));
+	sbi->nr_groups = nr_groups;
+	sbi->inodes_per_group = 256;
+
+	kunit_info(test, "inode group: %llu ns with 4 groups, %llu ns with 64 (%llu)",
+		   few_ns, many_ns, sum);
+	KUNIT_EXPECT_LE(test, many_ns,
+			AMNESIAFS_BENCH_SLACK * max_t(u64, few_ns, 50));
+}
+
+/*
+ * A lookup that misses has to look at every record, but nothing else, so it
+ * should cost what finding the last record does.
+ */
+static void amnesiafs_bench_dir_find(struct kunit *test)
+{
+	struct amnesiafs_dir_record *records;
+	unsigned int n = AMNESIAFS_DIR_RECORDS_PER_BLOCK;
+	u64 last_ns, miss_ns;
+	int sum = 0;
+
+	records = kunit_kzalloc(test, n * sizeof(*records), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, records);
+	amnesiafs_test_dir_records(test, records, n);
+
+	last_ns = amnesiafs_bench(AMNESIAFS_BENCH_RUNS,
+				  sum += amnesiafs_dir_find(records, n,
+							    "file-14", 7));
+	miss_ns = amnesiafs_bench(AMNESIAFS_BENCH_RUNS,
+				  sum += amnesiafs_dir_find(records, n,
+							    "file-99", 7));
+
+	kunit_info(test, "dir record: %llu ns last, %llu ns miss (%d)",
+		   last_ns, miss_ns, sum);
+	KUNIT_EXPECT_LE(test, miss_ns,
+			AMNESIAFS_BENCH_SLACK * max_t(u64, last_ns, 50));
+}
+
+static void amnesiafs_bench_dir_csum(struct kunit *test)
+{
+	struct amnesiafs_test_volume *vol = test->priv;
+	struct buffer_head *bh = amnesiafs_test_bh(test, 1000);
+	u64 ns;
+
+	set_buffer_amnesiafs_dir(bh);
+	ns = amnesiafs_bench(AMNESIAFS_BENCH_RUNS / 10,
+			     amnesiafs_csum_set(&vol->sb, bh, bh->b_data));
+
+	kunit_info(test, "directory block checksum: %llu ns", ns);
+}
+
+static struct kunit_case amnesiafs_bench_cases[] = {
+	KUNIT_CASE(amnesiafs_bench_group_new_blocks),
+	KUNIT_CASE(amnesiafs_bench_ino_group),
+	KUNIT_CASE(amnesiafs_bench_dir_find),
+	KUNIT_CASE(amnesiafs_bench_dir_csum),
+	{}
+};
+
+static struct kunit_suite amnesiafs_bench_suite = {
+	.name = "amnesiafs_bench",
+	.init = amnesiafs_test_init,
+	.exit = amnesiafs_test_exit,
+	.test_cases = amnesiafs_bench_cases,
+};
+
+kunit_test_suites(&amnesiafs_config_suite, &amnesiafs_dir_suite,
+		  &amnesiafs_inode_suite, &amnesiafs_alloc_suite,
+		  &amnesiafs_bench_suite);
+
+MODULE_LICENSE("GPL");
@@ -0,0 +1,16 @@
+#!/usr/bin/env bash
+
+set -euxo pipefail
+
+# the results come out in KTAP, which kunit.py parse can also read
+dmesg -C
+modprobe kunit || true
+insmod amnesiafs_test.ko
+dmesg | tee /tmp/kunit.log
+rmmod amnesiafs_test
+
+grep -q "^\s*ok [0-9]* - amnesiafs_bench" /tmp/kunit.log
+if grep -q "not ok" /tmp/kunit.log; then
+    echo "KUnit tests failed"
+    exit 1
+fi
@@ -5,6 +5,7 @@ set -euxo pipefail
 here="$(dirname $0)"
 tests_dir="$(realpath "$here")"
 src_dir="$(realpath "$here"/..)"
+script="$(realpath "${1:-$tests_dir/run-tests.sh}")"
 
 test_drive="${tests_dir}/test.img"
 dd if=/dev/zero of="${test_drive}" bs=4096 count=128KiB
@@ -13,5 +14,5 @@ virtme-run \
     --installed-kernel \
     --cwd $src_dir \
     --disk "test=${test_drive}" \
-    --script-sh "$tests_dir/run-tests.sh" \
+    --script-sh "$script" \
     --qemu-opts -m 2048 -smp 2
@@ -11,6 +11,18 @@ function start_test {
     } 2> /dev/null
 }
 
+# copy $1 to $2 with sendfile(2), which splices through a pipe in the kernel
+function sendfile_copy {
+    python3 -c '
+import os, sys
+src = os.open(sys.argv[1], os.O_RDONLY)
+dst = os.open(sys.argv[2], os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0o644)
+size, offset = os.fstat(src).st_size, 0
+while offset < size:
+    offset += os.sendfile(dst, src, offset, size - offset)
+' "${1}" "${2}"
+}
+
 export PATH=$(realpath .):${PATH}
 
 # start logging kernel messages
@@ -18,7 +30,7 @@ dmesg -C
 dmesg -w &
 
 start_test "loading kmodule"
-insmod amnesiafs.ko
+insmod amnesiafs.ko dyndbg=+pfl
 
 start_test "mkfs.amnesiafs"
 disk="/dev/disk/by-id/scsi-0virtme_disk_test"
@@ -50,12 +62,142 @@ mount -t amnesiafs -o "key_name=${key_name}" "${disk}" "/tmp/mount"
 start_test "listing"
 ls -la "/tmp/mount"
 
+start_test "statfs"
+df "/tmp/mount"
+free_before="$(stat -f -c %f "/tmp/mount")"
+test "${free_before}" -gt 0
+test "$(stat -f -c %d "/tmp/mount")" -gt 0
+
 echo "hello this is a longer file I'm not sure how long it should be" > "/tmp/mount/toot"
 
 cat "/tmp/mount/toot"
 
+start_test "inline data"
+printf "small" > "/tmp/mount/small"
+sync
+test "$(stat -c %b "/tmp/mount/small")" -eq 0
+head -c 1000 /dev/urandom > /tmp/grown
+cp /tmp/grown "/tmp/mount/small"
+cmp /tmp/grown "/tmp/mount/small"
+
+start_test "parallel creates"
+for dir in a b c d; do
+    mkdir "/tmp/mount/${dir}"
+    (for i in $(seq 1 10); do touch "/tmp/mount/${dir}/${i}"; done) &
+done
+wait
+for dir in a b c d; do
+    test "$(ls "/tmp/mount/${dir}" | wc -l)" -eq 10
+done
+
+start_test "multi-block files"
+dd if=/dev/urandom of=/tmp/big bs=1M count=8
+cp /tmp/big "/tmp/mount/big"
+cmp /tmp/big "/tmp/mount/big"
+sync
+echo 3 > /proc/sys/vm/drop_caches
+cmp /tmp/big "/tmp/mount/big"
+test "$(stat -f -c %f "/tmp/mount")" -le "$((free_before - 2048))"
+truncate -s 100000 "/tmp/mount/big"
+test "$(stat -c %s "/tmp/mount/big")" -eq 100000
+cmp -n 100000 /tmp/big "/tmp/mount/big"
+
+start_test "background reclaim"
+sync
+test "$(stat -c %b "/tmp/mount/big")" -eq 200
+test "$(stat -f -c %f "/tmp/mount")" -gt "$((free_before - 2048))"
+cp /tmp/big "/tmp/mount/regrown"
+truncate -s 0 "/tmp/mount/regrown"
+truncate -s 8M "/tmp/mount/regrown"
+cmp "/tmp/mount/regrown" <(head -c 8388608 /dev/zero)
+
+start_test "sparse files"
+truncate -s 16M "/tmp/mount/sparse"
+cmp -n 16777216 "/tmp/mount/sparse" /dev/zero
+printf "data" | dd of="/tmp/mount/sparse" bs=4096 seek=2048 conv=notrunc
+sync
+test "$(stat -c %b "/tmp/mount/sparse")" -eq 8
+fallocate -l 1M "/tmp/mount/prealloc"
+test "$(stat -c %b "/tmp/mount/prealloc")" -eq 2048
+cmp "/tmp/mount/prealloc" <(head -c 1048576 /dev/zero)
+printf "written" | dd of="/tmp/mount/prealloc" bs=4096 seek=5 conv=notrunc,fsync
+echo 3 > /proc/sys/vm/drop_caches
+cmp <(head -c 20487 "/tmp/mount/prealloc") \
+    <(head -c 20480 /dev/zero; printf "written")
+head -c 65536 /dev/urandom > "/tmp/mount/punched"
+fallocate -p -o 1000 -l 10000 "/tmp/mount/punched"
+cmp -n 10000 <(tail -c +1001 "/tmp/mount/punched") /dev/zero
+test "$(stat -c %s "/tmp/mount/punched")" -eq 65536
+
+start_test "reflinks"
+head -c 1048576 /dev/urandom > /tmp/original
+cp /tmp/original "/tmp/mount/original"
+sync
+cp --reflink=always "/tmp/mount/original" "/tmp/mount/clone"
+cmp /tmp/original "/tmp/mount/clone"
+printf "changed" | dd of="/tmp/mount/clone" bs=4096 seek=3 conv=notrunc
+sync
+cmp /tmp/original "/tmp/mount/original"
+echo 3 > /proc/sys/vm/drop_caches
+cmp -n 12288 /tmp/original "/tmp/mount/clone"
+# copying shared blocks takes space, so a full volume refuses the write
+if cat /dev/zero > "/tmp/mount/filler"; then
+    echo "the volume should have filled up"
+    exit 1
+fi
+sync
+if dd if=/dev/zero of="/tmp/mount/clone" bs=1M count=1 conv=notrunc,fsync; then
+    echo "overwriting shared blocks on a full volume should fail"
+    exit 1
+fi
+rm "/tmp/mount/filler"
+sync
+cmp /tmp/original "/tmp/mount/original"
+
+start_test "speculative preallocation"
+rm -f /tmp/log1 /tmp/log2
+exec 3>>"/tmp/mount/b/log1" 4>>"/tmp/mount/b/log2"
+for i in $(seq 1 8); do
+    head -c 65536 /dev/urandom | tee -a /tmp/log1 >&3
+    head -c 65536 /dev/urandom | tee -a /tmp/log2 >&4
+    sync
+done
+# blocks past the end while they're open...
+test "$(stat -c %b "/tmp/mount/b/log1")" -gt 1024
+test "$(stat -c %b "/tmp/mount/b/log2")" -gt 1024
+exec 3>&- 4>&-
+# ...and none once they're closed
+test "$(stat -c %b "/tmp/mount/b/log1")" -eq 1024
+test "$(stat -c %b "/tmp/mount/b/log2")" -eq 1024
+echo 3 > /proc/sys/vm/drop_caches
+cmp /tmp/log1 "/tmp/mount/b/log1"
+cmp /tmp/log2 "/tmp/mount/b/log2"
+
+start_test "splice and sendfile"
+sendfile_copy /tmp/big "/tmp/mount/spliced"
+cmp /tmp/big "/tmp/mount/spliced"
+sendfile_copy "/tmp/mount/spliced" /dev/stdout | cmp /tmp/big -
+sync
+echo 3 > /proc/sys/vm/drop_caches
+sendfile_copy "/tmp/mount/spliced" /dev/stdout | cmp /tmp/big -
+rm "/tmp/mount/spliced"
+
+start_test "encrypted names"
+touch "/tmp/mount/c/plaintext-canary"
+long_name="$(printf "n%.0s" $(seq 1 246))"
+touch "/tmp/mount/d/${long_name}"
+if touch "/tmp/mount/d/${long_name}n"; then
+    echo "names too long to encrypt should be refused"
+    exit 1
+fi
+ls -R "/tmp/mount" > /tmp/listing
+
 start_test "umount"
 umount "/tmp/mount"
+if grep -qa "plaintext-canary" "${disk}"; then
+    echo "names should be encrypted on disk"
+    exit 1
+fi
 
 start_test "key reuse"
 if mount -t amnesiafs -o "key_name=${key_name}" "${disk}" "/tmp/mount"; then
@@ -63,6 +205,165 @@ if mount -t amnesiafs -o "key_name=${key_name}" "${disk}" "/tmp/mount"; then
     exit 1
 fi
 
+start_test "remount"
+echo "my passphrase" | amnesiafs-store-passphrase "${key_name}" "${disk}"
+mount -t amnesiafs -o "key_name=${key_name},compress=lz4" "${disk}" "/tmp/mount"
+for dir in a b c d; do
+    test "$(ls "/tmp/mount/${dir}" | grep -c "^[0-9]*$")" -eq 10
+done
+test "$(ls -l "/tmp/mount/a" | grep -c "^-")" -eq 10
+cmp -n 100000 /tmp/big "/tmp/mount/big"
+grep -q "hello this is a longer file" "/tmp/mount/toot"
+cmp /tmp/grown "/tmp/mount/small"
+diff /tmp/listing <(ls -R "/tmp/mount")
+test -e "/tmp/mount/d/${long_name}"
+
+start_test "missing names"
+for i in 1 2; do
+    if stat "/tmp/mount/a/missing" || stat "/tmp/mount/a/11"; then
+        echo "missing names should not be found"
+        exit 1
+    fi
+done
+test -e "/tmp/mount/a/10"
+touch "/tmp/mount/a/missing"
+test -e "/tmp/mount/a/missing"
+mkdir "/tmp/mount/a/sub"
+test ! -e "/tmp/mount/a/sub/missing"
+touch "/tmp/mount/a/sub/missing"
+test -e "/tmp/mount/a/sub/missing"
+
+start_test "compression"
+yes "compress me" | head -c 1048576 > /tmp/compressible
+cp /tmp/compressible "/tmp/mount/compressible"
+cp /tmp/big "/tmp/mount/incompressible"
+sync
+test "$(stat -c %b "/tmp/mount/compressible")" -lt 2048
+test "$(stat -c %b "/tmp/mount/incompressible")" -eq 16384
+echo 3 > /proc/sys/vm/drop_caches
+cmp /tmp/compressible "/tmp/mount/compressible"
+cmp /tmp/big "/tmp/mount/incompressible"
+printf "changed" | dd of="/tmp/compressible" bs=4096 seek=3 conv=notrunc
+printf "changed" | dd of="/tmp/mount/compressible" bs=4096 seek=3 conv=notrunc
+truncate -s 100000 /tmp/compressible "/tmp/mount/compressible"
+sync
+echo 3 > /proc/sys/vm/drop_caches
+cmp /tmp/compressible "/tmp/mount/compressible"
+# the first pass only ages the transform, the second lets the shrinker free it
+echo 2 > /proc/sys/vm/drop_caches
+echo 3 > /proc/sys/vm/drop_caches
+cmp /tmp/compressible "/tmp/mount/compressible"
+umount "/tmp/mount"
+
+start_test "striping"
+truncate -s 64M /tmp/stripe0 /tmp/stripe1
+stripe0="$(losetup -f --show /tmp/stripe0)"
+stripe1="$(losetup -f --show /tmp/stripe1)"
+mkfs.amnesiafs "${stripe0}" "${stripe1}"
+echo "my passphrase" | amnesiafs-store-passphrase "${key_name}" "${stripe0}"
+if mount -t amnesiafs -o "key_name=${key_name}" "${stripe0}" "/tmp/mount"; then
+    echo "mounting without the second device should fail"
+    exit 1
+fi
+mount -t amnesiafs -o "key_name=${key_name},device=${stripe1}" "${stripe0}" "/tmp/mount"
+cp /tmp/big "/tmp/mount/big"
+sync
+echo 3 > /proc/sys/vm/drop_caches
+cmp /tmp/big "/tmp/mount/big"
+umount "/tmp/mount"
+losetup -d "${stripe0}" "${stripe1}"
+
+start_test "block groups"
+# eight groups, each with a slice of 128 inodes
+truncate -s 1G /tmp/groups
+groups="$(losetup -f --show /tmp/groups)"
+mkfs.amnesiafs "${groups}"
+echo "my passphrase" | amnesiafs-store-passphrase "${key_name}" "${groups}"
+mount -t amnesiafs -o "key_name=${key_name},discard" "${groups}" "/tmp/mount"
+for dir in a b c d; do
+    mkdir "/tmp/mount/${dir}"
+    touch "/tmp/mount/${dir}/file"
+    dir_group="$((($(stat -c %i "/tmp/mount/${dir}") - 1) / 128))"
+    file_group="$((($(stat -c %i "/tmp/mount/${dir}/file") - 1) / 128))"
+    test "${dir_group}" -eq "${file_group}"
+    echo "${dir_group}"
+done | sort -u | wc -l | grep -qx 4
+head -c 16777216 /dev/urandom > "/tmp/mount/a/discarded"
+sync
+truncate -s 0 "/tmp/mount/a/discarded"
+sync
+test "$(stat -c %b "/tmp/mount/a/discarded")" -eq 0
+umount "/tmp/mount"
+
+start_test "metadata checksums"
+# flip a byte in the super block's padding
+printf '\xff' | dd of="${groups}" bs=1 seek=4000 conv=notrunc
+echo "my passphrase" | amnesiafs-store-passphrase "${key_name}" "${groups}"
+if mount -t amnesiafs -o "key_name=${key_name}" "${groups}" "/tmp/mount"; then
+    echo "mounting with a corrupt super block should fail"
+    exit 1
+fi
+losetup -d "${groups}"
+
+start_test "inline encryption"
+truncate -s 64M /tmp/crypt
+crypt="$(losetup -f --show /tmp/crypt)"
+mkfs.amnesiafs "${crypt}"
+echo "my passphrase" | amnesiafs-store-passphrase "${key_name}" "${crypt}"
+mount -t amnesiafs -o "key_name=${key_name},inlinecrypt" "${crypt}" "/tmp/mount"
+cp /tmp/compressible "/tmp/mount/plaintext"
+printf "short-plaintext-canary" > "/tmp/mount/short"
+umount "/tmp/mount"
+if grep -q "compress me" "${crypt}"; then
+    echo "file data should be encrypted"
+    exit 1
+fi
+if grep -qa "short-plaintext-canary" "${crypt}"; then
+    echo "small files should be encrypted too"
+    exit 1
+fi
+echo "my passphrase" | amnesiafs-store-passphrase "${key_name}" "${crypt}"
+if mount -t amnesiafs -o "key_name=${key_name}" "${crypt}" "/tmp/mount"; then
+    echo "mounting an encrypted volume without inlinecrypt should fail"
+    exit 1
+fi
+echo "my passphrase" | amnesiafs-store-passphrase "${key_name}" "${crypt}"
+mount -t amnesiafs -o "key_name=${key_name},inlinecrypt" "${crypt}" "/tmp/mount"
+cmp /tmp/compressible "/tmp/mount/plaintext"
+grep -qx "short-plaintext-canary" "/tmp/mount/short"
+umount "/tmp/mount"
+losetup -d "${crypt}"
+
+start_test "device-less mode"
+key_id=$(echo -n "ephemeral" | keyctl padd amnesiafs "${key_name}" @u)
+mount -t amnesiafs -o "key_name=${key_name}" none "/tmp/mount"
+mkdir "/tmp/mount/secrets"
+cp /tmp/big "/tmp/mount/secrets/big"
+cmp /tmp/big "/tmp/mount/secrets/big"
+truncate -s 100000 "/tmp/mount/secrets/big"
+cmp -n 100000 /tmp/big "/tmp/mount/secrets/big"
+# read back from the encrypted store rather than the page cache
+sync
+echo 3 > /proc/sys/vm/drop_caches
+cmp -n 100000 /tmp/big "/tmp/mount/secrets/big"
+# and what was past the end before it was cut short stays gone
+truncate -s 200000 "/tmp/mount/secrets/big"
+tail -c 100000 "/tmp/mount/secrets/big" | cmp -n 100000 /dev/zero -
+rm "/tmp/mount/secrets/big"
+rmdir "/tmp/mount/secrets"
+# revoking the key discards the files
+echo "session token" > "/tmp/mount/token"
+keyctl revoke "${key_id}"
+if [ -s "/tmp/mount/token" ]; then
+    echo "revoking the key should have emptied the file"
+    exit 1
+fi
+if echo "more" > "/tmp/mount/token"; then
+    echo "writing after revoking the key should fail"
+    exit 1
+fi
+umount "/tmp/mount"
+
 start_test "unloading kmodule"
 rmmod amnesiafs
 
@@ -0,0 +1,263 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/string.h>
+
+#include "amnesiafs.h"
+
+#include "config.h"
+#include "log.h"
+#include "super.h"
+#include "volume.h"
+
+/*
+ * Volumes spanning several devices, striped RAID0 style above data_start.
+ * The first device is the one mounted; the others are named with device=
+ * mount options, in any order, and recognised by their member headers.
+ *
+ * Everything that reads or writes a block the allocator handed out goes
+ * through amnesiafs_map_block() or the buffer helpers below. Fixed metadata
+ * lives below data_start, where the mapping is the identity, so it can keep
+ * using sb_bread().
+ */
+
+#define AMNESIAFS_MEMBER_MODE (FMODE_READ | FMODE_WRITE | FMODE_EXCL)
+
+static int amnesiafs_volume_add(struct super_block *sb, const char *path)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	struct amnesiafs_super_block *disk_sb = sbi->disk_sb;
+	struct amnesiafs_member_header *header;
+	struct block_device *bdev;
+	struct buffer_head *bh;
+	uint64_t index, blocks;
+	int err;
+
+	bdev = blkdev_get_by_path(path, AMNESIAFS_MEMBER_MODE, sb->s_type);
+	if (IS_ERR(bdev)) {
+		amnesiafs_err("can't open %s: %ld", path, PTR_ERR(bdev));
+		return PTR_ERR(bdev);
+	}
+
+	err = set_blocksize(bdev, AMNESIAFS_BLOCKSIZE);
+	if (err)
+		goto out_put;
+
+	err = -EIO;
+	bh = __bread(bdev, 0, AMNESIAFS_BLOCKSIZE);
+	if (!bh)
+		goto out_put;
+
+	err = -EINVAL;
+	header = (struct amnesiafs_member_header *)bh->b_data;
+	index = header->index;
+	if (header->magic != AMNESIAFS_MEMBER_MAGIC ||
+	    memcmp(header->volume_uuid, disk_sb->volume_uuid,
+		   sizeof(header->volume_uuid))) {
+		amnesiafs_err("%s isn't part of this volume", path);
+		goto out_brelse;
+	}
+	if (!index || index >= disk_sb->nr_devices || sbi->devices[index]) {
+		amnesiafs_err("%s claims bad or duplicate slot %llu", path,
+			      index);
+		goto out_brelse;
+	}
+
+	blocks = div_u64(i_size_read(bdev->bd_inode), AMNESIAFS_BLOCKSIZE);
+	if (blocks < disk_sb->devices[index].blocks) {
+		amnesiafs_err("%s has shrunk to %llu blocks from %llu", path,
+			      blocks, disk_sb->devices[index].blocks);
+		goto out_brelse;
+	}
+
+	brelse(bh);
+	sbi->devices[index] = bdev;
+	return 0;
+
+out_brelse:
+	brelse(bh);
+out_put:
+	blkdev_put(bdev, AMNESIAFS_MEMBER_MODE);
+	return err;
+}
+
+/* Open the other devices of the volume, before anything reads from them. */
+int amnesiafs_volume_init(struct super_block *sb)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	struct amnesiafs_super_block *disk_sb = sbi->disk_sb;
+	struct amnesiafs_config *config = sbi->config;
+	unsigned int i;
+	int err;
+
+	sbi->devices[0] = sb->s_bdev;
+	sbi->nr_devices = 1;
+
+	/* made before volumes could span devices */
+	if (!disk_sb->nr_devices)
+		disk_sb->nr_devices = 1;
+
+	if (disk_sb->nr_devices > AMNESIAFS_MAX_DEVICES ||
+	    (disk_sb->nr_devices > 1 &&
+	     (!disk_sb->stripe_blocks ||
+	      disk_sb->data_start > disk_sb->blocks_count))) {
+		amnesiafs_err("bad device table: %llu devices, stripes of %llu",
+			      disk_sb->nr_devices, disk_sb->stripe_blocks);
+		return -EINVAL;
+	}
+
+	if (config->nr_devices != disk_sb->nr_devices - 1) {
+		amnesiafs_err("volume has %llu devices, but %u were given",
+			      disk_sb->nr_devices, config->nr_devices + 1);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < config->nr_devices; i++) {
+		err = amnesiafs_volume_add(sb, config->devices[i]);
+		if (err) {
+			amnesiafs_volume_destroy(sb);
+			return err;
+		}
+	}
+
+	sbi->nr_devices = disk_sb->nr_devices;
+	return 0;
+}
+
+void amnesiafs_volume_destroy(struct super_block *sb)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	unsigned int i;
+
+	/* the first device belongs to the VFS */
+	for (i = 1; i < AMNESIAFS_MAX_DEVICES; i++) {
+		if (sbi->devices[i])
+			blkdev_put(sbi->devices[i], AMNESIAFS_MEMBER_MODE);
+		sbi->devices[i] = NULL;
+	}
+	sbi->nr_devices = 1;
+}
+
+/* Flush the write caches of every device but the first. */
+int amnesiafs_volume_flush(struct super_block *sb)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	unsigned int i;
+	int err, ret = 0;
+
+	for (i = 1; i < sbi->nr_devices; i++) {
+		err = blkdev_issue_flush(sbi->devices[i], GFP_NOFS);
+		if (err && !ret)
+			ret = err;
+	}
+
+	return ret;
+}
+
+/*
+ * Add discards of volume blocks [block, block + count) to the chain in
+ * *biop, for the caller to submit. Devices that can't discard are skipped.
+ */
+void amnesiafs_volume_discard(struct super_block *sb, uint64_t block,
+			      uint64_t count, struct bio **biop)
+{
+	struct block_device *bdev;
+	uint64_t dev_block;
+	unsigned int run;
+
+	while (count) {
+		bdev = amnesiafs_map_block(sb, block, &dev_block, &run);
+		run = min_t(uint64_t, run, count);
+
+		if (blk_queue_discard(bdev_get_queue(bdev)))
+			__blkdev_issue_discard(
+				bdev,
+				dev_block * (AMNESIAFS_BLOCKSIZE >> SECTOR_SHIFT),
+				(sector_t)run *
+					(AMNESIAFS_BLOCKSIZE >> SECTOR_SHIFT),
+				GFP_NOFS, 0, biop);
+
+		block += run;
+		count -= run;
+	}
+}
+
+/*
+ * Find where volume block block lives. If run is given, it's set to the
+ * number of blocks from there on that follow it on the same device.
+ */
+struct block_device *amnesiafs_map_block(struct super_block *sb,
+					 uint64_t block, uint64_t *dev_block,
+					 unsigned int *run)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	uint64_t data_start = sbi->disk_sb->data_start;
+	uint64_t stripe_blocks = sbi->disk_sb->stripe_blocks;
+	uint64_t stripe, offset;
+	uint32_t device;
+
+	if (sbi->nr_devices == 1 || block < data_start) {
+		*dev_block = block;
+		if (run)
+			*run = sbi->nr_devices == 1 ?
+				       UINT_MAX :
+				       min_t(uint64_t, data_start - block,
+					     UINT_MAX);
+		return sb->s_bdev;
+	}
+
+	stripe = div64_u64_rem(block - data_start, stripe_blocks, &offset);
+	stripe = div_u64_rem(stripe, sbi->nr_devices, &device);
+
+	*dev_block = data_start + stripe * stripe_blocks + offset;
+	if (run)
+		*run = stripe_blocks - offset;
+	return sbi->devices[device];
+}
+
+/* The volume block a buffer from amnesiafs_bread() or _getblk() is for. */
+uint64_t amnesiafs_volume_block(struct super_block *sb,
+				struct buffer_head *bh)
+{
+	struct amnesiafs_sb_info *sbi = AMNESIAFS_SB(sb);
+	uint64_t data_start = sbi->disk_sb->data_start;
+	uint64_t stripe_blocks = sbi->disk_sb->stripe_blocks;
+	uint64_t row, offset;
+	unsigned int device;
+
+	if (sbi->nr_devices == 1 || bh->b_bdev == sb->s_bdev)
+		device = 0;
+	else
+		for (device = 1; device < sbi->nr_devices; device++)
+			if (sbi->devices[device] == bh->b_bdev)
+				break;
+
+	if (sbi->nr_devices == 1 || bh->b_blocknr < data_start)
+		return bh->b_blocknr;
+
+	row = div64_u64_rem(bh->b_blocknr - data_start, stripe_blocks, &offset);
+	return data_start +
+	       (row * sbi->nr_devices + device) * stripe_blocks + offset;
+}
+
+struct buffer_head *amnesiafs_bread(struct super_block *sb, uint64_t block)
+{
+	struct block_device *bdev;
+	uint64_t dev_block;
+
+	bdev = amnesiafs_map_block(sb, block, &dev_block, NULL);
+	return __bread(bdev, dev_block, AMNESIAFS_BLOCKSIZE);
+}
+
+struct buffer_head *amnesiafs_getblk(struct super_block *sb, uint64_t block)
+{
+	struct block_device *bdev;
+	uint64_t dev_block;
+
+	bdev = amnesiafs_map_block(sb, block, &dev_block, NULL);
+	return __getblk(bdev, dev_block, AMNESIAFS_BLOCKSIZE);
+}
@@ -0,0 +1,30 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#ifndef AMNESIAFS_VOLUME_H
+#define AMNESIAFS_VOLUME_H
+
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+
+int amnesiafs_volume_init(struct super_block *sb);
+
+void amnesiafs_volume_destroy(struct super_block *sb);
+
+int amnesiafs_volume_flush(struct super_block *sb);
+
+void amnesiafs_volume_discard(struct super_block *sb, uint64_t block,
+			      uint64_t count, struct bio **biop);
+
+struct block_device *amnesiafs_map_block(struct super_block *sb,
+					 uint64_t block, uint64_t *dev_block,
+					 unsigned int *run);
+
+uint64_t amnesiafs_volume_block(struct super_block *sb,
+				struct buffer_head *bh);
+
+struct buffer_head *amnesiafs_bread(struct super_block *sb, uint64_t block);
+
+struct buffer_head *amnesiafs_getblk(struct super_block *sb, uint64_t block);
+
+#endif